@@ -1,451 +1,616 @@
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
-#pragma pack(push, 1)
+#include "vsfs.h"
 
-typedef struct {
-    uint32_t magic;               
-    uint32_t version;             
-    uint32_t block_size;          
-    uint64_t total_blocks;       
-    uint64_t inode_count;         
-    uint64_t inode_bitmap_start;  
-    uint64_t inode_bitmap_blocks; 
-    uint64_t data_bitmap_start;   
-    uint64_t data_bitmap_blocks; 
-    uint64_t inode_table_start;   
-    uint64_t inode_table_blocks;  
-    uint64_t data_region_start;   
-    uint64_t data_region_blocks;  
-    uint64_t root_inode;          
-    uint64_t mtime_epoch;         
-    uint32_t flags;               
-    uint32_t checksum;           
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;                
-    uint16_t links;               
-    uint32_t uid;                
-    uint32_t gid;                 
-    uint64_t size_bytes;          
-    uint64_t atime;               
-    uint64_t mtime;              
-    uint64_t ctime;               
-    uint32_t direct[12];          
-    uint32_t reserved_0;          
-    uint32_t reserved_1;          
-    uint32_t reserved_2;          
-    uint32_t proj_id;             
-    uint32_t uid16_gid16;         
-    uint64_t xattr_ptr;           
-    uint64_t inode_crc;           
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;           
-    uint8_t type;                 
-    char name[58];                
-    uint8_t checksum;             
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
-    }
-}
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
+#define MAX_JOBS 256
+#define MAX_BATCH 4096
 
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+void print_usage(const char* program_name) {
+    printf("Usage: %s --input <input_image> (--output <output_image> | --in-place) [--file <filename>]... [--manifest <path>] [--dir <path>] [--mkdir <path>]... [--target <path>] [--remove <path>]... [--replace] [--jobs <n>] [--pack-small] [--dedup] [--compress <codec>] [--stats | --stats-json] [--verbose]\n", program_name);
+    printf("  --input: the name of the input image\n");
+    printf("  --output: name of the output image\n");
+    printf("  --in-place: modify the input image directly instead of writing a new one\n");
+    printf("  --file: a file to be added to the file system (may be repeated)\n");
+    printf("  --manifest: a text file listing one file to add per line\n");
+    printf("  --dir: add a directory tree, keeping its subdirectories\n");
+    printf("  --mkdir: create a directory and any missing parents (may be repeated)\n");
+    printf("  --target: directory in the image everything is added under, created if missing (default: /)\n");
+    printf("  --remove: a file or empty directory to delete, relative to the target (may be repeated)\n");
+    printf("  --replace: overwrite files that already exist instead of failing\n");
+    printf("  --jobs: number of threads copying file data (default: 1)\n");
+    printf("  --pack-small: store files of up to %u bytes in the inode or a shared tail block\n", VSFS_TAIL_MAX);
+    printf("  --dedup: share data blocks whose contents already exist in the image\n");
+    printf("  --compress: store files compressed with 'lz' (built in) or 'deflate' (zlib)\n");
+    printf("  --stats: print time per phase and I/O counters at the end\n");
+    printf("  --stats-json: the same as one line of JSON\n");
+    printf("  --verbose: report every file, inode and block run as it is allocated and written\n");
 }
 
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; 
+/*
+ * What to add: names[i] is a host file, stored as dests[i] relative to the
+ * target directory. A NULL name asks for the directory dests[i] itself.
+ */
+typedef struct {
+    char** names;
+    char** dests;
+    size_t count;
+    size_t cap;
+    size_t nfiles;
+} file_list_t;
+
+int file_list_push(file_list_t* list, const char* name, const char* dest) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 16;
+        char** names = realloc(list->names, cap * sizeof(char*));
+        if (names) list->names = names;
+        char** dests = realloc(list->dests, cap * sizeof(char*));
+        if (dests) list->dests = dests;
+        if (!names || !dests) return -1;
+        list->cap = cap;
+    }
+    if (!dest) {
+        const char* base = strrchr(name, '/');
+        dest = base ? base + 1 : name;
+    }
+    list->names[list->count] = name ? strdup(name) : NULL;
+    list->dests[list->count] = strdup(dest);
+    if ((name && !list->names[list->count]) || !list->dests[list->count]) {
+        free(list->names[list->count]);
+        free(list->dests[list->count]);
+        return -1;
+    }
+    list->nfiles += name != NULL;
+    list->count++;
+    return 0;
 }
 
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   
-    de->checksum = x;
+void file_list_free(file_list_t* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->names[i]);
+        free(list->dests[i]);
+    }
+    free(list->names);
+    free(list->dests);
+    list->names = list->dests = NULL;
+    list->count = list->cap = list->nfiles = 0;
 }
 
-void print_usage(const char* program_name) {
-    printf("Usage: %s --input <input_image> --output <output_image> --file <filename>\n", program_name);
-    printf("  --input: the name of the input image\n");
-    printf("  --output: name of the output image\n");
-    printf("  --file: the file to be added to the file system\n");
+int load_manifest(const char* manifest, file_list_t* list) {
+    FILE* f = fopen(manifest, "r");
+    if (!f) {
+        perror("Failed to open manifest");
+        return -1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+        if (file_list_push(list, line, NULL) != 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
 }
 
-int parse_args(int argc, char* argv[], char** input_name, char** output_name, char** file_name) {
-    if (argc != 7) {
+/* Queue a host directory tree; 'prefix' is where it lands, "" for the target itself. */
+int load_directory(const char* dir, const char* prefix, file_list_t* list) {
+    struct dirent** entries;
+    int n = scandir(dir, &entries, NULL, alphasort);
+    if (n < 0) {
+        perror("Failed to read directory");
         return -1;
     }
-    
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        char path[4096], dest[4096];
+        struct stat st;
+        const char* name = entries[i]->d_name;
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        snprintf(dest, sizeof(dest), "%s%s%s", prefix, *prefix ? "/" : "", name);
+        if (rc == 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && stat(path, &st) == 0) {
+            if (S_ISREG(st.st_mode)) {
+                if (file_list_push(list, path, dest) != 0) rc = -1;
+            } else if (S_ISDIR(st.st_mode)) {
+                /* The directory itself first, so empty ones are created too. */
+                if (file_list_push(list, NULL, dest) != 0 || load_directory(path, dest, list) != 0) rc = -1;
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return rc;
+}
+
+int parse_args(int argc, char* argv[], char** input_name, char** output_name, int* in_place, uint64_t* jobs,
+               int* pack_small, int* dedup, unsigned* codec, int* stats, int* verbose, char** target,
+               int* replace, file_list_t* files, file_list_t* removals) {
     for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "--in-place") == 0) {
+            *in_place = 1;
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "--pack-small") == 0) {
+            *pack_small = 1;
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "--dedup") == 0) {
+            *dedup = 1;
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "--replace") == 0) {
+            *replace = 1;
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats-json") == 0) {
+            *stats = strcmp(argv[i], "--stats") == 0 ? 1 : 2;
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "--verbose") == 0) {
+            *verbose = 1;
+            i--;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return -1;
+        }
         if (strcmp(argv[i], "--input") == 0) {
             *input_name = argv[i + 1];
         } else if (strcmp(argv[i], "--output") == 0) {
             *output_name = argv[i + 1];
         } else if (strcmp(argv[i], "--file") == 0) {
-            *file_name = argv[i + 1];
+            if (file_list_push(files, argv[i + 1], NULL) != 0) return -1;
+        } else if (strcmp(argv[i], "--manifest") == 0) {
+            if (load_manifest(argv[i + 1], files) != 0) return -1;
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            if (load_directory(argv[i + 1], "", files) != 0) return -1;
+        } else if (strcmp(argv[i], "--mkdir") == 0) {
+            if (file_list_push(files, NULL, argv[i + 1]) != 0) return -1;
+        } else if (strcmp(argv[i], "--remove") == 0) {
+            if (file_list_push(removals, NULL, argv[i + 1]) != 0) return -1;
+        } else if (strcmp(argv[i], "--target") == 0) {
+            *target = argv[i + 1];
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            char* end;
+            *jobs = strtoull(argv[i + 1], &end, 10);
+            if (*end != '\0' || *jobs == 0 || *jobs > MAX_JOBS) return -1;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            int c = vsfs_codec_parse(argv[i + 1]);
+            if (c < 0) return -1;
+            *codec = (unsigned)c;
         } else {
             return -1;
         }
     }
-    
-    if (*input_name == NULL || *output_name == NULL || *file_name == NULL) {
+
+    if (*input_name == NULL || files->count + removals->count == 0) {
+        return -1;
+    }
+    if ((*output_name == NULL) == !*in_place) {
         return -1;
     }
-    
+
     return 0;
 }
 
-uint64_t find_free_inode(FILE* img, superblock_t* sb) {
-    uint8_t bitmap[BS];
-    
-    fseek(img, sb->inode_bitmap_start * BS, SEEK_SET);
-    if (fread(bitmap, 1, BS, img) != BS) {
-        return 0; 
-    }
-    
-    for (uint64_t byte_idx = 0; byte_idx < BS; byte_idx++) {
-        for (int bit_idx = 0; bit_idx < 8; bit_idx++) {
-            uint64_t inode_num = byte_idx * 8 + bit_idx + 1; 
-            if (inode_num > sb->inode_count) {
-                return 0; 
-            }
-            
-            if (!(bitmap[byte_idx] & (1 << bit_idx))) {
-                bitmap[byte_idx] |= (1 << bit_idx);
-                
-                fseek(img, sb->inode_bitmap_start * BS, SEEK_SET);
-                fwrite(bitmap, 1, BS, img);
-                
-                return inode_num;
-            }
-        }
+static void report_add_error(vsfs_t* fs, const char* file_name, const char* name_on_disk, int rc) {
+    if (rc == -EFBIG) {
+        uint64_t max_blocks = vsfs_max_file_blocks(&fs->sb);
+        printf("Error: File too large. Maximum size is %llu bytes (%llu blocks)\n",
+               (unsigned long long)max_blocks * BS, (unsigned long long)max_blocks);
+    } else if (rc == -EEXIST) {
+        printf("Error: A file named '%s' already exists in the filesystem. Aborting.\n", name_on_disk);
+    } else if (rc == -ENOTDIR) {
+        printf("Error: A parent of '%s' is a file in the filesystem\n", name_on_disk);
+    } else if (rc == -EISDIR) {
+        printf("Error: '%s' is a directory in the filesystem\n", name_on_disk);
+    } else if (rc == -ENOSPC) {
+        printf("Error: No free inodes or data blocks available\n");
+    } else {
+        printf("Error: Failed to add '%s': %s\n", file_name, strerror(-rc));
     }
-    
-    return 0; 
 }
 
-uint64_t find_free_data_block(FILE* img, superblock_t* sb) {
-    uint8_t bitmap[BS];
+/* Resolve the directory part of dest below base, creating what is missing; *name points at the rest. */
+int resolve_parent(vsfs_t* fs, uint64_t base, const char* dest, uint64_t* dir_ino, const char** name) {
+    char dir[4096];
+    const char* slash = strrchr(dest, '/');
+    *name = slash ? slash + 1 : dest;
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - dest) : 0, dest);
+    int rc = vsfs_path_lookup(fs, base, dir, 1, dir_ino);
+    if (rc != 0) report_add_error(fs, dest, dest, rc);
+    return rc == 0 ? 0 : -1;
+}
 
-    fseek(img, sb->data_bitmap_start * BS, SEEK_SET);
-    if (fread(bitmap, 1, BS, img) != BS) {
-        return 0; 
+int make_directory(vsfs_t* fs, uint64_t base, const char* dest, uint64_t* ino) {
+    int rc = vsfs_path_lookup(fs, base, dest, 1, ino);
+    if (rc != 0) {
+        report_add_error(fs, dest, dest, rc);
+        return -1;
     }
+    return 0;
+}
 
-    for (uint64_t byte_idx = 0; byte_idx < BS; byte_idx++) {
-        for (int bit_idx = 0; bit_idx < 8; bit_idx++) {
-            uint64_t block_num = byte_idx * 8 + bit_idx;
-            if (block_num >= sb->data_region_blocks) {
-                return 0; 
-            }
-            if (!(bitmap[byte_idx] & (1 << bit_idx))) {
-                bitmap[byte_idx] |= (1 << bit_idx);
-                
-                fseek(img, sb->data_bitmap_start * BS, SEEK_SET);
-                fwrite(bitmap, 1, BS, img);
-                
-                return sb->data_region_start + block_num;
-            }
-        }
+/*
+ * With --replace, make room for a host file whose name is taken: rewrite
+ * the old file under its own inode when it can be (*done is set), otherwise
+ * unlink it so the file is added as new.
+ */
+int replace_existing(vsfs_t* fs, uint64_t dir_ino, const char* file_name, const char* name, int* done) {
+    uint64_t ino;
+    *done = 0;
+    /* A missing host file is reported by prepare_file(), before the old one is touched. */
+    if (access(file_name, F_OK) != 0) return 0;
+    int rc = vsfs_dir_lookup(fs, dir_ino, name, &ino);
+    if (rc == -ENOENT) return 0;
+    if (rc == 0) rc = vsfs_overwrite(fs, ino, file_name);
+    if (rc == 0) {
+        *done = 1;
+        return 0;
+    }
+    if (rc == -EOPNOTSUPP) rc = vsfs_unlink(fs, dir_ino, name);
+    if (rc != 0) {
+        report_add_error(fs, file_name, name, rc);
+        return -1;
     }
-    
-    return 0; 
+    return 0;
 }
 
-int file_exists_in_root(FILE* img, superblock_t* sb, const char* filename_sanitized, uint64_t* inode_out_opt) {
+int remove_path(vsfs_t* fs, uint64_t base, const char* dest) {
+    char dir[4096];
+    const char* slash = strrchr(dest, '/');
+    const char* name = slash ? slash + 1 : dest;
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - dest) : 0, dest);
+    uint64_t dir_ino;
+    int rc = vsfs_path_lookup(fs, base, dir, 0, &dir_ino);
+    if (rc == 0) rc = vsfs_unlink(fs, dir_ino, name);
+    if (rc == -ENOENT || rc == -EINVAL) {
+        printf("Error: '%s' not found in the filesystem\n", dest);
+    } else if (rc == -ENOTEMPTY) {
+        printf("Error: Directory '%s' is not empty\n", dest);
+    } else if (rc == -EBUSY) {
+        printf("Error: The root directory cannot be removed\n");
+    } else if (rc != 0) {
+        printf("Error: Failed to remove '%s': %s\n", dest, strerror(-rc));
+    }
+    return rc == 0 ? 0 : -1;
+}
 
-    inode_t root_inode;
-    fseek(img, (sb->inode_table_start * BS) + ((ROOT_INO - 1) * INODE_SIZE), SEEK_SET);
-    if (fread(&root_inode, sizeof(root_inode), 1, img) != 1) {
-        return -1; 
+/* Reserve an inode and data blocks for one host file in dir_ino; nothing is linked yet. */
+int prepare_file(vsfs_t* fs, uint64_t dir_ino, const char* file_name, const char* dest_name, vsfs_new_file_t* nf) {
+    if (access(file_name, F_OK) != 0) {
+        printf("Error: File to add '%s' does not exist\n", file_name);
+        return -1;
     }
 
-    if (root_inode.direct[0] == 0) {
-        return -1; 
+    struct stat file_stat;
+    if (stat(file_name, &file_stat) != 0) {
+        perror("Failed to get file stats");
+        return -1;
     }
 
-    uint8_t dir_block[BS];
-    fseek(img, root_inode.direct[0] * BS, SEEK_SET);
-    if (fread(dir_block, 1, BS, img) != BS) {
-        return -1; 
+    uint64_t blocks_needed = (file_stat.st_size + BS - 1) / BS;
+    if (fs->verbose) {
+        printf("Adding file: %s (size: %ld bytes, blocks needed: %lu)\n",
+               file_name, (long)file_stat.st_size, (unsigned long)blocks_needed);
     }
 
-    dirent64_t* entries = (dirent64_t*)dir_block;
-    int max_entries = BS / sizeof(dirent64_t);
+    char name_on_disk[58];
+    strncpy(name_on_disk, dest_name, 57);
+    name_on_disk[57] = '\0';
 
-    for (int i = 0; i < max_entries; i++) {
-        if (entries[i].inode_no != 0) {
-            if (strncmp(entries[i].name, filename_sanitized, 58) == 0) {
-                if (inode_out_opt) *inode_out_opt = entries[i].inode_no;
-                return 1; 
-            }
-        }
+    int rc = vsfs_add_prepare(fs, dir_ino, file_name, name_on_disk, nf);
+    if (rc != 0) {
+        report_add_error(fs, file_name, name_on_disk, rc);
+        return -1;
     }
-    return 0; 
+    return 0;
 }
 
-int add_to_root_directory(FILE* img, superblock_t* sb, const char* filename, uint64_t inode_num) {
-    inode_t root_inode;
-    fseek(img, (sb->inode_table_start * BS) + ((ROOT_INO - 1) * INODE_SIZE), SEEK_SET);
-    if (fread(&root_inode, sizeof(root_inode), 1, img) != 1) {
+int commit_file(vsfs_t* fs, uint64_t dir_ino, const char* file_name, vsfs_new_file_t* nf) {
+    int rc = vsfs_add_commit(fs, dir_ino, nf);
+    if (rc != 0) {
+        report_add_error(fs, file_name, nf->name, rc);
         return -1;
     }
-    
-    uint8_t dir_block[BS];
-    fseek(img, root_inode.direct[0] * BS, SEEK_SET);
-    if (fread(dir_block, 1, BS, img) != BS) {
-        return -1; 
-    }
-    
-    dirent64_t* entries = (dirent64_t*)dir_block;
-    int max_entries = BS / sizeof(dirent64_t);
-    
-    for (int i = 0; i < max_entries; i++) {
-        if (entries[i].inode_no == 0) {
-            entries[i].inode_no = (uint32_t)inode_num;
-            entries[i].type = 1; // file
-            strncpy(entries[i].name, filename, 57);
-            entries[i].name[57] = '\0';
-            dirent_checksum_finalize(&entries[i]);
-
-            root_inode.size_bytes += sizeof(dirent64_t);
-            root_inode.links++;
-            root_inode.mtime = time(NULL);
-            inode_crc_finalize(&root_inode);
-
-            fseek(img, (sb->inode_table_start * BS) + ((ROOT_INO - 1) * INODE_SIZE), SEEK_SET);
-            fwrite(&root_inode, sizeof(root_inode), 1, img);
-
-            fseek(img, root_inode.direct[0] * BS, SEEK_SET);
-            fwrite(dir_block, 1, BS, img);
-            
-            return 0; 
+    if (fs->verbose) printf("Added directory entry: %s -> inode %lu\n", nf->name, (unsigned long)nf->ino);
+    return 0;
+}
+
+int add_file(vsfs_t* fs, uint64_t base, const char* file_name, const char* dest, int replace) {
+    vsfs_new_file_t nf;
+    uint64_t dir_ino;
+    const char* name;
+    int done = 0;
+    if (!file_name) return make_directory(fs, base, dest, &dir_ino);
+    if (resolve_parent(fs, base, dest, &dir_ino, &name) != 0) return -1;
+    if (replace && replace_existing(fs, dir_ino, file_name, name, &done) != 0) return -1;
+    if (done) return 0;
+    if (prepare_file(fs, dir_ino, file_name, name, &nf) != 0) return -1;
+    int rc = vsfs_add_copy(fs, &nf);
+    if (rc != 0) {
+        report_add_error(fs, file_name, nf.name, rc);
+    } else {
+        rc = commit_file(fs, dir_ino, file_name, &nf);
+    }
+    vsfs_add_abort(fs, &nf);
+    return rc == 0 ? 0 : -1;
+}
+
+typedef struct {
+    vsfs_t* fs;
+    vsfs_new_file_t* files;
+    int* rcs;                     /* per file, so the files before a failed copy can still be committed */
+    uint64_t count;
+    uint64_t next;                /* next file to copy, shared by the workers */
+} copy_pool_t;
+
+static void* copy_worker(void* arg) {
+    copy_pool_t* pool = arg;
+    for (;;) {
+        uint64_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->count) break;
+        if (pool->files[i].src_fd < 0) continue;   /* a directory, or a file overwritten in place */
+        pool->rcs[i] = vsfs_add_copy(pool->fs, &pool->files[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Add 'count' files with payload copies spread over 'jobs' threads. Inodes and
+ * blocks are reserved on this thread first: the in-memory allocator costs
+ * microseconds per file and keeps the layout identical to a serial run, so
+ * only the copies, which dominate, run concurrently. Directory entries are
+ * inserted afterwards in list order; directories are created while preparing.
+ * As in a serial run, a failure leaves the files before it committed; *done
+ * is set to how many entries that is.
+ */
+int add_files_parallel(vsfs_t* fs, uint64_t base, char** names, char** dests, uint64_t count, uint64_t jobs,
+                       int replace, uint64_t* done) {
+    vsfs_new_file_t* files = calloc(count, sizeof(*files));
+    uint64_t* dirs = calloc(count, sizeof(uint64_t));
+    int* rcs = calloc(count, sizeof(int));
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    int* spawned = calloc(jobs, sizeof(int));
+    if (!files || !dirs || !rcs || !threads || !spawned) {
+        printf("Error: Out of memory\n");
+        free(files);
+        free(dirs);
+        free(rcs);
+        free(threads);
+        free(spawned);
+        return -1;
+    }
+
+    int rc = 0;
+    uint64_t prepared = 0;
+    for (; prepared < count; prepared++) {
+        const char* name;
+        int done = 0;
+        files[prepared].src_fd = -1;
+        if (!names[prepared]) {
+            if (make_directory(fs, base, dests[prepared], &dirs[prepared]) != 0) break;
+            continue;
+        }
+        if (resolve_parent(fs, base, dests[prepared], &dirs[prepared], &name) != 0) break;
+        if (replace && replace_existing(fs, dirs[prepared], names[prepared], name, &done) != 0) break;
+        if (!done && prepare_file(fs, dirs[prepared], names[prepared], name, &files[prepared]) != 0) break;
+    }
+    if (prepared < count) rc = -1;
+    *done = prepared;
+
+    if (prepared > 0) {
+        copy_pool_t pool = { .fs = fs, .files = files, .rcs = rcs, .count = prepared };
+        if (jobs > prepared) jobs = prepared;
+        /* This thread is worker 0 and also covers any thread that fails to start. */
+        for (uint64_t t = 1; t < jobs; t++) {
+            spawned[t] = pthread_create(&threads[t], NULL, copy_worker, &pool) == 0;
+        }
+        copy_worker(&pool);
+        for (uint64_t t = 1; t < jobs; t++) {
+            if (spawned[t]) pthread_join(threads[t], NULL);
         }
     }
-    
-    return -1; 
+
+    for (uint64_t i = 0; i < prepared; i++) {
+        if (rcs[i] != 0) {
+            report_add_error(fs, names[i], files[i].name, rcs[i]);
+            rc = -1;
+            *done = i;
+            break;
+        }
+        if (files[i].src_fd >= 0 && commit_file(fs, dirs[i], names[i], &files[i]) != 0) {
+            rc = -1;
+            *done = i;
+            break;
+        }
+    }
+    for (uint64_t i = 0; i < prepared; i++) vsfs_add_abort(fs, &files[i]);
+    free(files);
+    free(dirs);
+    free(rcs);
+    free(threads);
+    free(spawned);
+    return rc;
 }
 
 int main(int argc, char* argv[]) {
-    (void)&superblock_crc_finalize;
     char* input_name = NULL;
     char* output_name = NULL;
-    char* file_name = NULL;
-    
-    if (parse_args(argc, argv, &input_name, &output_name, &file_name) != 0) {
+    int in_place = 0;
+    int pack_small = 0;
+    int dedup = 0;
+    unsigned codec = VSFS_CODEC_NONE;
+    int stats = 0;
+    int verbose = 0;
+    uint64_t jobs = 1;
+    char* target = "";
+    int replace = 0;
+    file_list_t files = {0};
+    file_list_t removals = {0};
+
+    if (parse_args(argc, argv, &input_name, &output_name, &in_place, &jobs, &pack_small, &dedup, &codec, &stats, &verbose, &target,
+                   &replace, &files, &removals) != 0) {
         print_usage(argv[0]);
+        file_list_free(&files);
+        file_list_free(&removals);
         return 1;
     }
-    
+    if (codec != VSFS_CODEC_NONE && !vsfs_codec_available(codec)) {
+        printf("Error: This build does not support the '%s' codec\n", vsfs_codec_name(codec));
+        file_list_free(&files);
+        file_list_free(&removals);
+        return 1;
+    }
+
     crc32_init();
-    
+
     if (access(input_name, F_OK) != 0) {
         printf("Error: Input image file '%s' does not exist\n", input_name);
+        file_list_free(&files);
+        file_list_free(&removals);
         return 1;
     }
-    
-    if (access(file_name, F_OK) != 0) {
-        printf("Error: File to add '%s' does not exist\n", file_name);
-        return 1;
-    }
-    
-    struct stat file_stat;
-    if (stat(file_name, &file_stat) != 0) {
-        perror("Failed to get file stats");
+
+    uint64_t start_ns = vsfs_now_ns();
+    int rc;
+    if (in_place) {
+        output_name = input_name;
+    } else if ((rc = vsfs_clone_image(input_name, output_name)) != 0) {
+        printf("Error: Failed to copy '%s' to '%s': %s\n", input_name, output_name, strerror(-rc));
+        file_list_free(&files);
+        file_list_free(&removals);
         return 1;
     }
-    
-    uint64_t blocks_needed = (file_stat.st_size + BS - 1) / BS;
-    if (blocks_needed > DIRECT_MAX) {
-        printf("Error: File too large. Maximum size is %u bytes (%d blocks)\n", 
-               DIRECT_MAX * BS, DIRECT_MAX);
+    uint64_t clone_ns = vsfs_now_ns() - start_ns;
+
+    vsfs_t fs;
+    rc = vsfs_open(&fs, output_name, VSFS_OPEN_RDWR);
+    if (rc != 0 && !in_place) unlink(output_name);
+    if (rc == -EINVAL) {
+        printf("Error: Invalid filesystem magic number\n");
+        file_list_free(&files);
+        file_list_free(&removals);
         return 1;
     }
-    
-    printf("Adding file: %s (size: %ld bytes, blocks needed: %lu)\n", 
-           file_name, (long)file_stat.st_size, (unsigned long)blocks_needed);
-    
-    FILE* input = fopen(input_name, "rb");
-    FILE* output = fopen(output_name, "wb");
-    if (!input || !output) {
-        perror("Failed to open files");
-        if (input) fclose(input);
-        if (output) fclose(output);
+    if (rc == -EUCLEAN) {
+        printf("Error: Superblock layout is inconsistent (journal or bitmap size); run mkfs_check\n");
+        file_list_free(&files);
+        file_list_free(&removals);
         return 1;
     }
-    
-    uint8_t buffer[BS];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, BS, input)) > 0) {
-        fwrite(buffer, 1, bytes_read, output);
-    }
-    fclose(input);
-    fclose(output);
-    
-    output = fopen(output_name, "r+b");
-    if (!output) {
-        perror("Failed to reopen output file");
+    if (rc == -EPROTONOSUPPORT) {
+        printf("Error: Unsupported filesystem version or features\n");
+        file_list_free(&files);
+        file_list_free(&removals);
         return 1;
     }
-    
-    superblock_t sb;
-    fseek(output, 0, SEEK_SET);
-    size_t sb_bytes_read = fread(&sb, 1, sizeof(sb), output);
-    if (sb_bytes_read != sizeof(sb)) {
-        printf("Error: Failed to read superblock (read %zu bytes, expected %zu)\n", sb_bytes_read, sizeof(sb));
-        printf("File position: %ld\n", ftell(output));
-        fclose(output);
+    if (rc != 0) {
+        printf("Error: Failed to open output image: %s\n", strerror(-rc));
+        file_list_free(&files);
+        file_list_free(&removals);
         return 1;
     }
-    
-    printf("Read superblock: magic=0x%08X, size=%zu bytes\n", sb.magic, sizeof(sb));
-    
-    if (sb.magic != 0x4D565346) {
-        printf("Error: Invalid filesystem magic number\n");
-        fclose(output);
-        return 1;
+    fs.stats.phase_ns[VSFS_PHASE_CLONE] = clone_ns;
+    fs.verbose = verbose;
+    fs.pack_small = pack_small;
+    fs.compress = codec;
+    if (dedup && (rc = vsfs_dedup_load(&fs)) != 0) {
+        printf("Error: Failed to index existing data blocks: %s\n", strerror(-rc));
+        rc = 1;
+        goto out;
+    }
+    if (verbose) {
+        printf("Read superblock: magic=0x%08X, size=%zu bytes\n", fs.sb.magic, sizeof(fs.sb));
+        printf("Filesystem info:\n");
+        printf("  Total blocks: %lu\n", (unsigned long)fs.sb.total_blocks);
+        printf("  Inodes: %lu\n", (unsigned long)fs.sb.inode_count);
+        printf("  Data region start: %lu\n", (unsigned long)fs.sb.data_region_start);
     }
-    
-    printf("Filesystem info:\n");
-    printf("  Total blocks: %lu\n", (unsigned long)sb.total_blocks);
-    printf("  Inodes: %lu\n", (unsigned long)sb.inode_count);
-    printf("  Data region start: %lu\n", (unsigned long)sb.data_region_start);
 
-    const char* base = strrchr(file_name, '/');
-    const char* basename = base ? base + 1 : file_name;
-    char name_on_disk[58];
-    strncpy(name_on_disk, basename, 57);
-    name_on_disk[57] = '\0';
+    uint64_t base;
+    rc = 1;
+    if (make_directory(&fs, ROOT_INO, target, &base) != 0) goto out;
 
-    int exists = file_exists_in_root(output, &sb, name_on_disk, NULL);
-    if (exists < 0) {
-        printf("Error: Failed to read root directory to check duplicates\n");
-        fclose(output);
-        return 1;
-    }
-    if (exists == 1) {
-        printf("Error: A file named '%s' already exists in the root directory. Aborting.\n", name_on_disk);
-        fclose(output);
-        return 1;
-    }
-    
-    uint64_t free_inode = find_free_inode(output, &sb);
-    if (free_inode == 0) {
-        printf("Error: No free inodes available\n");
-        fclose(output);
-        return 1;
-    }
-    
-    printf("Allocated inode: %lu\n", (unsigned long)free_inode);
-    
-    uint32_t data_blocks[DIRECT_MAX] = {0};
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        uint64_t block = find_free_data_block(output, &sb);
-        if (block == 0) {
-            printf("Error: No free data blocks available\n");
-            fclose(output);
-            return 1;
+    /*
+     * On journalled images everything goes out as one transaction when it
+     * fits; a batch whose metadata outgrows the journal is committed in
+     * several, each leaving a consistent image behind.
+     */
+    uint64_t txn_capacity = vsfs_journal_txn_capacity(&fs.sb);
+    /* A parallel batch dirties at most a few metadata blocks per file. */
+    uint64_t batch = jobs > 1 ? (txn_capacity ? txn_capacity / 4 : MAX_BATCH) : 1;
+    if (batch < 1) batch = 1;
+    if (batch > MAX_BATCH) batch = MAX_BATCH;
+    /* Removals go first, so a path can be removed and added back in one run. */
+    for (size_t i = 0; i < removals.count; i++) {
+        if (txn_capacity && vsfs_dirty_blocks(&fs) * 2 > txn_capacity && vsfs_flush(&fs) != 0) {
+            printf("Error: Failed to write filesystem metadata\n");
+            goto out;
         }
-        data_blocks[i] = (uint32_t)block;
-        printf("Allocated data block: %lu\n", (unsigned long)block);
-    }
-    
-    inode_t new_inode = {0};
-    new_inode.mode = 0100000;  
-    new_inode.links = 1;
-    new_inode.uid = 0;
-    new_inode.gid = 0;
-    new_inode.size_bytes = (uint64_t)file_stat.st_size;
-    new_inode.atime = time(NULL);
-    new_inode.mtime = (uint64_t)file_stat.st_mtime;
-    new_inode.ctime = time(NULL);
-    
-    for (int i = 0; i < DIRECT_MAX; i++) {
-        new_inode.direct[i] = data_blocks[i];
-    }
-    
-    new_inode.reserved_0 = 0;
-    new_inode.reserved_1 = 0;
-    new_inode.reserved_2 = 0;
-    new_inode.proj_id = 13;  
-    new_inode.uid16_gid16 = 0;
-    new_inode.xattr_ptr = 0;
-    
-    inode_crc_finalize(&new_inode);
-    
-    fseek(output, (sb.inode_table_start * BS) + ((free_inode - 1) * INODE_SIZE), SEEK_SET);
-    fwrite(&new_inode, sizeof(new_inode), 1, output);
-    
-    FILE* file_to_add = fopen(file_name, "rb");
-    if (!file_to_add) {
-        perror("Failed to open file to add");
-        fclose(output);
-        return 1;
+        if (remove_path(&fs, base, removals.dests[i]) != 0) goto out;
     }
-    
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        uint8_t file_block[BS] = {0};
-        size_t r = fread(file_block, 1, BS, file_to_add);
-        if (r == 0 && ferror(file_to_add)) {
-            perror("Failed to read from file to add");
-            fclose(file_to_add);
-            fclose(output);
-            return 1;
+    for (size_t i = 0; i < files.count; i += batch) {
+        if (txn_capacity && vsfs_dirty_blocks(&fs) * 2 > txn_capacity && vsfs_flush(&fs) != 0) {
+            printf("Error: Failed to write filesystem metadata\n");
+            goto out;
+        }
+        uint64_t n = files.count - i < batch ? files.count - i : batch;
+        uint64_t done = 0;
+        int err = jobs > 1 ? add_files_parallel(&fs, base, files.names + i, files.dests + i, n, jobs, replace, &done)
+                           : add_file(&fs, base, files.names[i], files.dests[i], replace);
+        if (err != 0) {
+            /* A new output image is removed below; in place, the files before the failing one are committed. */
+            if (!in_place) goto out;
+            size_t failed = i + done, added = 0;
+            for (size_t j = 0; j < failed; j++) added += files.names[j] != NULL;
+            if (vsfs_flush(&fs) != 0) {
+                printf("Error: Failed to write filesystem metadata\n");
+            } else {
+                printf("Note: %zu file(s) before '%s' were added to '%s'; it and the entries after it were not\n",
+                       added, files.names[failed] ? files.names[failed] : files.dests[failed], output_name);
+            }
+            goto out;
         }
-        fseek(output, (long long)data_blocks[i] * BS, SEEK_SET);
-        fwrite(file_block, 1, BS, output);
-        
-        printf("Written %zu bytes to block %u\n", r, data_blocks[i]);
-    }
-    fclose(file_to_add);
-    
-    if (add_to_root_directory(output, &sb, name_on_disk, free_inode) != 0) {
-        printf("Error: Failed to add directory entry\n");
-        fclose(output);
-        return 1;
     }
-    
-    printf("Added directory entry: %s -> inode %lu\n", name_on_disk, (unsigned long)free_inode);
 
-    fclose(output);
-    printf("File '%s' successfully added to the filesystem image '%s'\n", name_on_disk, output_name);
-    return 0;
-}
\ No newline at end of file
+    if (vsfs_flush(&fs) != 0) {
+        printf("Error: Failed to write filesystem metadata\n");
+        goto out;
+    }
+
+    if (removals.count) printf("%zu path(s) removed from the filesystem image '%s'\n", removals.count, output_name);
+    if (files.count) printf("%zu file(s) successfully added to the filesystem image '%s'\n", files.nfiles, output_name);
+    if (stats) vsfs_stats_print(&fs.stats, "mkfs_adder", vsfs_now_ns() - start_ns, stats == 2);
+    rc = 0;
+
+out:
+    if (vsfs_close(&fs) != 0 && rc == 0) {
+        perror("Failed to close output image");
+        rc = 1;
+    }
+    if (rc != 0 && !in_place) {
+        unlink(output_name);
+        printf("Note: the incomplete output image '%s' was removed\n", output_name);
+    }
+    file_list_free(&files);
+    file_list_free(&removals);
+    return rc;
+}
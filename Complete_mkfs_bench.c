@@ -0,0 +1,431 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#define MAX_REPEAT 100
+#define INODE_BYTES 128ull            /* on-disk inode size, to skip builder grids whose table cannot fit */
+#define MAX_ARGS 32
+
+/* One measured configuration: wall time over the repeats, peak RSS over all of them. */
+typedef struct {
+    double seconds;               /* median */
+    double seconds_min;
+    double user_s;                /* of the median run */
+    double sys_s;
+    uint64_t max_rss_kib;
+    uint64_t blocks_in;
+    uint64_t blocks_out;
+    uint64_t syscalls;            /* from a separate traced run, 0 if not counted */
+} result_t;
+
+typedef struct {
+    uint64_t files;
+    uint64_t file_bytes;
+} file_set_t;
+
+static const uint64_t BUILDER_SIZES_KIB[] = { 16384, 262144, 1048576, 4194304 };
+static const uint64_t BUILDER_INODES[] = { 1024, 65536, 1048576 };
+static const file_set_t ADDER_SETS[] = { { 1, 64 << 20 }, { 100, 1 << 20 }, { 1000, 64 << 10 }, { 10000, 4096 } };
+static const file_set_t ADDER_SETS_QUICK[] = { { 1, 8 << 20 }, { 100, 64 << 10 }, { 1000, 4096 } };
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [--tools <dir>] [--work <dir>] [--output <file>] [--repeat <n>] [--adder-args <args>] "
+           "[--quick | --full] [--no-syscalls]\n", program_name);
+    printf("  --tools: directory holding mkfs_builder and mkfs_adder (default: .)\n");
+    printf("  --work: scratch directory for images and file sets (default: a new directory in /tmp)\n");
+    printf("  --output: file to write JSON lines to (default: stdout)\n");
+    printf("  --repeat: timed runs per configuration; the median is reported (default: 3)\n");
+    printf("  --adder-args: extra options passed to every mkfs_adder run, e.g. \"--jobs 4\"\n");
+    printf("  --quick: smaller images and file sets, for a fast sanity run (the default)\n");
+    printf("  --full: every image size, inode count and file set (what make bench runs)\n");
+    printf("  --no-syscalls: skip the extra traced run that counts system calls\n");
+}
+
+int parse_args(int argc, char* argv[], char** tools, char** work, char** output, uint64_t* repeat,
+               char** adder_args, int* quick, int* count_syscalls) {
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "--quick") == 0 || strcmp(argv[i], "--full") == 0) {
+            *quick = strcmp(argv[i], "--quick") == 0;
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "--no-syscalls") == 0) {
+            *count_syscalls = 0;
+            i--;
+            continue;
+        }
+        if (i + 1 >= argc) return -1;
+        if (strcmp(argv[i], "--tools") == 0) {
+            *tools = argv[i + 1];
+        } else if (strcmp(argv[i], "--work") == 0) {
+            *work = argv[i + 1];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            *output = argv[i + 1];
+        } else if (strcmp(argv[i], "--adder-args") == 0) {
+            *adder_args = argv[i + 1];
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            char* end;
+            *repeat = strtoull(argv[i + 1], &end, 10);
+            if (*end != '\0' || *repeat == 0 || *repeat > MAX_REPEAT) return -1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* In the child: silence the tool's per-file output, which would otherwise be part of the measurement. */
+static void child_redirect(void) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+}
+
+/* Run argv to completion; wall time from the parent, CPU time, peak RSS and block I/O from wait4(). */
+static int run_once(char* const argv[], double* seconds, struct rusage* ru) {
+    double t0 = now();
+    pid_t pid = fork();
+    if (pid < 0) return -errno;
+    if (pid == 0) {
+        child_redirect();
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if (wait4(pid, &status, 0, ru) < 0) return -errno;
+    *seconds = now() - t0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -ECHILD;
+}
+
+/*
+ * Run argv once more under ptrace and count system calls, following every
+ * thread it creates. Each call stops twice (entry and exit). Tracing slows
+ * the tool down a lot, so this run is never timed.
+ */
+static int count_syscalls(char* const argv[], uint64_t* count) {
+    pid_t pid = fork();
+    if (pid < 0) return -errno;
+    if (pid == 0) {
+        child_redirect();
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0) _exit(127);
+        raise(SIGSTOP);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) return -ECHILD;
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)options) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -errno;
+    }
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    uint64_t stops = 0;
+    int rc = -ECHILD;
+    for (;;) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) break;
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) rc = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -ECHILD;
+            continue;
+        }
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops++;
+            sig = 0;
+        } else if (sig == SIGTRAP || sig == SIGSTOP) {
+            sig = 0;              /* exec, clone events and the initial stop of new threads */
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void*)(long)sig);
+    }
+    *count = (stops + 1) / 2;
+    return rc;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double tv_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Time 'repeat' runs of argv; 'reset' (if set) runs before each one and is not timed. */
+static int measure(char* const argv[], uint64_t repeat, int syscalls, void (*reset)(void*), void* arg, result_t* r) {
+    double times[MAX_REPEAT];
+    struct rusage usage[MAX_REPEAT];
+    memset(r, 0, sizeof(*r));
+    for (uint64_t i = 0; i < repeat; i++) {
+        if (reset) reset(arg);
+        int rc = run_once(argv, &times[i], &usage[i]);
+        if (rc != 0) return rc;
+        if ((uint64_t)usage[i].ru_maxrss > r->max_rss_kib) r->max_rss_kib = (uint64_t)usage[i].ru_maxrss;
+    }
+    double sorted[MAX_REPEAT];
+    memcpy(sorted, times, repeat * sizeof(double));
+    qsort(sorted, repeat, sizeof(double), cmp_double);
+    r->seconds = sorted[repeat / 2];
+    r->seconds_min = sorted[0];
+    for (uint64_t i = 0; i < repeat; i++) {
+        if (times[i] != r->seconds) continue;
+        r->user_s = tv_seconds(usage[i].ru_utime);
+        r->sys_s = tv_seconds(usage[i].ru_stime);
+        r->blocks_in = (uint64_t)usage[i].ru_inblock;
+        r->blocks_out = (uint64_t)usage[i].ru_oublock;
+        break;
+    }
+    if (syscalls) {
+        if (reset) reset(arg);
+        return count_syscalls(argv, &r->syscalls);
+    }
+    return 0;
+}
+
+/* A JSON string literal; only '"', '\\' and control characters need escaping. */
+static void print_json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void print_result(FILE* out, const result_t* r) {
+    fprintf(out, "\"seconds\":%.6f,\"seconds_min\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,\"max_rss_kib\":%llu,"
+            "\"blocks_in\":%llu,\"blocks_out\":%llu,\"syscalls\":%llu}\n",
+            r->seconds, r->seconds_min, r->user_s, r->sys_s, (unsigned long long)r->max_rss_kib,
+            (unsigned long long)r->blocks_in, (unsigned long long)r->blocks_out, (unsigned long long)r->syscalls);
+    fflush(out);
+}
+
+/* Deterministic file contents: words from a small alphabet, so compressors have something to find. */
+static int write_file_set(const char* dir, const file_set_t* set) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -errno;
+    uint8_t* buf = malloc(set->file_bytes ? set->file_bytes : 1);
+    if (!buf) return -ENOMEM;
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    int rc = 0;
+    for (uint64_t f = 0; f < set->files && rc == 0; f++) {
+        for (uint64_t i = 0; i < set->file_bytes; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            buf[i] = (x & 7) == 0 ? ' ' : (uint8_t)('a' + (x >> 8) % 16);
+        }
+        char path[4096 + 32];
+        snprintf(path, sizeof(path), "%s/f_%06llu", dir, (unsigned long long)f);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            rc = -errno;
+            break;
+        }
+        for (uint64_t done = 0; done < set->file_bytes; ) {
+            ssize_t n = write(fd, buf + done, set->file_bytes - done);
+            if (n <= 0) {
+                rc = -EIO;
+                break;
+            }
+            done += (uint64_t)n;
+        }
+        close(fd);
+    }
+    free(buf);
+    return rc;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void remove_file(void* path) {
+    unlink(path);
+}
+
+/* Split 'args' on spaces into argv starting at argv[n]; returns the new count. */
+static int append_args(char** argv, int n, char* args) {
+    for (char* tok = strtok(args, " "); tok && n < MAX_ARGS - 1; tok = strtok(NULL, " ")) argv[n++] = tok;
+    argv[n] = NULL;
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    char* tools = ".";
+    char* work = NULL;
+    char* output = NULL;
+    char* adder_args = "";
+    uint64_t repeat = 3;
+    int quick = 1;
+    int syscalls = 1;
+
+    if (parse_args(argc, argv, &tools, &work, &output, &repeat, &adder_args, &quick, &syscalls) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    char builder[4096], adder[4096];
+    snprintf(builder, sizeof(builder), "%s/mkfs_builder", tools);
+    snprintf(adder, sizeof(adder), "%s/mkfs_adder", tools);
+    if (access(builder, X_OK) != 0 || access(adder, X_OK) != 0) {
+        printf("Error: mkfs_builder and mkfs_adder not found in '%s'\n", tools);
+        return 1;
+    }
+
+    char work_buf[] = "/tmp/vsfs-bench-XXXXXX";
+    int own_work = work == NULL;
+    if (own_work && !(work = mkdtemp(work_buf))) {
+        perror("Failed to create work directory");
+        return 1;
+    }
+    if (!own_work && mkdir(work, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create work directory");
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        perror("Failed to open output file");
+        return 1;
+    }
+
+    struct utsname uts;
+    uname(&uts);
+    fprintf(out, "{\"bench\":\"meta\",\"time\":%lld,\"kernel\":", (long long)time(NULL));
+    print_json_string(out, uts.release);
+    fprintf(out, ",\"machine\":");
+    print_json_string(out, uts.machine);
+    fprintf(out, ",\"cpus\":%ld,\"repeat\":%llu,\"quick\":%d,\"adder_args\":", sysconf(_SC_NPROCESSORS_ONLN),
+            (unsigned long long)repeat, quick);
+    print_json_string(out, adder_args);
+    fprintf(out, "}\n");
+
+    int failed = 0;
+    char image[4096];
+    snprintf(image, sizeof(image), "%s/bench.img", work);
+
+    /* mkfs_builder across image sizes and inode counts. */
+    uint64_t nsizes = quick ? 2 : sizeof(BUILDER_SIZES_KIB) / sizeof(BUILDER_SIZES_KIB[0]);
+    uint64_t ninodes = quick ? 2 : sizeof(BUILDER_INODES) / sizeof(BUILDER_INODES[0]);
+    for (uint64_t s = 0; s < nsizes; s++) {
+        for (uint64_t n = 0; n < ninodes; n++) {
+            /* An inode table as large as the image leaves no room for anything else; mkfs_builder refuses it. */
+            if (BUILDER_INODES[n] * INODE_BYTES >= BUILDER_SIZES_KIB[s] * 1024) continue;
+            char size_arg[32], inodes_arg[32];
+            snprintf(size_arg, sizeof(size_arg), "%llu", (unsigned long long)BUILDER_SIZES_KIB[s]);
+            snprintf(inodes_arg, sizeof(inodes_arg), "%llu", (unsigned long long)BUILDER_INODES[n]);
+            char* run_argv[] = { builder, "--image", image, "--size-kib", size_arg, "--inodes", inodes_arg, NULL };
+            fprintf(stderr, "builder: %s KiB, %s inodes\n", size_arg, inodes_arg);
+
+            result_t r;
+            if (measure(run_argv, repeat, syscalls, remove_file, image, &r) != 0) {
+                fprintf(stderr, "Error: mkfs_builder failed for %s KiB, %s inodes\n", size_arg, inodes_arg);
+                failed++;
+                continue;
+            }
+            fprintf(out, "{\"bench\":\"builder\",\"size_kib\":%s,\"inodes\":%s,", size_arg, inodes_arg);
+            print_result(out, &r);
+        }
+    }
+
+    /* mkfs_adder adding whole file sets to a fresh image; the base image is cloned by each run. */
+    const file_set_t* sets = quick ? ADDER_SETS_QUICK : ADDER_SETS;
+    uint64_t nsets = quick ? sizeof(ADDER_SETS_QUICK) / sizeof(ADDER_SETS_QUICK[0])
+                           : sizeof(ADDER_SETS) / sizeof(ADDER_SETS[0]);
+    char output_image[4096];
+    snprintf(output_image, sizeof(output_image), "%s/bench_out.img", work);
+    for (uint64_t i = 0; i < nsets; i++) {
+        const file_set_t* set = &sets[i];
+        uint64_t total = set->files * set->file_bytes;
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%s/set_%llu_%llu", work, (unsigned long long)set->files,
+                 (unsigned long long)set->file_bytes);
+        fprintf(stderr, "adder: %llu files of %llu bytes\n", (unsigned long long)set->files,
+                (unsigned long long)set->file_bytes);
+        if (write_file_set(dir, set) != 0) {
+            fprintf(stderr, "Error: Failed to generate the file set in '%s'\n", dir);
+            failed++;
+            continue;
+        }
+
+        /* Room for the data plus index blocks and the journal, and an inode per file. */
+        char size_arg[32], inodes_arg[32];
+        uint64_t size_kib = ((total + total / 4) / 1024 + 65536 + 3) & ~3ull;
+        uint64_t inodes = set->files + 128 < 1024 ? 1024 : set->files + 128;
+        snprintf(size_arg, sizeof(size_arg), "%llu", (unsigned long long)size_kib);
+        snprintf(inodes_arg, sizeof(inodes_arg), "%llu", (unsigned long long)inodes);
+        char* build_argv[] = { builder, "--image", image, "--size-kib", size_arg, "--inodes", inodes_arg, NULL };
+        double ignored;
+        struct rusage ru;
+        unlink(image);
+        if (run_once(build_argv, &ignored, &ru) != 0) {
+            fprintf(stderr, "Error: mkfs_builder failed for the adder image\n");
+            failed++;
+            continue;
+        }
+
+        char extra[1024];
+        snprintf(extra, sizeof(extra), "%s", adder_args);
+        char* run_argv[MAX_ARGS] = { adder, "--input", image, "--output", output_image, "--dir", dir };
+        append_args(run_argv, 7, extra);
+        result_t r;
+        if (measure(run_argv, repeat, syscalls, remove_file, output_image, &r) != 0) {
+            fprintf(stderr, "Error: mkfs_adder failed for %llu files of %llu bytes\n",
+                    (unsigned long long)set->files, (unsigned long long)set->file_bytes);
+            failed++;
+        } else {
+            double secs = r.seconds > 0 ? r.seconds : 1e-9;
+            fprintf(out, "{\"bench\":\"adder\",\"files\":%llu,\"file_bytes\":%llu,\"total_bytes\":%llu,"
+                    "\"files_per_s\":%.1f,\"mib_per_s\":%.2f,", (unsigned long long)set->files,
+                    (unsigned long long)set->file_bytes, (unsigned long long)total, set->files / secs,
+                    total / 1048576.0 / secs);
+            print_result(out, &r);
+        }
+        nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        unlink(output_image);
+    }
+
+    unlink(image);
+    if (own_work) rmdir(work);
+    if (out != stdout) fclose(out);
+    if (failed) {
+        printf("Error: %d benchmark(s) failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -1,4 +1,5 @@
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,269 +9,708 @@
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
-#define BS 4096u           
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
+#include "vsfs.h"
 
-uint64_t g_random_seed = 0; 
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;              
-    uint32_t version;             
-    uint32_t block_size;          
-    uint64_t total_blocks;        
-    uint64_t inode_count;         
-    uint64_t inode_bitmap_start;  
-    uint64_t inode_bitmap_blocks; 
-    uint64_t data_bitmap_start;   
-    uint64_t data_bitmap_blocks;  
-    uint64_t inode_table_start;   
-    uint64_t inode_table_blocks;  
-    uint64_t data_region_start;   
-    uint64_t data_region_blocks;  
-    uint64_t root_inode;          
-    uint64_t mtime_epoch;         
-    uint32_t flags;               
-    uint32_t checksum;            
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;                
-    uint16_t links;               
-    uint32_t uid;                 
-    uint32_t gid;                 
-    uint64_t size_bytes;         
-    uint64_t atime;              
-    uint64_t mtime;               
-    uint64_t ctime;               
-    uint32_t direct[12];          
-    uint32_t reserved_0;         
-    uint32_t reserved_1;          
-    uint32_t reserved_2;          
-    uint32_t proj_id;             
-    uint32_t uid16_gid16;         
-    uint64_t xattr_ptr;           
-    uint64_t inode_crc;           
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;            
-    uint8_t type;                 
-    char name[58];                
-    uint8_t checksum;             
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
-    }
-}
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
+#define MIN_SIZE_KIB 180ull
+#define MAX_SIZE_KIB (1ull << 30)   /* 1 TiB */
+#define MIN_INODES 128ull
+#define MAX_INODES (1ull << 20)
+#define JOURNAL_FRACTION 256ull      /* journal gets 1/256 of the image ... */
+#define MAX_JOURNAL_BLOCKS 32768ull  /* ... up to 128 MiB */
+#define JOURNAL_TXN_SLACK 16ull      /* directory and data bitmap blocks a batch dirties */
+#define JOURNAL_TXN_BLOCKS 64ull     /* largest transaction the journal is grown to fit */
+#define JOURNAL_MAX_SHARE 16ull      /* ... but never past 1/16 of the image */
+#define STAGE_BLOCKS 2048ull         /* data region is written 8 MiB at a time, from two buffers */
+#define MAX_SOURCE_DEPTH 256u
 
+uint64_t g_random_seed = 0;
 
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+/* A regular file or directory found by --from-dir and where its data goes in the image. */
+typedef struct {
+    char* path;
+    char name[58];
+    uint32_t parent;              /* inode of the directory that holds it */
+    int is_dir;
+    uint64_t depth;               /* hashed directory depth, for directories */
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t nblocks;
+    uint64_t first;               /* first data block; its index blocks follow the data */
+} source_file_t;
 
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; 
-}
+typedef struct {
+    source_file_t* items;
+    uint64_t count;
+    uint64_t cap;
+} source_list_t;
 
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   
-    de->checksum = x;
-}
+/*
+ * Consecutive data region blocks collected in memory and written out in large
+ * pieces. A full buffer is queued and the spare one filled while it is written.
+ */
+typedef struct {
+    vsfs_ioq_t* ioq;
+    uint8_t* buf;
+    uint8_t* spare;               /* may still be in flight until the next flush */
+    uint64_t used;
+    uint64_t block;               /* image block of buf[0] */
+    vsfs_stats_t* stats;
+} stage_t;
 
 void print_usage(const char* program_name) {
-    printf("Usage: %s --image <filename> --size-kib <180..4096> --inodes <128..512>\n", program_name);
+    printf("Usage: %s --image <filename> --size-kib <%llu..%llu> --inodes <%llu..%llu> [--stats | --stats-json] "
+           "[--verbose]\n", program_name, MIN_SIZE_KIB, MAX_SIZE_KIB, MIN_INODES, MAX_INODES);
+    printf("       %s --image <filename> --from-dir <path> [--size-kib <n>] [--inodes <n>] [--stats | --stats-json] "
+           "[--verbose]\n", program_name);
     printf("  --image: the name of the output image\n");
     printf("  --size-kib: the total size of the image in kilobytes (multiple of 4)\n");
     printf("  --inodes: number of inodes in the file system\n");
+    printf("  --from-dir: add every regular file and subdirectory below a directory; the size and inode count default to the smallest that fit\n");
+    printf("  --stats: print time per phase and I/O counters at the end\n");
+    printf("  --stats-json: the same as one line of JSON\n");
+    printf("  --verbose: print internal structure sizes and where every file is placed\n");
 }
 
 
-int parse_args(int argc, char* argv[], char** image_name, uint64_t* size_kib, uint64_t* inodes) {
-    if (argc != 7) {
-        return -1;
-    }
-    
+int parse_args(int argc, char* argv[], char** image_name, uint64_t* size_kib, uint64_t* inodes, char** from_dir,
+               int* stats, int* verbose) {
     for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats-json") == 0) {
+            *stats = strcmp(argv[i], "--stats") == 0 ? 1 : 2;
+            i--;
+            continue;
+        }
+        if (strcmp(argv[i], "--verbose") == 0) {
+            *verbose = 1;
+            i--;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            return -1;
+        }
         if (strcmp(argv[i], "--image") == 0) {
             *image_name = argv[i + 1];
+        } else if (strcmp(argv[i], "--from-dir") == 0) {
+            *from_dir = argv[i + 1];
         } else if (strcmp(argv[i], "--size-kib") == 0) {
             *size_kib = strtoull(argv[i + 1], NULL, 10);
-            if (*size_kib < 180 || *size_kib > 4096 || *size_kib % 4 != 0) {
-                printf("Error: size-kib must be between 180-4096 and multiple of 4\n");
+            if (*size_kib < MIN_SIZE_KIB || *size_kib > MAX_SIZE_KIB || *size_kib % 4 != 0) {
+                printf("Error: size-kib must be between %llu-%llu and multiple of 4\n", MIN_SIZE_KIB, MAX_SIZE_KIB);
                 return -1;
             }
         } else if (strcmp(argv[i], "--inodes") == 0) {
             *inodes = strtoull(argv[i + 1], NULL, 10);
-            if (*inodes < 128 || *inodes > 512) {
-                printf("Error: inodes must be between 128-512\n");
+            if (*inodes < MIN_INODES || *inodes > MAX_INODES) {
+                printf("Error: inodes must be between %llu-%llu\n", MIN_INODES, MAX_INODES);
                 return -1;
             }
         } else {
             return -1;
         }
     }
-    
-    if (*image_name == NULL || *size_kib == 0 || *inodes == 0) {
+
+    if (*image_name == NULL || (*from_dir == NULL && (*size_kib == 0 || *inodes == 0))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Fill in the layout fields of sb for an image of total_blocks blocks. The
+ * data bitmap covers the data region, whose size depends on the bitmap's own
+ * size. Returns -1 if the metadata alone does not fit; data_region_start is
+ * set either way.
+ */
+int plan_layout(uint64_t total_blocks, uint64_t inodes, superblock_t* sb) {
+    uint64_t inode_table_blocks = (inodes * INODE_SIZE + BS - 1) / BS;
+    uint64_t inode_bitmap_blocks = (inodes + BS * 8 - 1) / (BS * 8);
+    /*
+     * Each half should hold a transaction logging a whole batch of adds: at
+     * most every inode bitmap and inode table block, plus directory and data
+     * bitmap blocks. A smaller journal makes mkfs_adder commit, and sync,
+     * more often. That target never takes more than 1/16 of the image, so on
+     * images under 1 MiB MIN_JOURNAL_BLOCKS, which the format requires,
+     * decides the size instead.
+     */
+    uint64_t txn_blocks = inode_bitmap_blocks + inode_table_blocks + JOURNAL_TXN_SLACK;
+    if (txn_blocks > JOURNAL_TXN_BLOCKS) txn_blocks = JOURNAL_TXN_BLOCKS;
+    uint64_t min_journal = 2 * (vsfs_journal_desc_blocks(txn_blocks) + txn_blocks + 1);
+    if (min_journal > total_blocks / JOURNAL_MAX_SHARE) min_journal = total_blocks / JOURNAL_MAX_SHARE;
+    uint64_t journal_blocks = total_blocks / JOURNAL_FRACTION;
+    if (journal_blocks < min_journal) journal_blocks = min_journal;
+    if (journal_blocks < MIN_JOURNAL_BLOCKS) journal_blocks = MIN_JOURNAL_BLOCKS;
+    if (journal_blocks > MAX_JOURNAL_BLOCKS) journal_blocks = MAX_JOURNAL_BLOCKS;
+    journal_blocks &= ~1ull;
+
+    uint64_t data_bitmap_blocks = 1;
+    uint64_t data_region_start;
+    for (;;) {
+        data_region_start = 1 + inode_bitmap_blocks + data_bitmap_blocks + inode_table_blocks + journal_blocks;
+        if (data_region_start >= total_blocks) break;
+        uint64_t needed = (total_blocks - data_region_start + BS * 8 - 1) / (BS * 8);
+        if (needed <= data_bitmap_blocks) break;
+        data_bitmap_blocks = needed;
+    }
+
+    sb->total_blocks = total_blocks;
+    sb->inode_count = inodes;
+    sb->inode_bitmap_start = 1;
+    sb->inode_bitmap_blocks = inode_bitmap_blocks;
+    sb->data_bitmap_start = sb->inode_bitmap_start + inode_bitmap_blocks;
+    sb->data_bitmap_blocks = data_bitmap_blocks;
+    sb->inode_table_start = sb->data_bitmap_start + data_bitmap_blocks;
+    sb->inode_table_blocks = inode_table_blocks;
+    sb->journal_start = sb->inode_table_start + inode_table_blocks;
+    sb->journal_blocks = journal_blocks;
+    sb->data_region_start = data_region_start;
+    sb->data_region_blocks = data_region_start < total_blocks ? total_blocks - data_region_start : 0;
+    return data_region_start < total_blocks ? 0 : -1;
+}
+
+void source_list_free(source_list_t* list) {
+    for (uint64_t i = 0; i < list->count; i++) free(list->items[i].path);
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->cap = 0;
+}
+
+/* Collect the regular files and directories below dir, each directory before its contents, in name order. */
+int scan_source(const char* dir, uint32_t parent, unsigned level, source_list_t* list) {
+    if (level > MAX_SOURCE_DEPTH) {
+        printf("Error: Directory '%s' is nested too deeply\n", dir);
+        return -1;
+    }
+    struct dirent** entries;
+    int n = scandir(dir, &entries, NULL, alphasort);
+    if (n < 0) {
+        perror("Failed to read source directory");
+        return -1;
+    }
+    int rc = 0;
+    uint64_t max_blocks = DIRECT_MAX + PTRS_PER_BLOCK + (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    for (int i = 0; i < n; i++) {
+        char path[4096];
+        struct stat st, lst;
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+        const char* name = entries[i]->d_name;
+        int skip = strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || stat(path, &st) != 0;
+        /* Symlinks to files are followed; symlinks to directories are not, so the walk cannot loop. */
+        int is_dir = !skip && S_ISDIR(st.st_mode) && lstat(path, &lst) == 0 && S_ISDIR(lst.st_mode);
+        if (rc != 0 || skip || (!is_dir && !S_ISREG(st.st_mode))) {
+            free(entries[i]);
+            continue;
+        }
+        if (list->count == list->cap) {
+            uint64_t cap = list->cap ? list->cap * 2 : 64;
+            source_file_t* items = realloc(list->items, cap * sizeof(source_file_t));
+            if (!items) {
+                rc = -1;
+                free(entries[i]);
+                continue;
+            }
+            list->items = items;
+            list->cap = cap;
+        }
+        source_file_t* f = &list->items[list->count];
+        memset(f, 0, sizeof(*f));
+        f->path = strdup(path);
+        snprintf(f->name, sizeof(f->name), "%.57s", name);
+        f->parent = parent;
+        f->is_dir = is_dir;
+        f->size = is_dir ? 0 : (uint64_t)st.st_size;
+        f->mtime = (uint64_t)st.st_mtime;
+        f->nblocks = (f->size + BS - 1) / BS;
+        if (!f->path) {
+            rc = -1;
+        } else if (f->nblocks > max_blocks) {
+            printf("Error: File '%s' is too large for the filesystem\n", path);
+            free(f->path);
+            rc = -1;
+        } else {
+            list->count++;
+            /* Entry k becomes inode k + 2; the root is inode 1. */
+            if (is_dir) rc = scan_source(path, (uint32_t)(list->count + 1), level + 1, list);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return rc;
+}
+
+/* Group entries by the directory that holds them: the children of inode d are order[start[d] .. start[d + 1]). */
+int group_children(const source_list_t* list, uint64_t** order_out, uint64_t** start_out) {
+    uint64_t* order = malloc((list->count ? list->count : 1) * sizeof(uint64_t));
+    uint64_t* start = calloc(list->count + 3, sizeof(uint64_t));
+    uint64_t* next = malloc((list->count + 3) * sizeof(uint64_t));
+    if (!order || !start || !next) {
+        free(order);
+        free(start);
+        free(next);
         return -1;
     }
-    
+    for (uint64_t i = 0; i < list->count; i++) start[list->items[i].parent + 1]++;
+    for (uint64_t d = 1; d < list->count + 3; d++) start[d] += start[d - 1];
+    memcpy(next, start, (list->count + 3) * sizeof(uint64_t));
+    for (uint64_t i = 0; i < list->count; i++) order[next[list->items[i].parent]++] = i;
+    free(next);
+    *order_out = order;
+    *start_out = start;
     return 0;
 }
 
+/* Smallest hashed directory depth at which no bucket holds more than one block of entries. */
+int plan_directory(const source_list_t* list, const uint64_t* children, uint64_t nchildren, uint64_t* depth_out) {
+    for (uint64_t depth = 0; depth <= MAX_DIR_DEPTH; depth++) {
+        uint64_t nbuckets = 1ull << depth;
+        uint64_t mask = depth ? nbuckets - 1 : 0;
+        uint16_t* fill = calloc(nbuckets, sizeof(uint16_t));
+        if (!fill) return -1;
+        int fits = ++fill[vsfs_dir_hash(".") & mask] <= DIRENTS_PER_BLOCK &&
+                   ++fill[vsfs_dir_hash("..") & mask] <= DIRENTS_PER_BLOCK;
+        for (uint64_t i = 0; fits && i < nchildren; i++) {
+            fits = ++fill[vsfs_dir_hash(list->items[children[i]].name) & mask] <= DIRENTS_PER_BLOCK;
+        }
+        free(fill);
+        if (fits) {
+            *depth_out = depth;
+            return 0;
+        }
+    }
+    printf("Error: Too many files for one directory\n");
+    return -1;
+}
+
+/* Place a directory's entries in the buckets their names hash to; buf holds 1 << depth blocks. */
+int fill_directory(const source_list_t* list, const uint64_t* children, uint64_t nchildren, uint64_t dir_ino,
+                   uint64_t parent_ino, uint64_t depth, uint8_t* buf, uint16_t* fill) {
+    uint64_t nbuckets = 1ull << depth;
+    uint64_t mask = depth ? nbuckets - 1 : 0;
+    memset(buf, 0, nbuckets * BS);
+    memset(fill, 0, nbuckets * sizeof(uint16_t));
+    for (uint64_t i = 0; i < 2 + nchildren; i++) {
+        const source_file_t* f = i < 2 ? NULL : &list->items[children[i - 2]];
+        dirent64_t de = {0};
+        de.inode_no = (uint32_t)(i == 0 ? dir_ino : i == 1 ? parent_ino : children[i - 2] + 2);
+        de.type = !f || f->is_dir ? DIRENT_DIR : DIRENT_FILE;
+        strcpy(de.name, i == 0 ? "." : i == 1 ? ".." : f->name);
+        dirent_checksum_finalize(&de);
+
+        uint64_t bucket = vsfs_dir_hash(de.name) & mask;
+        dirent64_t* entries = (dirent64_t*)(buf + bucket * BS);
+        for (uint64_t j = 0; j < fill[bucket]; j++) {
+            if (strcmp(entries[j].name, de.name) == 0) {
+                printf("Error: File '%s' already exists in filesystem\n", f->path);
+                return -1;
+            }
+        }
+        entries[fill[bucket]++] = de;
+    }
+    return 0;
+}
+
+/*
+ * Map 'count' consecutive data blocks starting at 'first' into ino, with the
+ * index blocks at 'index' onward in the order vsfs_block_map_assign() uses:
+ * single indirect, double indirect, then the tables behind it. 'out' receives
+ * vsfs_index_blocks(count) blocks.
+ */
+void build_block_map(inode_t* ino, uint64_t first, uint64_t count, uint64_t index, uint8_t* out) {
+    for (uint64_t i = 0; i < count && i < DIRECT_MAX; i++) ino->direct[i] = (uint32_t)(first + i);
+    uint64_t nindex = vsfs_index_blocks(count);
+    if (nindex == 0) return;
+    memset(out, 0, nindex * BS);
+
+    uint64_t pos = DIRECT_MAX;
+    uint32_t* ptrs = (uint32_t*)out;
+    ino->reserved_0 = (uint32_t)index;
+    for (uint64_t i = 0; i < PTRS_PER_BLOCK && pos < count; i++) ptrs[i] = (uint32_t)(first + pos++);
+    if (pos == count) return;
+
+    uint32_t* dbl = (uint32_t*)(out + BS);
+    ino->reserved_1 = (uint32_t)(index + 1);
+    for (uint64_t j = 0; pos < count; j++) {
+        dbl[j] = (uint32_t)(index + 2 + j);
+        ptrs = (uint32_t*)(out + (2 + j) * BS);
+        for (uint64_t i = 0; i < PTRS_PER_BLOCK && pos < count; i++) ptrs[i] = (uint32_t)(first + pos++);
+    }
+}
+
+/* Queue the staged blocks and swap buffers, once the spare's own write has completed. */
+int stage_flush(stage_t* s) {
+    int rc = vsfs_ioq_wait(s->ioq);
+    uint64_t len = s->used * BS;
+    if (rc != 0 || len == 0) return rc;
+    if ((rc = vsfs_ioq_write(s->ioq, s->buf, len, s->block * BS)) != 0) return rc;
+    if ((rc = vsfs_ioq_submit(s->ioq)) != 0) return rc;
+    vsfs_stats_io(s->stats, 1, s->block * BS, len);
+    uint8_t* full = s->buf;
+    s->buf = s->spare;
+    s->spare = full;
+    s->block += s->used;
+    s->used = 0;
+    return 0;
+}
+
+/* Append whole blocks from memory. */
+int stage_put(stage_t* s, const uint8_t* data, uint64_t nblocks) {
+    while (nblocks) {
+        int rc;
+        if (s->used == STAGE_BLOCKS && (rc = stage_flush(s)) != 0) return rc;
+        uint64_t n = STAGE_BLOCKS - s->used < nblocks ? STAGE_BLOCKS - s->used : nblocks;
+        memcpy(s->buf + s->used * BS, data, n * BS);
+        s->used += n;
+        data += n * BS;
+        nblocks -= n;
+    }
+    return 0;
+}
+
+/* Append the contents of a source file, zero-padded to whole blocks. */
+int stage_file(stage_t* s, const source_file_t* f) {
+    int src = open(f->path, O_RDONLY);
+    if (src < 0) return -errno;
+    int rc = 0;
+    for (uint64_t off = 0; off < f->size; ) {
+        if (s->used == STAGE_BLOCKS && (rc = stage_flush(s)) != 0) break;
+        uint8_t* dst = s->buf + s->used * BS;
+        uint64_t room = (STAGE_BLOCKS - s->used) * BS;
+        uint64_t n = f->size - off < room ? f->size - off : room;
+        /* pread() may return short; only the end of the file is padded. */
+        for (uint64_t got = 0; got < n; ) {
+            ssize_t r = pread(src, dst + got, n - got, (off_t)(off + got));
+            if (r <= 0) {
+                rc = r < 0 ? -errno : -EIO;   /* the file shrank since it was scanned */
+                break;
+            }
+            got += (uint64_t)r;
+        }
+        if (rc != 0) break;
+        if (n % BS) memset(dst + n, 0, BS - n % BS);
+        s->used += (n + BS - 1) / BS;
+        off += n;
+    }
+    close(src);
+    return rc;
+}
+
 int main(int argc, char* argv[]) {
-    printf("DEBUG: sizeof(superblock_t) = %zu bytes\n", sizeof(superblock_t));
     char* image_name = NULL;
+    char* from_dir = NULL;
     uint64_t size_kib = 0;
     uint64_t inodes = 0;
-    
- 
-    if (parse_args(argc, argv, &image_name, &size_kib, &inodes) != 0) {
+    int stats = 0;
+    int verbose = 0;
+
+    if (parse_args(argc, argv, &image_name, &size_kib, &inodes, &from_dir, &stats, &verbose) != 0) {
         print_usage(argv[0]);
         return 1;
     }
-    
+    if (verbose) printf("DEBUG: sizeof(superblock_t) = %zu bytes\n", sizeof(superblock_t));
+
     crc32_init();
-    
-    uint64_t total_blocks = (size_kib * 1024) / BS;
-    uint64_t inode_table_blocks = (inodes * INODE_SIZE + BS - 1) / BS;
-    uint64_t data_region_start = 3 + inode_table_blocks;
-    uint64_t data_region_blocks = total_blocks - data_region_start;
-    
+    vsfs_stats_t st = {0};
+    uint64_t start_ns = vsfs_now_ns();
+    uint64_t t = start_ns;
+
+    source_list_t files = {0};
+    uint64_t* order = NULL;
+    uint64_t* start = NULL;
+    if ((from_dir && scan_source(from_dir, ROOT_INO, 0, &files) != 0) || group_children(&files, &order, &start) != 0) {
+        source_list_free(&files);
+        free(order);
+        return 1;
+    }
+
+    /*
+     * The data region holds the root directory and its index blocks, then
+     * every entry's data or directory blocks followed by its index blocks,
+     * all back to back. Each directory is hashed as deep as its own entries need.
+     */
+    uint64_t dir_depth = 0;
+    uint64_t nfiles = 0, ndirs = 0;
+    int planned = plan_directory(&files, order + start[ROOT_INO], start[ROOT_INO + 1] - start[ROOT_INO], &dir_depth);
+    uint64_t max_depth = dir_depth;
+    for (uint64_t i = 0; planned == 0 && i < files.count; i++) {
+        source_file_t* f = &files.items[i];
+        if (!f->is_dir) {
+            nfiles++;
+            continue;
+        }
+        uint64_t d = i + 2;
+        planned = plan_directory(&files, order + start[d], start[d + 1] - start[d], &f->depth);
+        f->nblocks = 1ull << f->depth;
+        f->size = (2 + start[d + 1] - start[d]) * sizeof(dirent64_t);
+        if (f->depth > max_depth) max_depth = f->depth;
+        ndirs++;
+    }
+    if (planned != 0) {
+        source_list_free(&files);
+        free(order);
+        free(start);
+        return 1;
+    }
+    uint64_t dir_blocks = 1ull << dir_depth;
+    uint64_t data_needed = dir_blocks + vsfs_index_blocks(dir_blocks);
+    for (uint64_t i = 0; i < files.count; i++) {
+        data_needed += files.items[i].nblocks + vsfs_index_blocks(files.items[i].nblocks);
+    }
+
+    /* Without --inodes, fill the last inode table block; the space is taken either way. */
+    uint64_t inodes_needed = 1 + files.count;
+    if (inodes == 0) {
+        inodes = (inodes_needed + BS / INODE_SIZE - 1) / (BS / INODE_SIZE) * (BS / INODE_SIZE);
+        if (inodes < MIN_INODES) inodes = MIN_INODES;
+    }
+    if (inodes < inodes_needed || inodes > MAX_INODES) {
+        printf("Error: %lu files and directories need %lu inodes\n", (unsigned long)files.count,
+               (unsigned long)inodes_needed);
+        source_list_free(&files);
+        free(order);
+        free(start);
+        return 1;
+    }
+
+    superblock_t sb = {0};
+    uint64_t min_blocks = (MIN_SIZE_KIB * 1024) / BS;
+    while (plan_layout(min_blocks, inodes, &sb) != 0 || sb.data_region_blocks < data_needed) {
+        min_blocks = sb.data_region_start + data_needed;
+    }
+    uint64_t total_blocks = size_kib ? (size_kib * 1024) / BS : min_blocks;
+    if (total_blocks < min_blocks || total_blocks * BS / 1024 > MAX_SIZE_KIB) {
+        if (from_dir) {
+            printf("Error: '%s' needs an image of %lu KiB\n", from_dir, (unsigned long)(min_blocks * BS / 1024));
+        } else {
+            printf("Error: image too small for %lu inodes\n", (unsigned long)inodes);
+        }
+        source_list_free(&files);
+        free(order);
+        free(start);
+        return 1;
+    }
+    plan_layout(total_blocks, inodes, &sb);
+    size_kib = total_blocks * BS / 1024;
+
     printf("Creating filesystem with:\n");
     printf("  Image: %s\n", image_name);
     printf("  Size: %lu KiB (%lu blocks)\n", size_kib, total_blocks);
     printf("  Inodes: %lu\n", inodes);
-    printf("  Inode table blocks: %lu\n", inode_table_blocks);
-    printf("  Data region blocks: %lu\n", data_region_blocks);
+    printf("  Bitmap blocks: %lu inode, %lu data\n", sb.inode_bitmap_blocks, sb.data_bitmap_blocks);
+    printf("  Inode table blocks: %lu\n", sb.inode_table_blocks);
+    printf("  Journal blocks: %lu\n", sb.journal_blocks);
+    printf("  Data region blocks: %lu\n", sb.data_region_blocks);
+    if (from_dir) {
+        printf("  Files: %lu in %lu directories (%lu data blocks)\n", (unsigned long)nfiles,
+               (unsigned long)(ndirs + 1), (unsigned long)data_needed);
+    }
 
-    FILE* img = fopen(image_name, "wb");
-    if (!img) {
+    int img = open(image_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (img < 0) {
         perror("Failed to create image file");
+        source_list_free(&files);
+        free(order);
+        free(start);
         return 1;
     }
-    
 
-    superblock_t sb = {0};
-    sb.magic = 0x4D565346;
-    sb.version = 1;
+    /* The journal and the unused data region are left as holes; only blocks in use are written. */
+    if (ftruncate(img, (off_t)(total_blocks * BS)) != 0) {
+        perror("Failed to size image file");
+        close(img);
+        source_list_free(&files);
+        free(order);
+        free(start);
+        return 1;
+    }
+
+    sb.magic = VSFS_MAGIC;
+    sb.version = VSFS_VERSION;
     sb.block_size = BS;
-    sb.total_blocks = total_blocks;
-    sb.inode_count = inodes;
-    sb.inode_bitmap_start = 1;
-    sb.inode_bitmap_blocks = 1;
-    sb.data_bitmap_start = 2;
-    sb.data_bitmap_blocks = 1;
-    sb.inode_table_start = 3;
-    sb.inode_table_blocks = inode_table_blocks;
-    sb.data_region_start = data_region_start;
-    sb.data_region_blocks = data_region_blocks;
     sb.root_inode = ROOT_INO;
     sb.mtime_epoch = time(NULL);
-    sb.flags = 0;
-    
-
-    superblock_crc_finalize(&sb);
-    
-
-    uint8_t block[BS] = {0};
-    memcpy(block, &sb, sizeof(sb));
-    fwrite(block, 1, BS, img);
-    
-
-    memset(block, 0, BS);
- 
-    block[0] = 0x01;
-    fwrite(block, 1, BS, img);
-    
-    memset(block, 0, BS);
-    block[0] = 0x01;
-    fwrite(block, 1, BS, img);
+    sb.flags = FEATURE_JOURNAL | (max_depth ? FEATURE_HASHED_DIR : 0);
+
+    static uint8_t sb_block[BS];
+    memcpy(sb_block, &sb, sizeof(sb));
+    superblock_crc_finalize((superblock_t*)sb_block);
+    t = vsfs_stats_phase(&st, VSFS_PHASE_SUPERBLOCK, t);
+
+    /* Only the leading bitmap and inode table blocks that have anything in them are kept in memory. */
+    uint64_t ibm_used = (inodes_needed + BS * 8 - 1) / (BS * 8);
+    uint64_t dbm_used = (data_needed + BS * 8 - 1) / (BS * 8);
+    uint64_t table_used = (inodes_needed * INODE_SIZE + BS - 1) / BS;
+    uint8_t* inode_bitmap = calloc(ibm_used, BS);
+    uint8_t* data_bitmap = calloc(dbm_used, BS);
+    uint8_t* inode_table = calloc(table_used, BS);
+    uint64_t max_dir_blocks = 1ull << max_depth;
+    uint8_t* dir = calloc(max_dir_blocks + vsfs_index_blocks(max_dir_blocks), BS);
+    uint16_t* fill = calloc(max_dir_blocks, sizeof(uint16_t));
+    uint8_t* index = malloc((2 + PTRS_PER_BLOCK) * BS);
+    vsfs_ioq_t ioq;
+    vsfs_ioq_init(&ioq, img, VSFS_IOQ_DEPTH);
+    stage_t stage = { .ioq = &ioq, .buf = malloc(STAGE_BLOCKS * BS), .spare = malloc(STAGE_BLOCKS * BS),
+                      .block = sb.data_region_start, .stats = &st };
+    int rc = 1;
+    if (verbose) printf("DEBUG: image writes go through %s\n", vsfs_ioq_backend(&ioq));
+    if (!inode_bitmap || !data_bitmap || !inode_table || !dir || !fill || !index || !stage.buf ||
+        !stage.spare) {
+        perror("Failed to allocate image buffers");
+        goto out;
+    }
+
+    for (uint64_t i = 0; i < inodes_needed; i++) inode_bitmap[i / 8] |= (uint8_t)(1u << (i % 8));
+    for (uint64_t i = 0; i < data_needed; i++) data_bitmap[i / 8] |= (uint8_t)(1u << (i % 8));
+    t = vsfs_stats_phase(&st, VSFS_PHASE_BITMAP, t);
 
     inode_t root_inode = {0};
-    root_inode.mode = 0040000;  
-    root_inode.links = 2;      
+    root_inode.mode = 0040000;
+    root_inode.links = 2 + start[ROOT_INO + 1] - start[ROOT_INO];
     root_inode.uid = 0;
     root_inode.gid = 0;
-    root_inode.size_bytes = 2 * sizeof(dirent64_t);  
+    root_inode.size_bytes = (2 + start[ROOT_INO + 1] - start[ROOT_INO]) * sizeof(dirent64_t);
     root_inode.atime = time(NULL);
     root_inode.mtime = time(NULL);
     root_inode.ctime = time(NULL);
-    root_inode.direct[0] = data_region_start; 
-    for (int i = 1; i < 12; i++) {
-        root_inode.direct[i] = 0;  
-    }
-    root_inode.reserved_0 = 0;
-    root_inode.reserved_1 = 0;
-    root_inode.reserved_2 = 0;
-    root_inode.proj_id = 13;  
+    build_block_map(&root_inode, sb.data_region_start, dir_blocks, sb.data_region_start + dir_blocks,
+                    dir + dir_blocks * BS);
+    root_inode.reserved_2 = dir_depth ? INODE_FLAG_HASHED_DIR | (uint32_t)(dir_depth << INODE_DIR_DEPTH_SHIFT) : 0;
+    root_inode.proj_id = 13;
     root_inode.uid16_gid16 = 0;
     root_inode.xattr_ptr = 0;
 
     inode_crc_finalize(&root_inode);
-    
-    for (uint64_t i = 0; i < inode_table_blocks; i++) {
-        memset(block, 0, BS);
-        if (i == 0) {
-            memcpy(block, &root_inode, sizeof(root_inode));
+
+    memcpy(inode_table, &root_inode, sizeof(root_inode));
+
+    uint64_t next_block = sb.data_region_start + dir_blocks + vsfs_index_blocks(dir_blocks);
+    for (uint64_t i = 0; i < files.count; i++) {
+        source_file_t* f = &files.items[i];
+        f->first = next_block;
+        next_block += f->nblocks + vsfs_index_blocks(f->nblocks);
+
+        inode_t ino = {0};
+        ino.mode = f->is_dir ? 0040000 : 0100000;
+        ino.links = f->is_dir ? 2 + start[i + 3] - start[i + 2] : 1;
+        ino.size_bytes = f->size;
+        ino.atime = time(NULL);
+        ino.mtime = f->mtime;
+        ino.ctime = time(NULL);
+        ino.proj_id = 13;
+        build_block_map(&ino, f->first, f->nblocks, f->first + f->nblocks, index);
+        if (f->is_dir && f->depth) ino.reserved_2 = INODE_FLAG_HASHED_DIR | (uint32_t)(f->depth << INODE_DIR_DEPTH_SHIFT);
+        inode_crc_finalize(&ino);
+        memcpy(inode_table + (i + 1) * INODE_SIZE, &ino, sizeof(ino));
+    }
+
+    /*
+     * Only the superblock and the populated bitmap and inode table blocks are
+     * queued, one write per region; the unused rest of the metadata stays a
+     * hole in the truncated file and reads back as zeros.
+     */
+    const struct {
+        uint64_t block;
+        uint64_t count;
+        const uint8_t* data;
+    } meta[] = {
+        { 0, 1, sb_block },
+        { sb.inode_bitmap_start, ibm_used, inode_bitmap },
+        { sb.data_bitmap_start, dbm_used, data_bitmap },
+        { sb.inode_table_start, table_used, inode_table },
+    };
+    int meta_rc = 0;
+    for (size_t i = 0; i < sizeof(meta) / sizeof(meta[0]) && meta_rc == 0; i++) {
+        meta_rc = vsfs_ioq_write(&ioq, meta[i].data, meta[i].count * BS, meta[i].block * BS);
+        vsfs_stats_io(&st, 1, meta[i].block * BS, meta[i].count * BS);
+    }
+    int waited = vsfs_ioq_wait(&ioq);
+    if (meta_rc == 0) meta_rc = waited;
+    if (meta_rc != 0) {
+        printf("Error: Failed to write filesystem metadata: %s\n", strerror(-meta_rc));
+        goto out;
+    }
+    t = vsfs_stats_phase(&st, VSFS_PHASE_INODE, t);
+
+    /* The root's index blocks were built with its inode; filling the buckets leaves them alone. */
+    if (fill_directory(&files, order + start[ROOT_INO], start[ROOT_INO + 1] - start[ROOT_INO], ROOT_INO, ROOT_INO,
+                       dir_depth, dir, fill) != 0) {
+        goto out;
+    }
+    if (stage_put(&stage, dir, dir_blocks + vsfs_index_blocks(dir_blocks)) != 0) {
+        perror("Failed to write root directory");
+        goto out;
+    }
+    t = vsfs_stats_phase(&st, VSFS_PHASE_DIRECTORY, t);
+
+    for (uint64_t i = 0; i < files.count; i++) {
+        source_file_t* f = &files.items[i];
+        inode_t ino = {0};
+        int err = 0;
+        if (f->is_dir) {
+            uint64_t d = i + 2;
+            if (fill_directory(&files, order + start[d], start[d + 1] - start[d], d, f->parent, f->depth, dir, fill) != 0) {
+                goto out;
+            }
+            build_block_map(&ino, f->first, f->nblocks, f->first + f->nblocks, dir + f->nblocks * BS);
+            err = stage_put(&stage, dir, f->nblocks + vsfs_index_blocks(f->nblocks));
+        } else {
+            build_block_map(&ino, f->first, f->nblocks, f->first + f->nblocks, index);
+            err = stage_file(&stage, f);
+            if (err == 0) err = stage_put(&stage, index, vsfs_index_blocks(f->nblocks));
+        }
+        if (err != 0) {
+            printf("Error: Failed to copy '%s': %s\n", f->path, strerror(-err));
+            goto out;
         }
-        fwrite(block, 1, BS, img);
-    }
-    
-    dirent64_t dot_entry = {0};
-    dot_entry.inode_no = ROOT_INO;
-    dot_entry.type = 2;  
-    strcpy(dot_entry.name, ".");
-    dirent_checksum_finalize(&dot_entry);
-    
-    dirent64_t dotdot_entry = {0};
-    dotdot_entry.inode_no = ROOT_INO;
-    dotdot_entry.type = 2;  
-    strcpy(dotdot_entry.name, "..");
-    dirent_checksum_finalize(&dotdot_entry);
-
-    memset(block, 0, BS);
-    memcpy(block, &dot_entry, sizeof(dot_entry));
-    memcpy(block + sizeof(dot_entry), &dotdot_entry, sizeof(dotdot_entry));
-    fseek(img, data_region_start * BS, SEEK_SET);
-    fwrite(block, 1, BS, img);
-    
-    memset(block, 0, BS);
-    for (uint64_t i = 1; i < data_region_blocks; i++) {
-        fwrite(block, 1, BS, img);
-    }
-    
-    fclose(img);
+        if (verbose && f->nblocks) {
+            printf("Added %s -> inode %lu, blocks %lu-%lu\n", f->name, (unsigned long)(i + 2),
+                   (unsigned long)f->first, (unsigned long)(f->first + f->nblocks - 1));
+        } else if (verbose) {
+            printf("Added %s -> inode %lu\n", f->name, (unsigned long)(i + 2));
+        }
+    }
+    int flushed = stage_flush(&stage);
+    if (flushed == 0) flushed = vsfs_ioq_wait(&ioq);
+    if (flushed != 0) {
+        printf("Error: Failed to write file data: %s\n", strerror(-flushed));
+        goto out;
+    }
+    t = vsfs_stats_phase(&st, VSFS_PHASE_PAYLOAD, t);
+    rc = 0;
+
+out:
+    vsfs_ioq_destroy(&ioq);
+    free(inode_bitmap);
+    free(data_bitmap);
+    free(inode_table);
+    free(dir);
+    free(fill);
+    free(index);
+    free(stage.buf);
+    free(stage.spare);
+    free(order);
+    free(start);
+    if (close(img) != 0 && rc == 0) {
+        perror("Failed to close image file");
+        rc = 1;
+    }
+    if (rc != 0) {
+        source_list_free(&files);
+        return rc;
+    }
+    vsfs_stats_phase(&st, VSFS_PHASE_FLUSH, t);
     printf("Filesystem created successfully: %s\n", image_name);
-    
+    if (from_dir) {
+        printf("%lu file(s) in %lu director%s added from '%s'\n", (unsigned long)nfiles, (unsigned long)(ndirs + 1),
+               ndirs ? "ies" : "y", from_dir);
+    }
+    if (stats) vsfs_stats_print(&st, "mkfs_builder", vsfs_now_ns() - start_ns, stats == 2);
+    source_list_free(&files);
+
     return 0;
 }
@@ -0,0 +1,576 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <endian.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vsfs.h"
+
+#define MAX_THREADS 256
+#define MAX_REPORTED_ERRORS 100
+
+/* State shared by all workers; the image is mapped read-only. */
+typedef struct {
+    const uint8_t* image;
+    superblock_t sb;
+    const uint8_t* inode_bitmap;
+    const uint8_t* data_bitmap;
+    uint64_t* block_refs;         /* one bit per data-region block, set atomically */
+    uint64_t* shared_refs;        /* the same for blocks files may share: tail blocks, deduplicated data */
+    uint8_t* inode_refs;          /* directory entries pointing at each inode */
+    uint64_t errors;
+    pthread_mutex_t print_lock;
+} check_ctx_t;
+
+typedef struct {
+    check_ctx_t* ctx;
+    pthread_t thread;
+    int spawned;
+    uint64_t first_ino;
+    uint64_t last_ino;
+    uint64_t inodes_checked;
+    uint64_t dirents_checked;
+    uint64_t bytes_scanned;
+} worker_t;
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image> [--threads <n>]\n", program_name);
+    printf("  --image: the filesystem image to check\n");
+    printf("  --threads: number of worker threads (default: online CPUs)\n");
+}
+
+int parse_args(int argc, char* argv[], char** image_name, uint64_t* threads) {
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) return -1;
+        if (strcmp(argv[i], "--image") == 0) {
+            *image_name = argv[i + 1];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            char* end;
+            *threads = strtoull(argv[i + 1], &end, 10);
+            if (*end != '\0' || *threads == 0 || *threads > MAX_THREADS) return -1;
+        } else {
+            return -1;
+        }
+    }
+    return *image_name ? 0 : -1;
+}
+
+static void report(check_ctx_t* ctx, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void report(check_ctx_t* ctx, const char* fmt, ...) {
+    uint64_t n = __atomic_fetch_add(&ctx->errors, 1, __ATOMIC_RELAXED);
+    if (n >= MAX_REPORTED_ERRORS) return;
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&ctx->print_lock);
+    printf("Error: ");
+    vprintf(fmt, ap);
+    printf("\n");
+    if (n + 1 == MAX_REPORTED_ERRORS) printf("Too many errors, further errors are counted but not shown\n");
+    pthread_mutex_unlock(&ctx->print_lock);
+    va_end(ap);
+}
+
+static int bit_is_set(const uint8_t* bits, uint64_t i) {
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+static const uint8_t* block_at(const check_ctx_t* ctx, uint64_t block) {
+    return ctx->image + block * BS;
+}
+
+static int in_data_region(const check_ctx_t* ctx, uint64_t block) {
+    return block >= ctx->sb.data_region_start &&
+           block < ctx->sb.data_region_start + ctx->sb.data_region_blocks;
+}
+
+/* Record a reference to 'block' from inode 'ino'; returns 0 if the block may be read. */
+static int claim_block(check_ctx_t* ctx, uint64_t ino, uint64_t block) {
+    if (!in_data_region(ctx, block)) {
+        report(ctx, "inode %lu references block %lu outside the data region", (unsigned long)ino, (unsigned long)block);
+        return -1;
+    }
+    uint64_t bit = block - ctx->sb.data_region_start;
+    uint64_t mask = 1ull << (bit % 64);
+    uint64_t old = __atomic_fetch_or(&ctx->block_refs[bit / 64], mask, __ATOMIC_RELAXED);
+    if (old & mask) {
+        report(ctx, "block %lu is referenced more than once (again by inode %lu)", (unsigned long)block, (unsigned long)ino);
+    }
+    if (!bit_is_set(ctx->data_bitmap, bit)) {
+        report(ctx, "block %lu used by inode %lu is free in the data bitmap", (unsigned long)block, (unsigned long)ino);
+    }
+    return 0;
+}
+
+/* Like claim_block() for blocks any number of files may share, but nothing else may map. */
+static int claim_shared(check_ctx_t* ctx, uint64_t ino, uint64_t block) {
+    if (!in_data_region(ctx, block)) {
+        report(ctx, "inode %lu references block %lu outside the data region", (unsigned long)ino, (unsigned long)block);
+        return -1;
+    }
+    uint64_t bit = block - ctx->sb.data_region_start;
+    __atomic_fetch_or(&ctx->shared_refs[bit / 64], 1ull << (bit % 64), __ATOMIC_RELAXED);
+    if (!bit_is_set(ctx->data_bitmap, bit)) {
+        report(ctx, "block %lu used by inode %lu is free in the data bitmap", (unsigned long)block, (unsigned long)ino);
+    }
+    return 0;
+}
+
+static void claim_tail(check_ctx_t* ctx, uint64_t ino, const inode_t* inode) {
+    if (inode->direct[1] > BS || inode->size_bytes > BS - inode->direct[1]) {
+        report(ctx, "inode %lu: tail data runs past the end of block %lu", (unsigned long)ino, (unsigned long)inode->direct[0]);
+    }
+    claim_shared(ctx, ino, inode->direct[0]);
+}
+
+/*
+ * Collect the first 'count' block pointers of an inode into 'out', claiming
+ * the data blocks and the index blocks that map them. Unreadable pointers are
+ * stored as 0. With 'shared' set the data blocks may also belong to other files.
+ */
+static int walk_block_map(worker_t* w, uint64_t ino, const inode_t* inode, uint64_t count, uint32_t* out, int shared) {
+    check_ctx_t* ctx = w->ctx;
+    uint64_t pos = 0;
+    for (; pos < count && pos < DIRECT_MAX; pos++) out[pos] = inode->direct[pos];
+
+    if (pos < count) {
+        uint32_t ind = inode->reserved_0;
+        if (claim_block(ctx, ino, ind) != 0) return -1;
+        uint64_t n = count - pos < PTRS_PER_BLOCK ? count - pos : PTRS_PER_BLOCK;
+        memcpy(out + pos, block_at(ctx, ind), n * sizeof(uint32_t));
+        w->bytes_scanned += BS;
+        pos += n;
+    }
+    if (pos < count) {
+        uint32_t dind = inode->reserved_1;
+        if (claim_block(ctx, ino, dind) != 0) return -1;
+        const uint32_t* dbl = (const uint32_t*)block_at(ctx, dind);
+        w->bytes_scanned += BS;
+        for (uint64_t j = 0; j < PTRS_PER_BLOCK && pos < count; j++) {
+            if (claim_block(ctx, ino, dbl[j]) != 0) return -1;
+            uint64_t n = count - pos < PTRS_PER_BLOCK ? count - pos : PTRS_PER_BLOCK;
+            memcpy(out + pos, block_at(ctx, dbl[j]), n * sizeof(uint32_t));
+            w->bytes_scanned += BS;
+            pos += n;
+        }
+    }
+    if (pos < count) {
+        report(ctx, "inode %lu maps more blocks than the format allows", (unsigned long)ino);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        if ((shared ? claim_shared(ctx, ino, out[i]) : claim_block(ctx, ino, out[i])) != 0) out[i] = 0;
+    }
+    return 0;
+}
+
+static void check_directory(worker_t* w, uint64_t ino, const inode_t* inode, const uint32_t* blocks, uint64_t nblocks) {
+    check_ctx_t* ctx = w->ctx;
+    uint64_t live = 0;
+    for (uint64_t b = 0; b < nblocks; b++) {
+        if (blocks[b] == 0) continue;
+        const dirent64_t* entries = (const dirent64_t*)block_at(ctx, blocks[b]);
+        w->bytes_scanned += BS;
+        for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            const dirent64_t* de = &entries[i];
+            if (de->inode_no == 0) continue;
+            live++;
+            w->dirents_checked++;
+
+            dirent64_t tmp = *de;
+            dirent_checksum_finalize(&tmp);
+            if (tmp.checksum != de->checksum) {
+                report(ctx, "directory %lu block %lu entry %lu: bad checksum", (unsigned long)ino,
+                       (unsigned long)blocks[b], (unsigned long)i);
+            }
+            if (memchr(de->name, '\0', sizeof(de->name)) == NULL) {
+                report(ctx, "directory %lu block %lu entry %lu: name is not terminated", (unsigned long)ino,
+                       (unsigned long)blocks[b], (unsigned long)i);
+                continue;
+            }
+            if ((vsfs_dir_hash(de->name) & (nblocks - 1)) != b) {
+                report(ctx, "directory %lu: entry '%s' is in the wrong hash bucket", (unsigned long)ino, de->name);
+            }
+            if (de->inode_no > ctx->sb.inode_count || !bit_is_set(ctx->inode_bitmap, de->inode_no - 1)) {
+                report(ctx, "directory %lu: entry '%s' points to unallocated inode %u", (unsigned long)ino,
+                       de->name, de->inode_no);
+                continue;
+            }
+            inode_t target;
+            memcpy(&target, block_at(ctx, ctx->sb.inode_table_start) + (de->inode_no - 1) * INODE_SIZE, sizeof(target));
+            if ((de->type == DIRENT_DIR) != ((target.mode & 0170000) == 0040000)) {
+                report(ctx, "directory %lu: entry '%s' has type %u but inode %u is not a %s", (unsigned long)ino,
+                       de->name, de->type, de->inode_no, de->type == DIRENT_DIR ? "directory" : "file");
+            }
+            /* "." and ".." are back references and do not count as links into the tree. */
+            if (strcmp(de->name, ".") == 0) {
+                if (de->inode_no != ino) {
+                    report(ctx, "directory %lu: '.' points to inode %u", (unsigned long)ino, de->inode_no);
+                }
+                continue;
+            }
+            if (strcmp(de->name, "..") == 0) continue;
+            __atomic_store_n(&ctx->inode_refs[de->inode_no - 1], 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (inode->size_bytes != live * sizeof(dirent64_t)) {
+        report(ctx, "directory %lu: size %lu does not match %lu entries", (unsigned long)ino,
+               (unsigned long)inode->size_bytes, (unsigned long)live);
+    }
+}
+
+/* Copy bytes [pos, pos + len) of a compressed file's stream out of the mapping. */
+static void stream_bytes(const check_ctx_t* ctx, const uint32_t* blocks, uint64_t pos, uint64_t len, uint8_t* out) {
+    while (len) {
+        uint64_t n = BS - pos % BS < len ? BS - pos % BS : len;
+        memcpy(out, block_at(ctx, blocks[pos / BS]) + pos % BS, n);
+        pos += n;
+        out += n;
+        len -= n;
+    }
+}
+
+/* The frame headers of a compressed file must tile its stream exactly, one frame per VSFS_FRAME_SIZE bytes. */
+static void check_frames(check_ctx_t* ctx, uint64_t ino, const inode_t* inode, const uint32_t* blocks, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (blocks[i] == 0) return;
+    }
+    uint64_t pos = 0;
+    for (uint64_t off = 0; off < inode->size_bytes; off += VSFS_FRAME_SIZE) {
+        uint64_t n = inode->size_bytes - off < VSFS_FRAME_SIZE ? inode->size_bytes - off : VSFS_FRAME_SIZE;
+        uint8_t header[4];
+        if (inode->xattr_ptr - pos < sizeof(header)) break;
+        stream_bytes(ctx, blocks, pos, sizeof(header), header);
+        uint64_t len = vsfs_frame_length(header);
+        uint32_t h;
+        memcpy(&h, header, sizeof(h));
+        if (len > inode->xattr_ptr - pos || len - 4 > n || ((le32toh(h) & VSFS_FRAME_STORED) && len - 4 != n)) {
+            report(ctx, "inode %lu: compressed frame at byte %lu is corrupt", (unsigned long)ino, (unsigned long)pos);
+            return;
+        }
+        pos += len;
+    }
+    if (pos != inode->xattr_ptr) {
+        report(ctx, "inode %lu: compressed stream of %lu bytes does not match its frames", (unsigned long)ino,
+               (unsigned long)inode->xattr_ptr);
+    }
+}
+
+static void check_inode(worker_t* w, uint64_t ino) {
+    check_ctx_t* ctx = w->ctx;
+    inode_t inode;
+    memcpy(&inode, block_at(ctx, ctx->sb.inode_table_start) + (ino - 1) * INODE_SIZE, sizeof(inode));
+    w->inodes_checked++;
+
+    inode_t tmp = inode;
+    inode_crc_finalize(&tmp);
+    if (tmp.inode_crc != inode.inode_crc) {
+        report(ctx, "inode %lu: bad checksum", (unsigned long)ino);
+    }
+
+    uint64_t count;
+    int is_dir = (inode.mode & 0170000) == 0040000;
+    if (is_dir) {
+        uint64_t depth = (inode.reserved_2 & INODE_FLAG_HASHED_DIR) ? inode.reserved_2 >> INODE_DIR_DEPTH_SHIFT : 0;
+        if (depth > MAX_DIR_DEPTH) {
+            report(ctx, "directory %lu: hash depth %lu is out of range", (unsigned long)ino, (unsigned long)depth);
+            return;
+        }
+        count = 1ull << depth;
+    } else if ((inode.mode & 0170000) == 0100000) {
+        if (inode.reserved_2 & INODE_FLAG_INLINE) {
+            if (inode.size_bytes > VSFS_INLINE_MAX) {
+                report(ctx, "inode %lu: inline size %lu is too large", (unsigned long)ino, (unsigned long)inode.size_bytes);
+            }
+            return;
+        }
+        if (inode.reserved_2 & INODE_FLAG_TAIL) {
+            claim_tail(ctx, ino, &inode);
+            return;
+        }
+        count = vsfs_file_blocks(&inode);
+        if (inode.reserved_2 & INODE_FLAG_COMPRESSED) {
+            unsigned codec = vsfs_inode_codec(&inode);
+            if (codec != VSFS_CODEC_LZ && codec != VSFS_CODEC_DEFLATE) {
+                report(ctx, "inode %lu: unknown compression codec %u", (unsigned long)ino, codec);
+                return;
+            }
+            if (inode.xattr_ptr == 0 || count > (inode.size_bytes + BS - 1) / BS) {
+                report(ctx, "inode %lu: compressed size %lu does not fit size %lu", (unsigned long)ino,
+                       (unsigned long)inode.xattr_ptr, (unsigned long)inode.size_bytes);
+                return;
+            }
+        }
+    } else {
+        report(ctx, "inode %lu: unknown mode 0%o", (unsigned long)ino, inode.mode);
+        return;
+    }
+    if (count > vsfs_max_file_blocks(&ctx->sb)) {
+        report(ctx, "inode %lu: size %lu exceeds the maximum file size", (unsigned long)ino, (unsigned long)inode.size_bytes);
+        return;
+    }
+
+    uint32_t* blocks = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!blocks) {
+        report(ctx, "inode %lu: out of memory", (unsigned long)ino);
+        return;
+    }
+    int shared = !is_dir && (ctx->sb.flags & FEATURE_DEDUP);
+    if (walk_block_map(w, ino, &inode, count, blocks, shared) == 0) {
+        if (is_dir) check_directory(w, ino, &inode, blocks, count);
+        else if (inode.reserved_2 & INODE_FLAG_COMPRESSED) check_frames(ctx, ino, &inode, blocks, count);
+    }
+    free(blocks);
+}
+
+static void* check_worker(void* arg) {
+    worker_t* w = arg;
+    for (uint64_t ino = w->first_ino; ino <= w->last_ino; ino++) {
+        if (bit_is_set(w->ctx->inode_bitmap, ino - 1)) check_inode(w, ino);
+    }
+    w->bytes_scanned += (w->last_ino - w->first_ino + 1) * INODE_SIZE;
+    return NULL;
+}
+
+/* Superblock layout must be self-consistent and fit in the mapped file before anything is dereferenced. */
+static int check_superblock(check_ctx_t* ctx, uint64_t file_size) {
+    const superblock_t* sb = &ctx->sb;
+    if (sb->magic != VSFS_MAGIC) {
+        printf("Error: Invalid filesystem magic number\n");
+        return -1;
+    }
+    if (sb->version == 0 || sb->version > VSFS_VERSION || sb->block_size != BS) {
+        printf("Error: Unsupported filesystem version %u (block size %u)\n", sb->version, sb->block_size);
+        return -1;
+    }
+    if (sb->flags & ~SUPPORTED_FEATURES) {
+        printf("Error: Unsupported filesystem features 0x%08X\n", sb->flags & ~SUPPORTED_FEATURES);
+        return -1;
+    }
+
+    uint8_t block[BS];
+    memcpy(block, ctx->image, BS);
+    uint32_t stored = ((superblock_t*)block)->checksum;
+    if (superblock_crc_finalize((superblock_t*)block) != stored) {
+        report(ctx, "superblock checksum mismatch");
+    }
+
+    uint64_t journal_blocks = 0;
+    if (sb->flags & FEATURE_JOURNAL) {
+        journal_blocks = sb->journal_blocks;
+        if (sb->journal_start != sb->inode_table_start + sb->inode_table_blocks ||
+            journal_blocks < MIN_JOURNAL_BLOCKS) {
+            printf("Error: Journal layout is inconsistent\n");
+            return -1;
+        }
+    }
+
+    if (sb->total_blocks == 0 || sb->total_blocks > file_size / BS) {
+        printf("Error: Image holds %lu blocks but the superblock claims %lu\n",
+               (unsigned long)(file_size / BS), (unsigned long)sb->total_blocks);
+        return -1;
+    }
+    if (sb->inode_bitmap_start != 1 ||
+        sb->data_bitmap_start != sb->inode_bitmap_start + sb->inode_bitmap_blocks ||
+        sb->inode_table_start != sb->data_bitmap_start + sb->data_bitmap_blocks ||
+        sb->data_region_start != sb->inode_table_start + sb->inode_table_blocks + journal_blocks ||
+        sb->data_region_start + sb->data_region_blocks > sb->total_blocks ||
+        sb->inode_count == 0 || sb->data_region_blocks == 0 ||
+        sb->inode_count > sb->inode_bitmap_blocks * BS * 8 ||
+        sb->inode_count * INODE_SIZE > sb->inode_table_blocks * BS ||
+        sb->data_region_blocks > sb->data_bitmap_blocks * BS * 8 ||
+        sb->root_inode != ROOT_INO) {
+        printf("Error: Superblock layout is inconsistent\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * A committed transaction whose blocks differ from their home copies means
+ * the image was not closed cleanly; the metadata checked here is then the
+ * state before that transaction.
+ */
+static void check_journal(check_ctx_t* ctx) {
+    uint64_t half = ctx->sb.journal_blocks / 2;
+    journal_txn_t txn, newest = {0};
+    for (uint64_t h = 0; h < 2; h++) {
+        const uint8_t* p = block_at(ctx, ctx->sb.journal_start + h * half);
+        if (vsfs_journal_parse(p, half, &txn) == 0 && txn.sequence > newest.sequence) newest = txn;
+    }
+    for (uint64_t i = 0; i < newest.nblocks; i++) {
+        uint64_t target;
+        memcpy(&target, newest.targets + i * sizeof(target), sizeof(target));
+        target = le64toh(target);
+        if (target >= ctx->sb.total_blocks) {
+            report(ctx, "journal transaction %lu targets block %lu outside the image",
+                   (unsigned long)newest.sequence, (unsigned long)target);
+            return;
+        }
+        if (memcmp(block_at(ctx, target), newest.data + i * BS, BS) != 0) {
+            printf("Note: journal transaction %lu has not been replayed; opening the image read-write applies it\n",
+                   (unsigned long)newest.sequence);
+            return;
+        }
+    }
+}
+
+/* Every data-region block must be marked used exactly when some inode references it. */
+static void check_data_bitmap(check_ctx_t* ctx) {
+    for (uint64_t bit = 0; bit < ctx->sb.data_region_blocks; bit++) {
+        if (bit % 64 == 0 && bit + 64 <= ctx->sb.data_region_blocks) {
+            uint64_t used;
+            memcpy(&used, ctx->data_bitmap + bit / 8, sizeof(used));
+            if (le64toh(used) == ctx->block_refs[bit / 64] && ctx->shared_refs[bit / 64] == 0) {
+                bit += 63;
+                continue;
+            }
+        }
+        int used = bit_is_set(ctx->data_bitmap, bit);
+        int referenced = (ctx->block_refs[bit / 64] >> (bit % 64)) & 1;
+        int shared = (ctx->shared_refs[bit / 64] >> (bit % 64)) & 1;
+        if (referenced && shared) {
+            report(ctx, "shared block %lu is also used as a private block", (unsigned long)(ctx->sb.data_region_start + bit));
+        }
+        if (used && !referenced && !shared) {
+            report(ctx, "block %lu is marked used but not referenced", (unsigned long)(ctx->sb.data_region_start + bit));
+        }
+    }
+}
+
+static void check_inode_refs(check_ctx_t* ctx) {
+    for (uint64_t i = 0; i < ctx->sb.inode_count; i++) {
+        if (bit_is_set(ctx->inode_bitmap, i) && !ctx->inode_refs[i]) {
+            report(ctx, "inode %lu is allocated but not linked from any directory", (unsigned long)(i + 1));
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    char* image_name = NULL;
+    uint64_t threads = 0;
+
+    if (parse_args(argc, argv, &image_name, &threads) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (uint64_t)n : 1;
+        if (threads > MAX_THREADS) threads = MAX_THREADS;
+    }
+
+    crc32_init();
+
+    int fd = open(image_name, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open image");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < BS) {
+        printf("Error: '%s' is too small to be a filesystem image\n", image_name);
+        close(fd);
+        return 1;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map image");
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    check_ctx_t ctx = {0};
+    ctx.image = map;
+    memcpy(&ctx.sb, map, sizeof(ctx.sb));
+    pthread_mutex_init(&ctx.print_lock, NULL);
+
+    int rc = 1;
+    worker_t* workers = NULL;
+    if (check_superblock(&ctx, (uint64_t)st.st_size) != 0) goto out;
+
+    ctx.inode_bitmap = block_at(&ctx, ctx.sb.inode_bitmap_start);
+    ctx.data_bitmap = block_at(&ctx, ctx.sb.data_bitmap_start);
+    ctx.block_refs = calloc((ctx.sb.data_region_blocks + 63) / 64, sizeof(uint64_t));
+    ctx.shared_refs = calloc((ctx.sb.data_region_blocks + 63) / 64, sizeof(uint64_t));
+    ctx.inode_refs = calloc(ctx.sb.inode_count, 1);
+    workers = calloc(threads, sizeof(worker_t));
+    if (!ctx.block_refs || !ctx.shared_refs || !ctx.inode_refs || !workers) {
+        perror("Failed to allocate checker state");
+        goto out;
+    }
+    madvise((void*)block_at(&ctx, ctx.sb.inode_table_start), ctx.sb.inode_table_blocks * BS, MADV_WILLNEED);
+
+    if (!bit_is_set(ctx.inode_bitmap, ROOT_INO - 1)) {
+        report(&ctx, "root inode is not allocated");
+    }
+    ctx.inode_refs[ROOT_INO - 1] = 1;
+
+    if (threads > ctx.sb.inode_count) threads = ctx.sb.inode_count;
+    uint64_t per_thread = (ctx.sb.inode_count + threads - 1) / threads;
+    uint64_t started = 0;
+    for (uint64_t t = 0; t < threads; t++) {
+        workers[t].ctx = &ctx;
+        workers[t].first_ino = t * per_thread + 1;
+        workers[t].last_ino = (t + 1) * per_thread;
+        if (workers[t].first_ino > ctx.sb.inode_count) break;
+        if (workers[t].last_ino > ctx.sb.inode_count) workers[t].last_ino = ctx.sb.inode_count;
+        /* Worker 0 runs on the main thread, as does any range whose thread fails to start. */
+        if (t > 0) workers[t].spawned = pthread_create(&workers[t].thread, NULL, check_worker, &workers[t]) == 0;
+        started = t + 1;
+    }
+    for (uint64_t t = 0; t < started; t++) {
+        if (!workers[t].spawned) check_worker(&workers[t]);
+    }
+
+    uint64_t inodes = 0, dirents = 0, bytes = ctx.sb.data_region_start * BS;
+    for (uint64_t t = 0; t < started; t++) {
+        if (workers[t].spawned) pthread_join(workers[t].thread, NULL);
+        inodes += workers[t].inodes_checked;
+        dirents += workers[t].dirents_checked;
+        bytes += workers[t].bytes_scanned;
+    }
+
+    check_data_bitmap(&ctx);
+    check_inode_refs(&ctx);
+    if (ctx.sb.flags & FEATURE_JOURNAL) check_journal(&ctx);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+
+    printf("Checked %lu inodes and %lu directory entries with %lu thread(s)\n",
+           (unsigned long)inodes, (unsigned long)dirents, (unsigned long)started);
+    printf("Scanned %.1f MiB of metadata in %.3f s (%.1f MiB/s, %.0f inodes/s)\n",
+           bytes / 1048576.0, secs, bytes / 1048576.0 / secs, inodes / secs);
+
+    if (ctx.errors) {
+        printf("%lu error(s) found in '%s'\n", (unsigned long)ctx.errors, image_name);
+    } else {
+        printf("Filesystem image '%s' is clean\n", image_name);
+        rc = 0;
+    }
+
+out:
+    free(workers);
+    free(ctx.block_refs);
+    free(ctx.shared_refs);
+    free(ctx.inode_refs);
+    pthread_mutex_destroy(&ctx.print_lock);
+    munmap(map, (size_t)st.st_size);
+    return rc;
+}
@@ -0,0 +1,226 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vsfs.h"
+
+#define OUTPUT_BUFFER (1u << 20)
+
+/* One read-only mapped image. */
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    superblock_t sb;
+} image_t;
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --base <image> --target <image> --output <delta>\n", program_name);
+    printf("  --base: the image the delta will be applied to\n");
+    printf("  --target: the image the delta turns it into; both must have the same layout\n");
+    printf("  --output: the delta file to write\n");
+}
+
+int parse_args(int argc, char* argv[], char** base_name, char** target_name, char** output_name) {
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) return -1;
+        if (strcmp(argv[i], "--base") == 0) {
+            *base_name = argv[i + 1];
+        } else if (strcmp(argv[i], "--target") == 0) {
+            *target_name = argv[i + 1];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            *output_name = argv[i + 1];
+        } else {
+            return -1;
+        }
+    }
+    return *base_name && *target_name && *output_name ? 0 : -1;
+}
+
+/*
+ * Map an image privately. A target with an unreplayed journal transaction is
+ * compared as replay would leave it; a base must already be replayed, since
+ * mkfs_patch checks the delta against the blocks actually on disk.
+ */
+int map_image(image_t* img, const char* name, int is_base) {
+    memset(img, 0, sizeof(*img));
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Failed to open image '%s': %s\n", name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < BS) {
+        printf("Error: '%s' is too small to be a filesystem image\n", name);
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map image");
+        return -1;
+    }
+    img->data = map;
+    img->size = (size_t)st.st_size;
+    memcpy(&img->sb, map, sizeof(img->sb));
+    if (img->sb.magic != VSFS_MAGIC || img->sb.block_size != BS || img->sb.total_blocks * BS > img->size ||
+        img->sb.data_region_start > img->sb.total_blocks ||
+        img->sb.data_region_start + img->sb.data_region_blocks > img->sb.total_blocks ||
+        (img->sb.data_bitmap_start + img->sb.data_bitmap_blocks) * BS > img->size ||
+        img->sb.data_bitmap_blocks * BS * 8 < img->sb.data_region_blocks) {
+        printf("Error: '%s' is not a valid filesystem image\n", name);
+        munmap(map, img->size);
+        img->data = NULL;
+        return -1;
+    }
+    journal_txn_t txn;
+    int pending = vsfs_journal_pending(map, &img->sb, &txn);
+    if (pending < 0 || (pending && is_base)) {
+        if (pending < 0) printf("Error: '%s' has a corrupt journal transaction\n", name);
+        else printf("Error: '%s' has a journal transaction that has not been replayed; open it read-write once, "
+                    "for example with mkfs_adder, before making a delta against it\n", name);
+        munmap(map, img->size);
+        img->data = NULL;
+        return -1;
+    }
+    if (pending) {
+        vsfs_journal_apply(map, &txn);
+        memcpy(&img->sb, map, sizeof(img->sb));
+        printf("Note: journal transaction %lu of '%s' has not been replayed; the delta includes it\n",
+               (unsigned long)txn.sequence, name);
+    }
+    mprotect(map, img->size, PROT_READ);
+    madvise(map, img->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+/* A delta only patches blocks in place, so every region must start and end at the same block. */
+static int same_layout(const superblock_t* a, const superblock_t* b) {
+    return a->total_blocks == b->total_blocks && a->inode_count == b->inode_count &&
+           a->inode_bitmap_start == b->inode_bitmap_start && a->data_bitmap_start == b->data_bitmap_start &&
+           a->inode_table_start == b->inode_table_start && a->journal_start == b->journal_start &&
+           a->data_region_start == b->data_region_start && a->data_region_blocks == b->data_region_blocks;
+}
+
+static int block_is_zero(const uint8_t* p) {
+    static const uint8_t zero[BS];
+    return memcmp(p, zero, BS) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* base_name = NULL;
+    char* target_name = NULL;
+    char* output_name = NULL;
+
+    if (parse_args(argc, argv, &base_name, &target_name, &output_name) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    crc32_init();
+
+    image_t base, target;
+    if (map_image(&base, base_name, 1) != 0) return 1;
+    if (map_image(&target, target_name, 0) != 0) {
+        munmap((void*)base.data, base.size);
+        return 1;
+    }
+
+    int rc = 1;
+    FILE* out = NULL;
+    char* outbuf = NULL;
+    if (!same_layout(&base.sb, &target.sb)) {
+        printf("Error: '%s' and '%s' have different layouts; a delta needs images built with the same size and "
+               "inode count\n", base_name, target_name);
+        goto out;
+    }
+    out = fopen(output_name, "wb");
+    outbuf = malloc(OUTPUT_BUFFER);
+    if (!out || !outbuf) {
+        perror("Failed to create delta file");
+        goto out;
+    }
+    setvbuf(out, outbuf, _IOFBF, OUTPUT_BUFFER);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* The header is rewritten with the record count once every block has been compared. */
+    delta_header_t hdr = {0};
+    hdr.magic = VSFS_DELTA_MAGIC;
+    hdr.version = VSFS_DELTA_VERSION;
+    hdr.block_size = BS;
+    hdr.total_blocks = target.sb.total_blocks;
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) goto write_error;
+
+    /*
+     * Metadata blocks, the journal included, are always compared. In the data
+     * region only blocks the target's bitmap marks used matter: whatever the
+     * base holds in a block the target leaves free is never read.
+     */
+    const superblock_t* sb = &target.sb;
+    const uint8_t* bitmap = target.data + sb->data_bitmap_start * BS;
+    uint64_t data_end = sb->data_region_start + sb->data_region_blocks;
+    uint64_t compared = 0;
+    uint64_t bytes = sizeof(hdr);
+    for (uint64_t b = 0; b < sb->total_blocks; b++) {
+        if (b >= sb->data_region_start && b < data_end) {
+            uint64_t bit = b - sb->data_region_start;
+            if (bit % 8 == 0 && bit + 8 <= sb->data_region_blocks && bitmap[bit / 8] == 0) {
+                b += 7;
+                continue;
+            }
+            if (!((bitmap[bit / 8] >> (bit % 8)) & 1)) continue;
+        }
+        compared++;
+        const uint8_t* old = base.data + b * BS;
+        const uint8_t* new = target.data + b * BS;
+        if (memcmp(old, new, BS) == 0) continue;
+
+        delta_record_t rec = {0};
+        rec.block = b;
+        rec.base_crc = crc32(old, BS);
+        rec.crc = crc32(new, BS);
+        rec.flags = block_is_zero(new) ? DELTA_ZERO : 0;
+        if (fwrite(&rec, sizeof(rec), 1, out) != 1) goto write_error;
+        if (!(rec.flags & DELTA_ZERO) && fwrite(new, BS, 1, out) != 1) goto write_error;
+        bytes += sizeof(rec) + (rec.flags & DELTA_ZERO ? 0 : BS);
+        hdr.nrecords++;
+    }
+
+    hdr.crc = crc32(&hdr, sizeof(hdr));
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1) goto write_error;
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto write_error;
+    }
+    out = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("Compared %lu of %lu blocks in %.3f s: %lu changed\n", (unsigned long)compared,
+           (unsigned long)sb->total_blocks, secs, (unsigned long)hdr.nrecords);
+    printf("Delta written to '%s': %.1f KiB (%.2f%% of the image)\n", output_name, bytes / 1024.0,
+           100.0 * bytes / (sb->total_blocks * BS));
+    rc = 0;
+    goto out;
+
+write_error:
+    perror("Failed to write delta file");
+
+out:
+    if (out) fclose(out);
+    free(outbuf);
+    munmap((void*)base.data, base.size);
+    munmap((void*)target.data, target.size);
+    return rc;
+}
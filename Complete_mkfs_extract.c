@@ -0,0 +1,413 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "vsfs.h"
+
+#define MAX_THREADS 256
+#define MAX_DEPTH 1024
+
+/*
+ * One file or directory to extract; a file's block map is resolved up front
+ * because the block cache is single-threaded.
+ */
+typedef struct {
+    char* name;                   /* path below the root directory */
+    int is_dir;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t* blocks;
+    uint8_t* packed;              /* contents of an inline or tail-packed file */
+    inode_t inode;                /* for decoding a compressed file */
+} job_t;
+
+typedef struct {
+    job_t* items;
+    uint64_t count;
+    uint64_t cap;
+    uint64_t skipped;             /* directory entries whose names cannot be a path component */
+} job_list_t;
+
+typedef struct {
+    vsfs_t* fs;
+    const char* out_dir;
+    job_t* jobs;
+    uint64_t count;
+    uint64_t next;                /* next job to claim, shared by the workers */
+    uint64_t failed;
+} extract_ctx_t;
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image> [--file <name>]... [--output <dir>] [--threads <n>]\n", program_name);
+    printf("  --image: the filesystem image to read\n");
+    printf("  --file: a file or directory to extract, as a path from the root (may be repeated; default: all)\n");
+    printf("  --output: directory to extract into (default: concatenate to stdout)\n");
+    printf("  --threads: number of files extracted in parallel into --output (default: online CPUs)\n");
+}
+
+int parse_args(int argc, char* argv[], char** image_name, char** out_dir, uint64_t* threads,
+               char*** names, uint64_t* name_count) {
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) return -1;
+        if (strcmp(argv[i], "--image") == 0) {
+            *image_name = argv[i + 1];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            *out_dir = argv[i + 1];
+        } else if (strcmp(argv[i], "--file") == 0) {
+            char** list = realloc(*names, (*name_count + 1) * sizeof(char*));
+            if (!list) return -1;
+            *names = list;
+            (*names)[(*name_count)++] = argv[i + 1];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            char* end;
+            *threads = strtoull(argv[i + 1], &end, 10);
+            if (*end != '\0' || *threads == 0 || *threads > MAX_THREADS) return -1;
+        } else {
+            return -1;
+        }
+    }
+    return *image_name ? 0 : -1;
+}
+
+static int write_all(int fd, const uint8_t* buf, uint64_t len) {
+    for (uint64_t done = 0; done < len; ) {
+        ssize_t n = write(fd, buf + done, len - done);
+        if (n <= 0) return -EIO;
+        done += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int copy_job(vsfs_t* fs, const job_t* job, int out) {
+    if (job->packed) return write_all(out, job->packed, job->size);
+    if (vsfs_inode_codec(&job->inode)) return vsfs_copy_out_compressed(fs, &job->inode, job->blocks, out);
+    return vsfs_copy_out(fs, job->blocks, job->size, out);
+}
+
+static int extract_one(extract_ctx_t* ctx, job_t* job) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", ctx->out_dir, job->name);
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        printf("Error: Failed to create '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    int rc = copy_job(ctx->fs, job, out);
+    if (rc == 0) {
+        struct timespec times[2] = { { (time_t)job->mtime, 0 }, { (time_t)job->mtime, 0 } };
+        futimens(out, times);
+    }
+    if (close(out) != 0 && rc == 0) rc = -errno;
+    if (rc != 0) {
+        printf("Error: Failed to extract '%s': %s\n", job->name, strerror(-rc));
+        return -1;
+    }
+    return 0;
+}
+
+static void* extract_worker(void* arg) {
+    extract_ctx_t* ctx = arg;
+    for (;;) {
+        uint64_t i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+        if (i >= ctx->count) break;
+        if (ctx->jobs[i].is_dir) continue;
+        if (extract_one(ctx, &ctx->jobs[i]) != 0) __atomic_fetch_add(&ctx->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static job_t* job_push(job_list_t* list, const char* path, uint64_t ino, int is_dir) {
+    if (list->count == list->cap) {
+        uint64_t cap = list->cap ? list->cap * 2 : 64;
+        job_t* items = realloc(list->items, cap * sizeof(job_t));
+        if (!items) return NULL;
+        list->items = items;
+        list->cap = cap;
+    }
+    job_t* job = &list->items[list->count];
+    memset(job, 0, sizeof(*job));
+    job->name = strdup(path);
+    if (!job->name) return NULL;
+    job->ino = ino;
+    job->is_dir = is_dir;
+    list->count++;
+    return job;
+}
+
+static void job_list_free(job_list_t* list) {
+    for (uint64_t i = 0; i < list->count; i++) {
+        free(list->items[i].name);
+        free(list->items[i].blocks);
+        free(list->items[i].packed);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+/* Read a file's inode and resolve its block map, or its packed contents. */
+static int load_file_job(vsfs_t* fs, job_t* job) {
+    inode_t inode;
+    int rc;
+    if ((rc = vsfs_inode_read(fs, job->ino, &inode)) != 0) return rc;
+    if ((inode.mode & 0170000) != 0100000) {
+        printf("Error: '%s' is not a regular file\n", job->name);
+        return -EISDIR;
+    }
+    job->size = inode.size_bytes;
+    job->mtime = inode.mtime;
+    job->inode = inode;
+    if (vsfs_inode_packed(&inode)) {
+        job->packed = malloc(job->size ? job->size : 1);
+        if (!job->packed) return -ENOMEM;
+        if ((rc = vsfs_packed_read(fs, &inode, job->packed)) != 0) {
+            printf("Error: Failed to read packed file '%s': %s\n", job->name, strerror(-rc));
+        }
+        return rc;
+    }
+    if (vsfs_inode_codec(&inode) && !vsfs_codec_available(vsfs_inode_codec(&inode))) {
+        printf("Error: '%s' is compressed with the unsupported '%s' codec\n", job->name,
+               vsfs_codec_name(vsfs_inode_codec(&inode)));
+        return -EOPNOTSUPP;
+    }
+    uint64_t nblocks = vsfs_file_blocks(&inode);
+    if (nblocks > vsfs_max_file_blocks(&fs->sb)) return -EIO;
+    job->blocks = malloc((nblocks ? nblocks : 1) * sizeof(uint32_t));
+    if (!job->blocks) return -ENOMEM;
+    if ((rc = vsfs_block_map_read(fs, &inode, nblocks, job->blocks)) != 0) {
+        printf("Error: Failed to read the block map of '%s': %s\n", job->name, strerror(-rc));
+    }
+    return rc;
+}
+
+/*
+ * A name from the image becomes one component of an output path, so it must
+ * not be empty, "." or "..", or contain a '/'; otherwise a crafted image could
+ * write outside the output directory.
+ */
+static int name_is_safe(const char* name) {
+    return name[0] && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && !strchr(name, '/');
+}
+
+/* Queue everything below directory dir_ino, each directory before its contents; unsafe names are skipped. */
+static int collect_tree(vsfs_t* fs, uint64_t dir_ino, const char* prefix, job_list_t* jobs, unsigned depth) {
+    dirent64_t* entries = NULL;
+    uint64_t nentries = 0;
+    int rc = vsfs_dir_list(fs, dir_ino, &entries, &nentries);
+    if (rc != 0) {
+        printf("Error: Failed to read directory '%s': %s\n", *prefix ? prefix : "/", strerror(-rc));
+        return rc;
+    }
+    if (depth > MAX_DEPTH) {
+        printf("Error: Directory '%s' is nested too deeply\n", prefix);
+        rc = -ELOOP;
+    }
+    for (uint64_t i = 0; i < nentries && rc == 0; i++) {
+        if (!name_is_safe(entries[i].name)) {
+            printf("Error: Skipping entry '%s' in '%s': not a valid file name\n", entries[i].name,
+                   *prefix ? prefix : "/");
+            jobs->skipped++;
+            continue;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "", entries[i].name);
+        int is_dir = entries[i].type == DIRENT_DIR;
+        job_t* job = job_push(jobs, path, entries[i].inode_no, is_dir);
+        if (!job) {
+            rc = -ENOMEM;
+        } else if (is_dir) {
+            rc = collect_tree(fs, entries[i].inode_no, path, jobs, depth + 1);
+        } else {
+            rc = load_file_job(fs, job);
+        }
+    }
+    free(entries);
+    return rc;
+}
+
+/* Queue one named path: a file, or a directory with everything below it, after its parent directories. */
+static int collect_path(vsfs_t* fs, const char* path, job_list_t* jobs) {
+    char prefix[4096];
+    uint64_t ino = ROOT_INO;
+    int rc = 0;
+    for (const char* p = path; *p && rc == 0; ) {
+        size_t len = strcspn(p, "/");
+        const char* next = p + len + (p[len] == '/');
+        char name[58];
+        snprintf(name, sizeof(name), "%.*s", (int)(len < VSFS_NAME_MAX ? len : VSFS_NAME_MAX), p);
+        snprintf(prefix, sizeof(prefix), "%.*s", (int)(p + len - path), path);
+        if (len == 0) {
+            p = next;
+            continue;
+        }
+        if (!name_is_safe(name)) {
+            printf("Error: '%s' is not a valid path in the filesystem\n", path);
+            rc = -EINVAL;
+            break;
+        }
+        if ((rc = vsfs_dir_lookup(fs, ino, name, &ino)) != 0) {
+            printf("Error: '%s' not found in the filesystem\n", prefix);
+            break;
+        }
+        inode_t inode;
+        if ((rc = vsfs_inode_read(fs, ino, &inode)) != 0) break;
+        int is_dir = (inode.mode & 0170000) == 0040000;
+        job_t* job = job_push(jobs, prefix, ino, is_dir);
+        if (!job) {
+            rc = -ENOMEM;
+        } else if (!is_dir) {
+            if (*next) {
+                printf("Error: '%s' is not a directory\n", prefix);
+                rc = -ENOTDIR;
+            } else {
+                rc = load_file_job(fs, job);
+            }
+        } else if (!*next) {
+            rc = collect_tree(fs, ino, prefix, jobs, 0);
+        }
+        p = next;
+    }
+    if (rc == 0 && ino == ROOT_INO) rc = collect_tree(fs, ROOT_INO, "", jobs, 0);
+    return rc;
+}
+
+/* Resolve the requested paths (or the whole tree) into jobs with their block maps. */
+static int collect_jobs(vsfs_t* fs, char** names, uint64_t name_count, job_list_t* jobs) {
+    int rc = name_count ? 0 : collect_tree(fs, ROOT_INO, "", jobs, 0);
+    for (uint64_t i = 0; i < name_count && rc == 0; i++) rc = collect_path(fs, names[i], jobs);
+    if (rc != 0) {
+        job_list_free(jobs);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* image_name = NULL;
+    char* out_dir = NULL;
+    uint64_t threads = 0;
+    char** names = NULL;
+    uint64_t name_count = 0;
+
+    if (parse_args(argc, argv, &image_name, &out_dir, &threads, &names, &name_count) != 0) {
+        print_usage(argv[0]);
+        free(names);
+        return 1;
+    }
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (uint64_t)n : 1;
+        if (threads > MAX_THREADS) threads = MAX_THREADS;
+    }
+    /* File contents keep the original stdout; messages go to stderr instead. */
+    int data_fd = -1;
+    if (!out_dir && ((data_fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)) {
+        perror("Failed to redirect messages");
+        free(names);
+        return 1;
+    }
+
+    crc32_init();
+
+    vsfs_t fs;
+    int rc = vsfs_open(&fs, image_name, VSFS_OPEN_RDONLY);
+    if (rc != 0) {
+        printf("Error: Failed to open image '%s': %s\n", image_name, strerror(-rc));
+        free(names);
+        return 1;
+    }
+    if (fs.overlay_buf) {
+        printf("Note: journal transaction %lu has not been replayed; extracting the image as replay would leave it\n",
+               (unsigned long)fs.overlay.sequence);
+    }
+
+    job_list_t list = { 0 };
+    rc = 1;
+    if (collect_jobs(&fs, names, name_count, &list) != 0) goto out;
+    job_t* jobs = list.items;
+    uint64_t count = list.count;
+    if (out_dir && mkdir(out_dir, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create output directory");
+        goto out;
+    }
+    /* Directories are created up front, parents first, so workers only ever create files. */
+    for (uint64_t i = 0; out_dir && i < count; i++) {
+        if (!jobs[i].is_dir) continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", out_dir, jobs[i].name);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            printf("Error: Failed to create directory '%s': %s\n", path, strerror(errno));
+            goto out;
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    extract_ctx_t ctx = { .fs = &fs, .out_dir = out_dir, .jobs = jobs, .count = count };
+    if (!out_dir) {
+        for (uint64_t i = 0; i < count; i++) {
+            if (jobs[i].is_dir) continue;
+            if (copy_job(&fs, &jobs[i], data_fd) != 0) {
+                printf("Error: Failed to write '%s' to stdout\n", jobs[i].name);
+                ctx.failed++;
+                break;
+            }
+        }
+    } else {
+        if (threads > count) threads = count ? count : 1;
+        pthread_t* tids = calloc(threads, sizeof(pthread_t));
+        int* spawned = calloc(threads, sizeof(int));
+        if (!tids || !spawned) {
+            free(tids);
+            free(spawned);
+            perror("Failed to allocate worker state");
+            goto out;
+        }
+        /* The main thread is worker 0 and also covers any thread that fails to start. */
+        for (uint64_t t = 1; t < threads; t++) {
+            spawned[t] = pthread_create(&tids[t], NULL, extract_worker, &ctx) == 0;
+        }
+        extract_worker(&ctx);
+        for (uint64_t t = 1; t < threads; t++) {
+            if (spawned[t]) pthread_join(tids[t], NULL);
+        }
+        free(tids);
+        free(spawned);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    uint64_t bytes = 0;
+    uint64_t nfiles = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (jobs[i].is_dir) continue;
+        bytes += jobs[i].size;
+        nfiles++;
+    }
+
+    if (ctx.failed) {
+        printf("%lu of %lu file(s) could not be extracted\n", (unsigned long)ctx.failed, (unsigned long)nfiles);
+    } else {
+        printf("Extracted %lu file(s), %.1f MiB in %.3f s (%.1f MiB/s)\n", (unsigned long)nfiles,
+               bytes / 1048576.0, secs, bytes / 1048576.0 / secs);
+        if (list.skipped) printf("%lu entr(ies) with invalid names were skipped\n", (unsigned long)list.skipped);
+        rc = list.skipped ? 1 : 0;
+    }
+
+out:
+    job_list_free(&list);
+    free(names);
+    vsfs_close(&fs);
+    return rc;
+}
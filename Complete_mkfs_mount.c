@@ -0,0 +1,561 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+
+#include "vsfs.h"
+
+/*
+ * Read-only view of one image, shared by all FUSE worker threads. Everything
+ * except the per-inode block and frame maps is built before fuse_main() starts
+ * and never changes; those are resolved on first open and published with a CAS.
+ */
+typedef struct {
+    const uint8_t* image;
+    superblock_t sb;
+    uint32_t** block_maps;        /* per inode, NULL until first resolved */
+    uint64_t** frame_maps;        /* per compressed inode: stream offset of each frame, then the stream size */
+    struct {
+        const dirent64_t* de;
+        uint32_t parent;
+        uint32_t hash;
+    }* names;                     /* open-addressed (parent, name) index of every directory */
+    uint64_t names_mask;
+    uint64_t names_count;         /* files */
+    uint64_t dirs_count;
+} mount_ctx_t;
+
+static mount_ctx_t g_ctx;
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image> <mountpoint> [FUSE options]\n", program_name);
+    printf("  --image: the filesystem image to mount read-only\n");
+    printf("  FUSE options such as -f (foreground) or -s (single-threaded) are passed on\n");
+}
+
+static const uint8_t* block_at(uint64_t block) {
+    return g_ctx.image + block * BS;
+}
+
+static int block_ok(uint64_t block) {
+    return block >= g_ctx.sb.data_region_start && block < g_ctx.sb.data_region_start + g_ctx.sb.data_region_blocks;
+}
+
+static int inode_get(uint64_t ino, inode_t* out) {
+    if (ino == 0 || ino > g_ctx.sb.inode_count) return -ENOENT;
+    memcpy(out, block_at(g_ctx.sb.inode_table_start) + (ino - 1) * INODE_SIZE, sizeof(*out));
+    return 0;
+}
+
+static int copy_ptrs(uint32_t block, uint32_t* out, uint64_t n) {
+    if (!block_ok(block)) return -EIO;
+    memcpy(out, block_at(block), n * sizeof(uint32_t));
+    return 0;
+}
+
+/* Same walk as vsfs_block_map_read(), straight from the mapping. */
+static int map_blocks(const inode_t* ino, uint64_t count, uint32_t* out) {
+    uint64_t pos = 0;
+    for (; pos < count && pos < DIRECT_MAX; pos++) out[pos] = ino->direct[pos];
+    if (pos < count) {
+        uint64_t n = count - pos < PTRS_PER_BLOCK ? count - pos : PTRS_PER_BLOCK;
+        if (copy_ptrs(ino->reserved_0, out + pos, n) != 0) return -EIO;
+        pos += n;
+    }
+    if (pos < count) {
+        uint32_t dbl[PTRS_PER_BLOCK];
+        if (copy_ptrs(ino->reserved_1, dbl, PTRS_PER_BLOCK) != 0) return -EIO;
+        for (uint64_t j = 0; j < PTRS_PER_BLOCK && pos < count; j++) {
+            uint64_t n = count - pos < PTRS_PER_BLOCK ? count - pos : PTRS_PER_BLOCK;
+            if (copy_ptrs(dbl[j], out + pos, n) != 0) return -EIO;
+            pos += n;
+        }
+    }
+    if (pos < count) return -EFBIG;
+    for (uint64_t i = 0; i < count; i++) {
+        if (!block_ok(out[i])) return -EIO;
+    }
+    return 0;
+}
+
+static uint64_t inode_blocks(const inode_t* ino) {
+    if (vsfs_inode_packed(ino)) return 0;
+    if ((ino->mode & 0170000) == 0040000) {
+        return (ino->reserved_2 & INODE_FLAG_HASHED_DIR) ? 1ull << (ino->reserved_2 >> INODE_DIR_DEPTH_SHIFT) : 1;
+    }
+    return vsfs_file_blocks(ino);
+}
+
+/* Cached block map of a regular file; the first thread to publish one wins. */
+static const uint32_t* file_block_map(uint64_t ino, const inode_t* inode) {
+    uint32_t* map = __atomic_load_n(&g_ctx.block_maps[ino - 1], __ATOMIC_ACQUIRE);
+    if (map) return map;
+
+    uint64_t count = inode_blocks(inode);
+    if (count > vsfs_max_file_blocks(&g_ctx.sb)) return NULL;
+    map = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!map) return NULL;
+    if (map_blocks(inode, count, map) != 0) {
+        free(map);
+        return NULL;
+    }
+    uint32_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(&g_ctx.block_maps[ino - 1], &expected, map, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(map);
+        map = expected;
+    }
+    return map;
+}
+
+/*
+ * Bytes [pos, pos + len) of a compressed stream: straight from the mapping
+ * when every block they span is one run, otherwise copied into scratch one
+ * run at a time.
+ */
+static const uint8_t* stream_at(const uint32_t* map, uint64_t pos, uint64_t len, uint8_t* scratch) {
+    uint64_t first = pos / BS, last = (pos + len - 1) / BS;
+    if (vsfs_block_run_length(map, first, last + 1) > last - first) return block_at(map[first]) + pos % BS;
+    for (uint64_t done = 0; done < len; ) {
+        uint64_t at = pos + done;
+        uint64_t n = vsfs_block_run_length(map, at / BS, last + 1) * BS - at % BS;
+        if (n > len - done) n = len - done;
+        memcpy(scratch + done, block_at(map[at / BS]) + at % BS, n);
+        done += n;
+    }
+    return scratch;
+}
+
+/* Frame offsets of a compressed file, found by walking the frame headers once. */
+static const uint64_t* file_frame_map(uint64_t ino, const inode_t* inode, const uint32_t* map) {
+    uint64_t* frames = __atomic_load_n(&g_ctx.frame_maps[ino - 1], __ATOMIC_ACQUIRE);
+    if (frames) return frames;
+
+    uint64_t nframes = (inode->size_bytes + VSFS_FRAME_SIZE - 1) / VSFS_FRAME_SIZE;
+    frames = malloc((nframes + 1) * sizeof(uint64_t));
+    if (!frames) return NULL;
+    uint64_t pos = 0, f = 0;
+    for (; f < nframes; f++) {
+        uint8_t header[4];
+        if (inode->xattr_ptr - pos < sizeof(header)) break;
+        frames[f] = pos;
+        uint64_t len = vsfs_frame_length(stream_at(map, pos, sizeof(header), header));
+        if (len - 4 > VSFS_FRAME_SIZE || len > inode->xattr_ptr - pos) break;
+        pos += len;
+    }
+    if (nframes == 0 || f != nframes || pos != inode->xattr_ptr) {
+        free(frames);
+        return NULL;
+    }
+    frames[nframes] = pos;
+    uint64_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(&g_ctx.frame_maps[ino - 1], &expected, frames, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(frames);
+        frames = expected;
+    }
+    return frames;
+}
+
+static uint32_t name_hash(uint64_t parent, const char* name) {
+    return vsfs_dir_hash(name) ^ (uint32_t)(parent * 2654435761u);
+}
+
+static const dirent64_t* name_lookup(uint64_t parent, const char* name) {
+    uint32_t h = name_hash(parent, name);
+    for (uint64_t i = h & g_ctx.names_mask; g_ctx.names[i].de; i = (i + 1) & g_ctx.names_mask) {
+        if (g_ctx.names[i].hash == h && g_ctx.names[i].parent == parent &&
+            strncmp(g_ctx.names[i].de->name, name, 58) == 0) {
+            return g_ctx.names[i].de;
+        }
+    }
+    return NULL;
+}
+
+/* Block map of a directory inode, or NULL if it is not a usable directory. */
+static const uint32_t* dir_block_map(uint64_t ino, inode_t* inode) {
+    if (inode_get(ino, inode) != 0 || (inode->mode & 0170000) != 0040000 ||
+        (inode->reserved_2 >> INODE_DIR_DEPTH_SHIFT) > MAX_DIR_DEPTH) {
+        return NULL;
+    }
+    return file_block_map(ino, inode);
+}
+
+/*
+ * Index every live entry of every directory reachable from the root by
+ * (parent inode, name), sized for a load factor of at most 1/2. A first pass
+ * finds the directories, breadth first; the second fills the table.
+ */
+static int build_name_index(void) {
+    uint32_t* dirs = malloc(g_ctx.sb.inode_count * sizeof(uint32_t));
+    uint8_t* seen = calloc(g_ctx.sb.inode_count + 1, 1);
+    if (!dirs || !seen) {
+        free(dirs);
+        free(seen);
+        return -ENOMEM;
+    }
+    uint64_t ndirs = 0;
+    uint64_t nentries = 0;
+    int rc = 0;
+    dirs[ndirs++] = ROOT_INO;
+    seen[ROOT_INO] = 1;
+    for (uint64_t d = 0; d < ndirs && rc == 0; d++) {
+        inode_t inode;
+        const uint32_t* blocks = dir_block_map(dirs[d], &inode);
+        if (!blocks) {
+            rc = -EIO;
+            break;
+        }
+        uint64_t nblocks = inode_blocks(&inode);
+        nentries += nblocks * DIRENTS_PER_BLOCK;
+        for (uint64_t b = 0; b < nblocks; b++) {
+            const dirent64_t* entries = (const dirent64_t*)block_at(blocks[b]);
+            for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+                uint64_t child = entries[i].inode_no;
+                if (entries[i].type != DIRENT_DIR || child == 0 || child > g_ctx.sb.inode_count || seen[child]) continue;
+                seen[child] = 1;
+                dirs[ndirs++] = (uint32_t)child;
+            }
+        }
+    }
+    free(seen);
+
+    uint64_t cap = 64;
+    while (cap < 2 * nentries) cap *= 2;
+    g_ctx.names = rc == 0 ? calloc(cap, sizeof(*g_ctx.names)) : NULL;
+    if (!g_ctx.names) {
+        free(dirs);
+        return rc ? rc : -ENOMEM;
+    }
+    g_ctx.names_mask = cap - 1;
+
+    for (uint64_t d = 0; d < ndirs; d++) {
+        inode_t inode;
+        const uint32_t* blocks = dir_block_map(dirs[d], &inode);
+        for (uint64_t b = 0; b < inode_blocks(&inode); b++) {
+            const dirent64_t* entries = (const dirent64_t*)block_at(blocks[b]);
+            for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+                const dirent64_t* de = &entries[i];
+                if (de->inode_no == 0 || memchr(de->name, '\0', sizeof(de->name)) == NULL) continue;
+                if (name_lookup(dirs[d], de->name)) continue;
+                uint32_t h = name_hash(dirs[d], de->name);
+                uint64_t slot = h & g_ctx.names_mask;
+                while (g_ctx.names[slot].de) slot = (slot + 1) & g_ctx.names_mask;
+                g_ctx.names[slot].de = de;
+                g_ctx.names[slot].parent = dirs[d];
+                g_ctx.names[slot].hash = h;
+                if (de->type != DIRENT_DIR) g_ctx.names_count++;
+            }
+        }
+    }
+    g_ctx.dirs_count = ndirs;
+    free(dirs);
+    return 0;
+}
+
+/* Inode number for a path, one component at a time from the root. */
+static int resolve(const char* path, uint64_t* ino) {
+    if (path[0] != '/') return -ENOENT;
+    uint64_t cur = ROOT_INO;
+    char name[58];
+    for (const char* p = path + 1; *p; ) {
+        size_t len = strcspn(p, "/");
+        if (len > VSFS_NAME_MAX) return -ENAMETOOLONG;
+        if (len) {
+            memcpy(name, p, len);
+            name[len] = '\0';
+            const dirent64_t* de = name_lookup(cur, name);
+            if (!de) return -ENOENT;
+            cur = de->inode_no;
+        }
+        p += len + (p[len] == '/');
+    }
+    *ino = cur;
+    return 0;
+}
+
+static void fill_stat(uint64_t ino, const inode_t* inode, struct stat* st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_mode = ((inode->mode & 0170000) == 0040000 ? S_IFDIR | 0555 : S_IFREG | 0444);
+    st->st_nlink = inode->links;
+    st->st_uid = inode->uid;
+    st->st_gid = inode->gid;
+    st->st_size = (off_t)inode->size_bytes;
+    st->st_blksize = BS;
+    st->st_blocks = (blkcnt_t)(inode_blocks(inode) * (BS / 512));
+    st->st_atime = (time_t)inode->atime;
+    st->st_mtime = (time_t)inode->mtime;
+    st->st_ctime = (time_t)inode->ctime;
+}
+
+static int vsfs_getattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
+    uint64_t ino;
+    inode_t inode;
+    int rc;
+    if (fi && fi->fh) {
+        ino = fi->fh;
+    } else if ((rc = resolve(path, &ino)) != 0) {
+        return rc;
+    }
+    if ((rc = inode_get(ino, &inode)) != 0) return rc;
+    fill_stat(ino, &inode, st);
+    return 0;
+}
+
+static int vsfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
+                        struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
+    (void)offset;
+    (void)fi;
+    (void)flags;
+    uint64_t ino;
+    inode_t inode;
+    int rc;
+    if ((rc = resolve(path, &ino)) != 0) return rc;
+    if ((rc = inode_get(ino, &inode)) != 0) return rc;
+    if ((inode.mode & 0170000) != 0040000) return -ENOTDIR;
+    const uint32_t* blocks = dir_block_map(ino, &inode);
+    if (!blocks) return -EIO;
+    for (uint64_t b = 0; b < inode_blocks(&inode); b++) {
+        const dirent64_t* entries = (const dirent64_t*)block_at(blocks[b]);
+        for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            const dirent64_t* de = &entries[i];
+            if (de->inode_no == 0 || memchr(de->name, '\0', sizeof(de->name)) == NULL) continue;
+            if (filler(buf, de->name, NULL, 0, 0) != 0) return 0;
+        }
+    }
+    return 0;
+}
+
+static int vsfs_fuse_open(const char* path, struct fuse_file_info* fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+    uint64_t ino;
+    inode_t inode;
+    int rc;
+    if ((rc = resolve(path, &ino)) != 0) return rc;
+    if ((rc = inode_get(ino, &inode)) != 0) return rc;
+    if ((inode.mode & 0170000) != 0100000) return -EISDIR;
+    unsigned codec = vsfs_inode_codec(&inode);
+    if (codec && !vsfs_codec_available(codec)) return -EOPNOTSUPP;
+    const uint32_t* map = vsfs_inode_packed(&inode) ? NULL : file_block_map(ino, &inode);
+    if (!vsfs_inode_packed(&inode) && !map) return -EIO;
+    if (codec && !file_frame_map(ino, &inode, map)) return -EIO;
+    fi->fh = ino;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+/*
+ * Decode every frame the request touches. A frame the request covers whole is
+ * decoded straight into the caller's buffer; others go through a scratch one.
+ */
+static int read_compressed(uint64_t ino, const inode_t* inode, const uint32_t* map, char* buf, size_t size, uint64_t off) {
+    const uint64_t* frames = file_frame_map(ino, inode, map);
+    uint8_t* scratch = malloc(VSFS_FRAME_SIZE + 4);
+    uint8_t* data = malloc(VSFS_FRAME_SIZE);
+    int rc = frames && scratch && data ? 0 : -EIO;
+
+    size_t done = 0;
+    while (done < size && rc == 0) {
+        uint64_t pos = off + done;
+        uint64_t f = pos / VSFS_FRAME_SIZE;
+        uint64_t start = f * VSFS_FRAME_SIZE;
+        uint64_t n = inode->size_bytes - start < VSFS_FRAME_SIZE ? inode->size_bytes - start : VSFS_FRAME_SIZE;
+        uint64_t len = frames[f + 1] - frames[f];
+        uint8_t* out = (pos == start && size - done >= n) ? (uint8_t*)buf + done : data;
+        if (vsfs_frame_decode(vsfs_inode_codec(inode), stream_at(map, frames[f], len, scratch), len, out, n) != 0) {
+            rc = -EIO;
+            break;
+        }
+        uint64_t k = n - (pos - start) < size - done ? n - (pos - start) : size - done;
+        if (out == data) memcpy(buf + done, data + (pos - start), k);
+        done += k;
+    }
+    free(scratch);
+    free(data);
+    return rc != 0 ? rc : (int)done;
+}
+
+/* Copy straight out of the mapping, one memcpy per run of consecutive blocks. */
+static int vsfs_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+    (void)path;
+    inode_t inode;
+    if (inode_get(fi->fh, &inode) != 0) return -EIO;
+    uint64_t off = (uint64_t)offset;
+    if (off >= inode.size_bytes) return 0;
+    if (size > inode.size_bytes - off) size = inode.size_bytes - off;
+
+    if (vsfs_inode_packed(&inode)) {
+        const uint8_t* data = (const uint8_t*)&inode + offsetof(inode_t, direct);
+        if (inode.reserved_2 & INODE_FLAG_TAIL) {
+            if (!block_ok(inode.direct[0]) || inode.direct[1] > BS || inode.size_bytes > BS - inode.direct[1]) return -EIO;
+            data = block_at(inode.direct[0]) + inode.direct[1];
+        } else if (inode.size_bytes > VSFS_INLINE_MAX) {
+            return -EIO;
+        }
+        memcpy(buf, data + off, size);
+        return (int)size;
+    }
+
+    const uint32_t* map = file_block_map(fi->fh, &inode);
+    if (!map) return -EIO;
+    if (vsfs_inode_codec(&inode)) return read_compressed(fi->fh, &inode, map, buf, size, off);
+
+    size_t done = 0;
+    while (done < size) {
+        uint64_t pos = off + done;
+        uint64_t i = pos / BS;
+        uint64_t run = 1;
+        uint64_t last = (off + size - 1) / BS;
+        while (i + run <= last && map[i + run] == map[i] + run) run++;
+        uint64_t len = run * BS - pos % BS;
+        if (len > size - done) len = size - done;
+        memcpy(buf + done, block_at(map[i]) + pos % BS, len);
+        done += len;
+    }
+    return (int)done;
+}
+
+static int vsfs_statfs(const char* path, struct statvfs* st) {
+    (void)path;
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = BS;
+    st->f_frsize = BS;
+    st->f_blocks = g_ctx.sb.total_blocks;
+    st->f_files = g_ctx.sb.inode_count;
+    st->f_namemax = 57;
+    st->f_flag = ST_RDONLY;
+    return 0;
+}
+
+static void* vsfs_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    (void)conn;
+    cfg->kernel_cache = 1;
+    cfg->use_ino = 1;
+    return NULL;
+}
+
+static const struct fuse_operations vsfs_ops = {
+    .init = vsfs_init,
+    .getattr = vsfs_getattr,
+    .readdir = vsfs_readdir,
+    .open = vsfs_fuse_open,
+    .read = vsfs_read,
+    .statfs = vsfs_statfs,
+};
+
+int main(int argc, char* argv[]) {
+    char* image_name = NULL;
+    char** fuse_argv = malloc((size_t)(argc + 2) * sizeof(char*));
+    int fuse_argc = 0;
+    if (!fuse_argv) {
+        perror("Failed to allocate arguments");
+        return 1;
+    }
+    fuse_argv[fuse_argc++] = argv[0];
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_name = argv[++i];
+        } else {
+            fuse_argv[fuse_argc++] = argv[i];
+        }
+    }
+    if (!image_name || fuse_argc < 2) {
+        print_usage(argv[0]);
+        free(fuse_argv);
+        return 1;
+    }
+    fuse_argv[fuse_argc++] = "-oro,default_permissions";
+    fuse_argv[fuse_argc] = NULL;
+
+    crc32_init();
+
+    /* vsfs_open() validates the superblock; the tool itself only uses the mapping. */
+    vsfs_t fs;
+    int rc = vsfs_open(&fs, image_name, VSFS_OPEN_RDONLY);
+    if (rc != 0) {
+        printf("Error: Failed to open image '%s': %s\n", image_name, strerror(-rc));
+        free(fuse_argv);
+        return 1;
+    }
+    g_ctx.sb = fs.sb;
+    vsfs_close(&fs);
+
+    int fd = open(image_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size < g_ctx.sb.total_blocks * BS) {
+        printf("Error: '%s' is shorter than its superblock claims\n", image_name);
+        if (fd >= 0) close(fd);
+        free(fuse_argv);
+        return 1;
+    }
+    /* Private, so an unreplayed transaction can be laid over the mapping without touching the file. */
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map image");
+        free(fuse_argv);
+        return 1;
+    }
+    journal_txn_t txn;
+    int pending = vsfs_journal_pending(map, &g_ctx.sb, &txn);
+    if (pending < 0) {
+        printf("Error: '%s' has a corrupt journal transaction\n", image_name);
+        munmap(map, (size_t)st.st_size);
+        free(fuse_argv);
+        return 1;
+    }
+    if (pending) {
+        vsfs_journal_apply(map, &txn);
+        printf("Note: journal transaction %lu has not been replayed; serving the image as replay would leave it\n",
+               (unsigned long)txn.sequence);
+    }
+    mprotect(map, (size_t)st.st_size, PROT_READ);
+    g_ctx.image = map;
+    madvise(map, g_ctx.sb.data_region_start * BS, MADV_WILLNEED);
+
+    rc = 1;
+    g_ctx.block_maps = calloc(g_ctx.sb.inode_count, sizeof(*g_ctx.block_maps));
+    g_ctx.frame_maps = calloc(g_ctx.sb.inode_count, sizeof(*g_ctx.frame_maps));
+    if (!g_ctx.block_maps || !g_ctx.frame_maps) {
+        perror("Failed to allocate inode cache");
+        goto out;
+    }
+    inode_t root;
+    if (!dir_block_map(ROOT_INO, &root)) {
+        printf("Error: Root inode of '%s' is not a directory\n", image_name);
+        goto out;
+    }
+    if (build_name_index() != 0) {
+        printf("Error: Failed to read the directories of '%s'\n", image_name);
+        goto out;
+    }
+    printf("Mounting '%s' read-only: %lu files in %lu directories\n", image_name,
+           (unsigned long)g_ctx.names_count, (unsigned long)g_ctx.dirs_count);
+    fflush(stdout);
+
+    rc = fuse_main(fuse_argc, fuse_argv, &vsfs_ops, NULL);
+
+out:
+    for (uint64_t i = 0; i < g_ctx.sb.inode_count; i++) {
+        if (g_ctx.block_maps) free(g_ctx.block_maps[i]);
+        if (g_ctx.frame_maps) free(g_ctx.frame_maps[i]);
+    }
+    free(g_ctx.block_maps);
+    free(g_ctx.frame_maps);
+    free(g_ctx.names);
+    munmap(map, (size_t)st.st_size);
+    free(fuse_argv);
+    return rc;
+}
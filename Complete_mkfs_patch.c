@@ -0,0 +1,251 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "vsfs.h"
+
+/* A block the delta changes that does not hold its new contents yet. */
+typedef struct {
+    uint64_t block;
+    const uint8_t* data;          /* into the mapped delta, or a zero block */
+} pending_t;
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image> --delta <delta> [--verify-only]\n", program_name);
+    printf("  --image: the image to update in place\n");
+    printf("  --delta: a delta written by mkfs_diff\n");
+    printf("  --verify-only: check that the delta applies without writing anything\n");
+}
+
+int parse_args(int argc, char* argv[], char** image_name, char** delta_name, int* verify_only) {
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "--verify-only") == 0) {
+            *verify_only = 1;
+            i--;
+            continue;
+        }
+        if (i + 1 >= argc) return -1;
+        if (strcmp(argv[i], "--image") == 0) {
+            *image_name = argv[i + 1];
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            *delta_name = argv[i + 1];
+        } else {
+            return -1;
+        }
+    }
+    return *image_name && *delta_name ? 0 : -1;
+}
+
+/*
+ * Walk the records and check each one against the image before anything is
+ * written: the new contents must match their CRC, and the image block must
+ * hold either the base contents (it is queued) or the new ones already (an
+ * interrupted patch is being resumed). Returns the number queued, or -1.
+ */
+static int64_t verify_delta(const uint8_t* delta, size_t delta_size, const uint8_t* image, uint64_t total_blocks,
+                            pending_t* pending, uint64_t* up_to_date) {
+    static const uint8_t zero[BS];
+    const delta_header_t* hdr = (const delta_header_t*)delta;
+    uint32_t zero_crc = crc32(zero, BS);
+    size_t pos = sizeof(*hdr);
+    uint64_t npending = 0;
+    int64_t last = -1;
+
+    for (uint64_t i = 0; i < hdr->nrecords; i++) {
+        delta_record_t rec;
+        if (delta_size - pos < sizeof(rec)) {
+            printf("Error: Delta is truncated at record %lu\n", (unsigned long)i);
+            return -1;
+        }
+        memcpy(&rec, delta + pos, sizeof(rec));
+        pos += sizeof(rec);
+        const uint8_t* data = zero;
+        if (!(rec.flags & DELTA_ZERO)) {
+            if (delta_size - pos < BS) {
+                printf("Error: Delta is truncated at record %lu\n", (unsigned long)i);
+                return -1;
+            }
+            data = delta + pos;
+            pos += BS;
+        }
+        if (rec.block >= total_blocks || (int64_t)rec.block <= last) {
+            printf("Error: Delta record %lu names block %lu out of order or range\n", (unsigned long)i,
+                   (unsigned long)rec.block);
+            return -1;
+        }
+        last = (int64_t)rec.block;
+        if ((rec.flags & DELTA_ZERO ? zero_crc : crc32(data, BS)) != rec.crc) {
+            printf("Error: Delta record %lu (block %lu) is corrupt\n", (unsigned long)i, (unsigned long)rec.block);
+            return -1;
+        }
+
+        uint32_t current = crc32(image + rec.block * BS, BS);
+        if (current == rec.crc && memcmp(image + rec.block * BS, data, BS) == 0) {
+            (*up_to_date)++;
+        } else if (current == rec.base_crc) {
+            pending[npending].block = rec.block;
+            pending[npending].data = data;
+            npending++;
+        } else {
+            printf("Error: Block %lu does not match the image the delta was made from\n", (unsigned long)rec.block);
+            return -1;
+        }
+    }
+    if (pos != delta_size) {
+        printf("Error: Delta has %lu trailing bytes\n", (unsigned long)(delta_size - pos));
+        return -1;
+    }
+    return (int64_t)npending;
+}
+
+/* One pwritev per run of consecutive blocks, up to IOV_MAX blocks at a time. */
+static int write_pending(int fd, const pending_t* pending, uint64_t count) {
+    struct iovec iov[IOV_MAX];
+    for (uint64_t i = 0; i < count; ) {
+        int n = 0;
+        while (i + n < count && n < IOV_MAX && pending[i + n].block == pending[i].block + n) {
+            iov[n].iov_base = (void*)pending[i + n].data;
+            iov[n].iov_len = BS;
+            n++;
+        }
+        uint64_t len = (uint64_t)n * BS;
+        uint64_t done = 0;
+        while (done < len) {
+            ssize_t w = pwritev(fd, iov, n, (off_t)(pending[i].block * BS + done));
+            if (w <= 0) return w < 0 ? -errno : -EIO;
+            done += (uint64_t)w;
+            /* Drop the iovecs a short write consumed. */
+            size_t skip = (size_t)w;
+            int k = 0;
+            while (k < n && skip >= iov[k].iov_len) skip -= iov[k++].iov_len;
+            memmove(iov, iov + k, (size_t)(n - k) * sizeof(iov[0]));
+            n -= k;
+            if (n > 0) {
+                iov[0].iov_base = (uint8_t*)iov[0].iov_base + skip;
+                iov[0].iov_len -= skip;
+            }
+        }
+        i += len / BS;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    char* image_name = NULL;
+    char* delta_name = NULL;
+    int verify_only = 0;
+
+    if (parse_args(argc, argv, &image_name, &delta_name, &verify_only) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    crc32_init();
+
+    int dfd = open(delta_name, O_RDONLY);
+    struct stat dst;
+    if (dfd < 0 || fstat(dfd, &dst) != 0) {
+        perror("Failed to open delta file");
+        if (dfd >= 0) close(dfd);
+        return 1;
+    }
+    if ((uint64_t)dst.st_size < sizeof(delta_header_t)) {
+        printf("Error: '%s' is not a delta file\n", delta_name);
+        close(dfd);
+        return 1;
+    }
+    size_t delta_size = (size_t)dst.st_size;
+    const uint8_t* delta = mmap(NULL, delta_size, PROT_READ, MAP_PRIVATE, dfd, 0);
+    close(dfd);
+    if (delta == MAP_FAILED) {
+        perror("Failed to map delta file");
+        return 1;
+    }
+    madvise((void*)delta, delta_size, MADV_SEQUENTIAL);
+
+    int rc = 1;
+    int fd = -1;
+    const uint8_t* image = MAP_FAILED;
+    size_t image_size = 0;
+    pending_t* pending = NULL;
+
+    delta_header_t hdr;
+    memcpy(&hdr, delta, sizeof(hdr));
+    uint32_t crc = hdr.crc;
+    hdr.crc = 0;
+    if (hdr.magic != VSFS_DELTA_MAGIC || hdr.version != VSFS_DELTA_VERSION || hdr.block_size != BS ||
+        crc32(&hdr, sizeof(hdr)) != crc) {
+        printf("Error: '%s' is not a valid delta file\n", delta_name);
+        goto out;
+    }
+
+    fd = open(image_name, verify_only ? O_RDONLY : O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Failed to open image");
+        goto out;
+    }
+    superblock_t sb;
+    if (pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb) || sb.magic != VSFS_MAGIC) {
+        printf("Error: '%s' is not a filesystem image\n", image_name);
+        goto out;
+    }
+    if (sb.total_blocks != hdr.total_blocks || (uint64_t)st.st_size < sb.total_blocks * BS) {
+        printf("Error: '%s' has %lu blocks but the delta is for an image of %lu\n", image_name,
+               (unsigned long)sb.total_blocks, (unsigned long)hdr.total_blocks);
+        goto out;
+    }
+    if (hdr.nrecords > (delta_size - sizeof(hdr)) / sizeof(delta_record_t)) {
+        printf("Error: Delta is truncated: header lists %lu records\n", (unsigned long)hdr.nrecords);
+        goto out;
+    }
+    image_size = (size_t)st.st_size;
+    image = mmap(NULL, image_size, PROT_READ, MAP_SHARED, fd, 0);
+    pending = malloc((hdr.nrecords ? hdr.nrecords : 1) * sizeof(pending_t));
+    if (image == MAP_FAILED || !pending) {
+        perror("Failed to load image");
+        goto out;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t up_to_date = 0;
+    int64_t npending = verify_delta(delta, delta_size, image, hdr.total_blocks, pending, &up_to_date);
+    if (npending < 0) goto out;
+
+    if (!verify_only) {
+        int err = write_pending(fd, pending, (uint64_t)npending);
+        if (err == 0 && npending && fsync(fd) != 0) err = -errno;
+        if (err != 0) {
+            printf("Error: Failed to write '%s': %s; run the patch again to finish it\n", image_name, strerror(-err));
+            goto out;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("%s %lu of %lu block(s) in %.3f s (%lu already up to date)\n", verify_only ? "Would write" : "Patched",
+           (unsigned long)npending, (unsigned long)hdr.nrecords, secs, (unsigned long)up_to_date);
+    rc = 0;
+
+out:
+    free(pending);
+    if (image != MAP_FAILED) munmap((void*)image, image_size);
+    if (fd >= 0 && close(fd) != 0 && rc == 0) {
+        perror("Failed to close image");
+        rc = 1;
+    }
+    munmap((void*)delta, delta_size);
+    return rc;
+}
@@ -0,0 +1,2525 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#include "vsfs.h"
+
+uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = crc32((void *) sb, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+
+void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c;
+}
+
+void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    de->checksum = x;
+}
+
+/* ---- statistics ---- */
+
+static const char* const PHASE_NAMES[VSFS_PHASE_COUNT] = {
+    "clone", "superblock", "bitmaps", "inodes", "payload", "directories", "flush",
+};
+
+uint64_t vsfs_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t vsfs_stats_phase(vsfs_stats_t* st, vsfs_phase_t phase, uint64_t start_ns) {
+    uint64_t now = vsfs_now_ns();
+    __atomic_fetch_add(&st->phase_ns[phase], now - start_ns, __ATOMIC_RELAXED);
+    return now;
+}
+
+/* Payload copies run on several threads, so every counter is updated atomically. */
+void vsfs_stats_io(vsfs_stats_t* st, int write, uint64_t offset, uint64_t len) {
+    if (__atomic_exchange_n(&st->next_offset, offset + len, __ATOMIC_RELAXED) != offset) {
+        __atomic_fetch_add(&st->seeks, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(write ? &st->writes : &st->reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &st->bytes_written : &st->bytes_read, len, __ATOMIC_RELAXED);
+}
+
+void vsfs_stats_print(const vsfs_stats_t* st, const char* tool, uint64_t total_ns, int json) {
+    if (json) {
+        printf("{\"tool\":\"%s\",\"seconds\":%.6f,\"phases\":{", tool, total_ns / 1e9);
+        for (int i = 0; i < VSFS_PHASE_COUNT; i++) {
+            printf("%s\"%s\":%.6f", i ? "," : "", PHASE_NAMES[i], st->phase_ns[i] / 1e9);
+        }
+        printf("},\"reads\":%llu,\"writes\":%llu,\"seeks\":%llu,\"syncs\":%llu,\"bytes_read\":%llu,"
+               "\"bytes_written\":%llu}\n", (unsigned long long)st->reads, (unsigned long long)st->writes,
+               (unsigned long long)st->seeks, (unsigned long long)st->syncs, (unsigned long long)st->bytes_read,
+               (unsigned long long)st->bytes_written);
+        return;
+    }
+    printf("Statistics for %s (%.6f s total):\n", tool, total_ns / 1e9);
+    for (int i = 0; i < VSFS_PHASE_COUNT; i++) {
+        printf("  %-12s %.6f s\n", PHASE_NAMES[i], st->phase_ns[i] / 1e9);
+    }
+    printf("  I/O: %llu reads (%.1f KiB), %llu writes (%.1f KiB), %llu seeks, %llu syncs\n",
+           (unsigned long long)st->reads, st->bytes_read / 1024.0, (unsigned long long)st->writes,
+           st->bytes_written / 1024.0, (unsigned long long)st->seeks, (unsigned long long)st->syncs);
+}
+
+/* pread()/pwrite() on the image, counted in fs->stats. */
+static ssize_t image_pread(vsfs_t* fs, void* buf, uint64_t len, uint64_t offset) {
+    vsfs_stats_io(&fs->stats, 0, offset, len);
+    return pread(fs->fd, buf, len, (off_t)offset);
+}
+
+static ssize_t image_pwrite(vsfs_t* fs, const void* buf, uint64_t len, uint64_t offset) {
+    vsfs_stats_io(&fs->stats, 1, offset, len);
+    return pwrite(fs->fd, buf, len, (off_t)offset);
+}
+
+/* Writes queued on fs->ioq, counted in fs->stats; they are done once vsfs_ioq_wait() returns. */
+static int image_queue(vsfs_t* fs, const void* buf, uint64_t len, uint64_t offset) {
+    vsfs_stats_io(&fs->stats, 1, offset, len);
+    return vsfs_ioq_write(&fs->ioq, buf, len, offset);
+}
+
+static int image_queuev(vsfs_t* fs, const struct iovec* iov, int cnt, uint64_t offset) {
+    vsfs_stats_io(&fs->stats, 1, offset, (uint64_t)cnt * BS);
+    return vsfs_ioq_writev(&fs->ioq, iov, cnt, offset);
+}
+
+static int u32map_insert(vsfs_u32map_t* m, uint32_t key, uint32_t value);
+static uint32_t* u32map_find(const vsfs_u32map_t* m, uint32_t key);
+static void u32map_free(vsfs_u32map_t* m);
+
+/* Blocks of an unreplayed transaction kept by a read-only open are laid over what is on disk. */
+static int read_blocks(vsfs_t* fs, uint64_t block, void* buf, uint64_t count) {
+    if (image_pread(fs, buf, count * BS, block * BS) != (ssize_t)(count * BS)) return -EIO;
+    for (uint64_t i = 0; fs->overlay_buf && i < count; i++) {
+        const uint32_t* slot = u32map_find(&fs->overlay_index, (uint32_t)(block + i));
+        if (slot) memcpy((uint8_t*)buf + i * BS, fs->overlay.data + (*slot - 1) * BS, BS);
+    }
+    return 0;
+}
+
+/* ---- bitmaps ---- */
+
+/* 64 bits of the bitmap starting at bit w*64; bits past nbits read as allocated. */
+static uint64_t bitmap_word(const vsfs_bitmap_t* bm, uint64_t w) {
+    uint64_t v;
+    memcpy(&v, bm->bits + w * 8, sizeof(v));
+    v = le64toh(v);
+    uint64_t base = w * 64;
+    if (base + 64 > bm->nbits) {
+        v |= (bm->nbits <= base) ? ~0ull : ~0ull << (bm->nbits - base);
+    }
+    return v;
+}
+
+/* First bit at or after 'from' whose value is 'set' (0 = free, 1 = used), or nbits. */
+uint64_t vsfs_bitmap_scan(const vsfs_bitmap_t* bm, uint64_t from, int set) {
+    uint64_t nwords = (bm->nbits + 63) / 64;
+    for (uint64_t w = from / 64; w < nwords; w++) {
+        uint64_t v = bitmap_word(bm, w);
+        if (!set) v = ~v;
+        if (w == from / 64) v &= ~0ull << (from % 64);
+        if (v) {
+            uint64_t bit = w * 64 + (uint64_t)__builtin_ctzll(v);
+            return bit < bm->nbits ? bit : bm->nbits;
+        }
+    }
+    return bm->nbits;
+}
+
+static void bitmap_mark_dirty(vsfs_bitmap_t* bm, uint64_t start, uint64_t count) {
+    if (!bm->dirty || start < bm->dirty_lo) bm->dirty_lo = start;
+    if (!bm->dirty || start + count > bm->dirty_hi) bm->dirty_hi = start + count;
+    bm->dirty = 1;
+}
+
+void vsfs_bitmap_set_range(vsfs_bitmap_t* bm, uint64_t start, uint64_t count) {
+    for (uint64_t i = start; i < start + count; i++) {
+        bm->bits[i / 8] |= (uint8_t)(1u << (i % 8));
+    }
+    bitmap_mark_dirty(bm, start, count);
+}
+
+void vsfs_bitmap_clear_range(vsfs_bitmap_t* bm, uint64_t start, uint64_t count) {
+    for (uint64_t i = start; i < start + count; i++) {
+        bm->bits[i / 8] &= (uint8_t)~(1u << (i % 8));
+    }
+    bitmap_mark_dirty(bm, start, count);
+}
+
+/*
+ * Allocate the first free run at or after the hint cursor (wrapping once),
+ * up to 'want' bits long. Returns the run length, 0 if the bitmap is full.
+ */
+uint64_t vsfs_bitmap_alloc_extent(vsfs_bitmap_t* bm, uint64_t want, uint64_t* start) {
+    uint64_t from = bm->hint < bm->nbits ? bm->hint : 0;
+    uint64_t first = vsfs_bitmap_scan(bm, from, 0);
+    if (first == bm->nbits && from != 0) first = vsfs_bitmap_scan(bm, 0, 0);
+    if (first == bm->nbits) return 0;
+
+    uint64_t end = vsfs_bitmap_scan(bm, first, 1);
+    uint64_t len = end - first;
+    if (len > want) len = want;
+    vsfs_bitmap_set_range(bm, first, len);
+    bm->hint = first + len;
+    *start = first;
+    return len;
+}
+
+/*
+ * First-fit search for 'count' contiguous free bits, starting at the hint
+ * cursor and wrapping once. Returns 0 and allocates the run, or -ENOSPC if no
+ * run is long enough.
+ */
+int vsfs_bitmap_alloc_contiguous(vsfs_bitmap_t* bm, uint64_t count, uint64_t* start) {
+    uint64_t from = bm->hint < bm->nbits ? bm->hint : 0;
+    for (int pass = 0; pass < 2; pass++) {
+        uint64_t pos = pass == 0 ? from : 0;
+        uint64_t limit = pass == 0 ? bm->nbits : from;
+        while (pos < limit) {
+            uint64_t first = vsfs_bitmap_scan(bm, pos, 0);
+            if (first >= limit) break;
+            uint64_t end = vsfs_bitmap_scan(bm, first, 1);
+            if (end - first >= count) {
+                vsfs_bitmap_set_range(bm, first, count);
+                bm->hint = first + count;
+                *start = first;
+                return 0;
+            }
+            pos = end;
+        }
+    }
+    return -ENOSPC;
+}
+
+static int bitmap_load(vsfs_t* fs, vsfs_bitmap_t* bm, uint64_t start, uint64_t blocks, uint64_t nbits) {
+    if (nbits > blocks * BS * 8) return -EUCLEAN;
+    bm->bits = malloc(blocks * BS);
+    if (!bm->bits) return -ENOMEM;
+    bm->nbits = nbits;
+    return read_blocks(fs, start, bm->bits, blocks);
+}
+
+/* Copy the dirty range of a bitmap into the cache so it is written back with the other metadata. */
+static int bitmap_stage(vsfs_t* fs, vsfs_bitmap_t* bm, uint64_t start) {
+    if (!bm->dirty) return 0;
+    uint64_t first = bm->dirty_lo / (BS * 8);
+    uint64_t last = (bm->dirty_hi - 1) / (BS * 8);
+    for (uint64_t b = first; b <= last; b++) {
+        uint8_t* p = vsfs_block_zero(fs, start + b);
+        if (!p) return -ENOMEM;
+        memcpy(p, bm->bits + b * BS, BS);
+    }
+    bm->dirty = 0;
+    return 0;
+}
+
+/* ---- journal ---- */
+
+/* Blocks taken by the descriptor of a transaction logging 'nblocks' blocks. */
+uint64_t vsfs_journal_desc_blocks(uint64_t nblocks) {
+    return (sizeof(journal_header_t) + nblocks * sizeof(uint64_t) + BS - 1) / BS;
+}
+
+/* Largest number of blocks one transaction can log, or 0 without a journal. */
+uint64_t vsfs_journal_txn_capacity(const superblock_t* sb) {
+    if (!(sb->flags & FEATURE_JOURNAL)) return 0;
+    uint64_t half = sb->journal_blocks / 2;
+    if (half < 3) return 0;
+    uint64_t n = half - 2;
+    while (n > 0 && vsfs_journal_desc_blocks(n) + n + 1 > half) n--;
+    return n;
+}
+
+static int journal_header_ok(const journal_header_t* h, uint32_t type, uint64_t half_blocks) {
+    return h->magic == VSFS_JOURNAL_MAGIC && h->type == type && h->nblocks > 0 && h->nblocks < half_blocks &&
+           vsfs_journal_desc_blocks(h->nblocks) + h->nblocks + 1 <= half_blocks;
+}
+
+/*
+ * Decode the transaction at the start of a journal half. Returns 0 if it is
+ * complete: descriptor and commit block agree and the commit CRC matches.
+ */
+int vsfs_journal_parse(const uint8_t* half, uint64_t half_blocks, journal_txn_t* txn) {
+    journal_header_t desc, commit;
+    memcpy(&desc, half, sizeof(desc));
+    if (!journal_header_ok(&desc, JOURNAL_DESCRIPTOR, half_blocks)) return -ENOENT;
+
+    uint64_t body = vsfs_journal_desc_blocks(desc.nblocks) + desc.nblocks;
+    memcpy(&commit, half + body * BS, sizeof(commit));
+    if (!journal_header_ok(&commit, JOURNAL_COMMIT, half_blocks) ||
+        commit.sequence != desc.sequence || commit.nblocks != desc.nblocks) {
+        return -ENOENT;
+    }
+    if (crc32(half, body * BS) != commit.crc) return -ENOENT;
+
+    txn->sequence = desc.sequence;
+    txn->nblocks = desc.nblocks;
+    txn->targets = half + sizeof(desc);
+    txn->data = half + vsfs_journal_desc_blocks(desc.nblocks) * BS;
+    return 0;
+}
+
+static uint64_t journal_target(const journal_txn_t* txn, uint64_t i) {
+    uint64_t t;
+    memcpy(&t, txn->targets + i * sizeof(t), sizeof(t));
+    return le64toh(t);
+}
+
+/*
+ * Read the transaction in journal half 'h' into a malloc'd buffer. Only the
+ * descriptor block is read unless it looks like the start of a transaction.
+ */
+static int journal_load(vsfs_t* fs, uint64_t h, uint8_t** buf, journal_txn_t* txn) {
+    uint64_t half = fs->sb.journal_blocks / 2;
+    uint64_t start = fs->sb.journal_start + h * half;
+    journal_header_t desc;
+    *buf = NULL;
+    if (image_pread(fs, &desc, sizeof(desc), start * BS) != (ssize_t)sizeof(desc)) return -EIO;
+    if (!journal_header_ok(&desc, JOURNAL_DESCRIPTOR, half)) return -ENOENT;
+
+    uint64_t len = vsfs_journal_desc_blocks(desc.nblocks) + desc.nblocks + 1;
+    *buf = malloc(len * BS);
+    if (!*buf) return -ENOMEM;
+    int rc = read_blocks(fs, start, *buf, len);
+    if (rc == 0) rc = vsfs_journal_parse(*buf, len, txn);
+    if (rc != 0) {
+        free(*buf);
+        *buf = NULL;
+    }
+    return rc;
+}
+
+/*
+ * Load both journal halves; returns the half holding the newest committed
+ * transaction, or -ENOENT if neither holds one. On success or -ENOENT the
+ * caller frees both buffers.
+ */
+static int journal_newest(vsfs_t* fs, uint8_t* buf[2], journal_txn_t txn[2]) {
+    int ok[2];
+    buf[1] = NULL;
+    for (uint64_t h = 0; h < 2; h++) {
+        int rc = journal_load(fs, h, &buf[h], &txn[h]);
+        if (rc != 0 && rc != -ENOENT) {
+            free(buf[0]);
+            buf[0] = NULL;
+            return rc;
+        }
+        ok[h] = rc == 0;
+    }
+    if (!ok[0] && !ok[1]) return -ENOENT;
+    return !ok[0] || (ok[1] && txn[1].sequence > txn[0].sequence);
+}
+
+/*
+ * Bring the image up to date with the newest committed transaction. Every
+ * transaction is made durable at home by the fdatasync of the one after it,
+ * so only the newest can be incomplete; older ones must not be replayed, as
+ * blocks they logged may since have been freed and reused for file data.
+ */
+static int journal_recover(vsfs_t* fs) {
+    uint8_t* buf[2];
+    journal_txn_t txn[2];
+    int h = journal_newest(fs, buf, txn);
+    if (h < 0 && h != -ENOENT) return h;
+
+    fs->journal_seq = 1;
+    fs->journal_half = 0;
+    int rc = 0;
+    if (h >= 0) {
+        for (uint64_t i = 0; i < txn[h].nblocks && rc == 0; i++) {
+            uint64_t target = journal_target(&txn[h], i);
+            if (target >= fs->sb.total_blocks) {
+                rc = -EIO;
+                break;
+            }
+            rc = image_queue(fs, txn[h].data + i * BS, BS, target * BS);
+        }
+        int err = vsfs_ioq_wait(&fs->ioq);
+        if (rc == 0) rc = err;
+        fs->journal_seq = txn[h].sequence + 1;
+        fs->journal_half = (uint64_t)h ^ 1;
+    }
+    free(buf[0]);
+    free(buf[1]);
+    return rc;
+}
+
+/*
+ * A read-only open cannot replay, so when the newest committed transaction
+ * has not reached its home blocks it is kept in memory and read_blocks()
+ * returns the logged copies instead: readers see the image as replay would
+ * leave it.
+ */
+static int journal_overlay(vsfs_t* fs) {
+    uint8_t* buf[2];
+    journal_txn_t txn[2];
+    int h = journal_newest(fs, buf, txn);
+    if (h == -ENOENT) return 0;
+    if (h < 0) return h;
+
+    int rc = 0, stale = 0;
+    uint8_t home[BS];
+    for (uint64_t i = 0; i < txn[h].nblocks && rc == 0 && !stale; i++) {
+        uint64_t target = journal_target(&txn[h], i);
+        if (target >= fs->sb.total_blocks || read_blocks(fs, target, home, 1) != 0) rc = -EIO;
+        else stale = memcmp(home, txn[h].data + i * BS, BS) != 0;
+    }
+    for (uint64_t i = 0; i < txn[h].nblocks && rc == 0 && stale; i++) {
+        uint64_t target = journal_target(&txn[h], i);
+        if (target >= fs->sb.total_blocks) rc = -EIO;
+        else rc = u32map_insert(&fs->overlay_index, (uint32_t)target, (uint32_t)(i + 1));
+    }
+    if (rc == 0 && stale) {
+        fs->overlay = txn[h];
+        fs->overlay_buf = buf[h];
+        buf[h] = NULL;
+    } else {
+        u32map_free(&fs->overlay_index);
+    }
+    free(buf[0]);
+    free(buf[1]);
+    return rc;
+}
+
+/* Mapped-image counterparts, for tools that read the image through mmap(). */
+int vsfs_journal_pending(const uint8_t* image, const superblock_t* sb, journal_txn_t* txn) {
+    if (!(sb->flags & FEATURE_JOURNAL)) return 0;
+    if (sb->journal_blocks < MIN_JOURNAL_BLOCKS || sb->journal_start + sb->journal_blocks > sb->total_blocks) {
+        return -EIO;
+    }
+    uint64_t half = sb->journal_blocks / 2;
+    journal_txn_t t;
+    int found = 0;
+    for (uint64_t h = 0; h < 2; h++) {
+        if (vsfs_journal_parse(image + (sb->journal_start + h * half) * BS, half, &t) == 0 &&
+            (!found || t.sequence > txn->sequence)) {
+            *txn = t;
+            found = 1;
+        }
+    }
+    for (uint64_t i = 0; found && i < txn->nblocks; i++) {
+        uint64_t target = journal_target(txn, i);
+        if (target >= sb->total_blocks) return -EIO;
+        if (memcmp(image + target * BS, txn->data + i * BS, BS) != 0) return 1;
+    }
+    return 0;
+}
+
+void vsfs_journal_apply(uint8_t* image, const journal_txn_t* txn) {
+    for (uint64_t i = 0; i < txn->nblocks; i++) {
+        memcpy(image + journal_target(txn, i) * BS, txn->data + i * BS, BS);
+    }
+}
+
+/*
+ * Log the sorted dirty blocks to the next journal half, queued as one batch
+ * of writes of up to IOV_MAX blocks each, then fdatasync once. The sync also
+ * makes the previous transaction's home writes and any payload written since
+ * durable, so the half it occupied can be reused by the transaction after
+ * this one.
+ */
+static int journal_commit(vsfs_t* fs, vsfs_cache_entry_t** list, uint64_t n) {
+    if (n > vsfs_journal_txn_capacity(&fs->sb)) return -ENOSPC;
+
+    uint64_t ndesc = vsfs_journal_desc_blocks(n);
+    uint64_t total = ndesc + n + 1;
+    uint8_t* desc = calloc(ndesc + 1, BS);
+    struct iovec* iov = malloc(total * sizeof(*iov));
+    if (!desc || !iov) {
+        free(desc);
+        free(iov);
+        return -ENOMEM;
+    }
+
+    journal_header_t h = {0};
+    h.magic = VSFS_JOURNAL_MAGIC;
+    h.type = JOURNAL_DESCRIPTOR;
+    h.sequence = fs->journal_seq;
+    h.nblocks = n;
+    memcpy(desc, &h, sizeof(h));
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t t = htole64(list[i]->block);
+        memcpy(desc + sizeof(h) + i * sizeof(t), &t, sizeof(t));
+    }
+    uint32_t crc = crc32(desc, ndesc * BS);
+    for (uint64_t i = 0; i < n; i++) crc = crc32_update(crc, list[i]->data, BS);
+    h.type = JOURNAL_COMMIT;
+    h.crc = crc;
+    uint8_t* commit = desc + ndesc * BS;
+    memcpy(commit, &h, sizeof(h));
+
+    uint64_t start = fs->sb.journal_start + fs->journal_half * (fs->sb.journal_blocks / 2);
+    int rc = 0;
+    for (uint64_t done = 0; done < total && rc == 0; ) {
+        int cnt = 0;
+        for (; cnt < IOV_MAX && done + cnt < total; cnt++) {
+            uint64_t b = done + cnt;
+            iov[b].iov_base = b < ndesc ? desc + b * BS : b < ndesc + n ? list[b - ndesc]->data : commit;
+            iov[b].iov_len = BS;
+        }
+        rc = image_queuev(fs, iov + done, cnt, (start + done) * BS);
+        done += (uint64_t)cnt;
+    }
+    int err = vsfs_ioq_wait(&fs->ioq);
+    if (rc == 0) rc = err;
+    if (rc == 0) fs->stats.syncs++;
+    if (rc == 0 && fdatasync(fs->fd) != 0) rc = -errno;
+    if (rc == 0) {
+        fs->journal_seq++;
+        fs->journal_half ^= 1;
+    }
+    free(desc);
+    free(iov);
+    return rc;
+}
+
+/* ---- block cache ---- */
+
+static void list_init(vsfs_cache_entry_t* head) {
+    head->prev = head->next = head;
+}
+
+static void list_unlink(vsfs_cache_entry_t* e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void list_push_front(vsfs_cache_entry_t* head, vsfs_cache_entry_t* e) {
+    e->next = head->next;
+    e->prev = head;
+    head->next->prev = e;
+    head->next = e;
+}
+
+static uint64_t cache_slot(const vsfs_cache_t* c, uint64_t block) {
+    return (block * 0x9E3779B97F4A7C15ull) >> 32 & (c->nbuckets - 1);
+}
+
+static int cache_init(vsfs_cache_t* c, uint64_t capacity) {
+    memset(c, 0, sizeof(*c));
+    c->capacity = capacity;
+    c->nbuckets = 64;
+    while (c->nbuckets < capacity) c->nbuckets *= 2;
+    c->buckets = calloc(c->nbuckets, sizeof(*c->buckets));
+    if (!c->buckets) return -ENOMEM;
+    list_init(&c->lru);
+    list_init(&c->dirty);
+    return 0;
+}
+
+static vsfs_cache_entry_t* cache_find(vsfs_cache_t* c, uint64_t block) {
+    for (vsfs_cache_entry_t* e = c->buckets[cache_slot(c, block)]; e; e = e->hash_next) {
+        if (e->block == block) return e;
+    }
+    return NULL;
+}
+
+static void cache_hash_remove(vsfs_cache_t* c, vsfs_cache_entry_t* e) {
+    vsfs_cache_entry_t** pp = &c->buckets[cache_slot(c, e->block)];
+    while (*pp != e) pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+}
+
+static void cache_hash_insert(vsfs_cache_t* c, vsfs_cache_entry_t* e) {
+    uint64_t slot = cache_slot(c, e->block);
+    e->hash_next = c->buckets[slot];
+    c->buckets[slot] = e;
+}
+
+/* Double the hash table when dirty blocks push the cache past its capacity. */
+static void cache_rehash(vsfs_cache_t* c) {
+    vsfs_cache_entry_t** old = c->buckets;
+    uint64_t old_n = c->nbuckets;
+    vsfs_cache_entry_t** buckets = calloc(old_n * 2, sizeof(*buckets));
+    if (!buckets) return;
+    c->buckets = buckets;
+    c->nbuckets = old_n * 2;
+    for (uint64_t i = 0; i < old_n; i++) {
+        vsfs_cache_entry_t* e = old[i];
+        while (e) {
+            vsfs_cache_entry_t* next = e->hash_next;
+            cache_hash_insert(c, e);
+            e = next;
+        }
+    }
+    free(old);
+}
+
+/* New entry for 'block', recycling the least recently used clean block when full. */
+static vsfs_cache_entry_t* cache_insert(vsfs_cache_t* c, uint64_t block) {
+    vsfs_cache_entry_t* e;
+    if (c->count >= c->capacity && c->lru.prev != &c->lru) {
+        e = c->lru.prev;
+        list_unlink(e);
+        cache_hash_remove(c, e);
+    } else {
+        e = malloc(sizeof(*e));
+        if (!e) return NULL;
+        c->count++;
+        if (c->count > c->nbuckets) cache_rehash(c);
+    }
+    e->block = block;
+    e->dirty = 0;
+    cache_hash_insert(c, e);
+    list_push_front(&c->lru, e);
+    return e;
+}
+
+static void cache_drop(vsfs_cache_t* c, uint64_t block) {
+    vsfs_cache_entry_t* e = cache_find(c, block);
+    if (!e) return;
+    if (e->dirty) c->ndirty--;
+    list_unlink(e);
+    cache_hash_remove(c, e);
+    c->count--;
+    free(e);
+}
+
+static void cache_destroy(vsfs_cache_t* c) {
+    if (!c->buckets) return;
+    for (vsfs_cache_entry_t* head = &c->lru; ; head = &c->dirty) {
+        vsfs_cache_entry_t* e = head->next;
+        while (e != head) {
+            vsfs_cache_entry_t* next = e->next;
+            free(e);
+            e = next;
+        }
+        if (head == &c->dirty) break;
+    }
+    free(c->buckets);
+    c->buckets = NULL;
+    c->count = 0;
+    c->ndirty = 0;
+}
+
+static int cmp_entry_block(const void* a, const void* b) {
+    uint64_t x = (*(vsfs_cache_entry_t* const*)a)->block;
+    uint64_t y = (*(vsfs_cache_entry_t* const*)b)->block;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Write the given blocks to their home locations: one write per run of
+ * consecutive blocks, all queued before waiting for any, so bitmaps, inode
+ * table and directory blocks go to the kernel as one batch. 'iov' has n
+ * entries.
+ */
+static int write_home(vsfs_t* fs, vsfs_cache_entry_t** list, uint64_t n, struct iovec* iov) {
+    int rc = 0;
+    for (uint64_t i = 0; i < n && rc == 0; ) {
+        struct iovec* run = iov + i;
+        int cnt = 0;
+        while (i + cnt < n && cnt < IOV_MAX &&
+               (cnt == 0 || list[i + cnt]->block == list[i]->block + (uint64_t)cnt)) {
+            run[cnt].iov_base = list[i + cnt]->data;
+            run[cnt].iov_len = BS;
+            cnt++;
+        }
+        rc = image_queuev(fs, run, cnt, list[i]->block * BS);
+        i += (uint64_t)cnt;
+    }
+    int err = vsfs_ioq_wait(&fs->ioq);
+    return rc ? rc : err;
+}
+
+/*
+ * Move the blocks that are free in the data bitmap on disk to the front of
+ * 'list' and return how many there are. Committed metadata cannot reference
+ * them, so they may be written home before the transaction that links them.
+ */
+static uint64_t partition_fresh(vsfs_t* fs, vsfs_cache_entry_t** list, uint64_t n) {
+    const superblock_t* sb = &fs->sb;
+    uint8_t bits[BS];
+    uint64_t loaded = UINT64_MAX;
+    uint64_t nfresh = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t block = list[i]->block;
+        if (block < sb->data_region_start || block >= sb->data_region_start + sb->data_region_blocks) continue;
+        uint64_t bit = block - sb->data_region_start;
+        if (bit / (BS * 8) != loaded) {
+            loaded = bit / (BS * 8);
+            if (read_blocks(fs, sb->data_bitmap_start + loaded, bits, 1) != 0) return 0;
+        }
+        if (bits[bit % (BS * 8) / 8] & (1u << (bit % 8))) continue;
+        vsfs_cache_entry_t* e = list[nfresh];
+        list[nfresh++] = list[i];
+        list[i] = e;
+    }
+    /* Both halves must stay in block order for write_home(). */
+    qsort(list, nfresh, sizeof(*list), cmp_entry_block);
+    qsort(list + nfresh, n - nfresh, sizeof(*list), cmp_entry_block);
+    return nfresh;
+}
+
+/*
+ * Write every dirty block in block order. On journalled images the blocks are
+ * first committed as one transaction, so a crash during the home writes is
+ * repaired by replay on the next open. A transaction too large for the journal
+ * first writes and syncs its newly allocated blocks, such as a directory that
+ * has just been split, and journals only the rest.
+ */
+static int cache_writeback(vsfs_t* fs) {
+    vsfs_cache_t* c = &fs->cache;
+    uint64_t n = c->ndirty;
+    if (n == 0) return 0;
+
+    vsfs_cache_entry_t** list = malloc(n * sizeof(*list));
+    struct iovec* iov = malloc(n * sizeof(*iov));
+    if (!list || !iov) {
+        free(list);
+        free(iov);
+        return -ENOMEM;
+    }
+    n = 0;
+    for (vsfs_cache_entry_t* e = c->dirty.next; e != &c->dirty; e = e->next) list[n++] = e;
+    qsort(list, n, sizeof(*list), cmp_entry_block);
+
+    int rc = 0;
+    uint64_t nfresh = 0;
+    if ((fs->sb.flags & FEATURE_JOURNAL) && n > vsfs_journal_txn_capacity(&fs->sb)) {
+        nfresh = partition_fresh(fs, list, n);
+        if (nfresh && (rc = write_home(fs, list, nfresh, iov)) == 0) {
+            fs->stats.syncs++;
+            if (fdatasync(fs->fd) != 0) rc = -errno;
+        }
+    }
+    if (rc == 0 && (fs->sb.flags & FEATURE_JOURNAL)) rc = journal_commit(fs, list + nfresh, n - nfresh);
+    if (rc == 0) rc = write_home(fs, list + nfresh, n - nfresh, iov);
+
+    if (rc == 0) {
+        for (uint64_t i = 0; i < n; i++) {
+            list_unlink(list[i]);
+            list[i]->dirty = 0;
+            list_push_front(&c->lru, list[i]);
+        }
+        c->ndirty = 0;
+        while (c->count > c->capacity && c->lru.prev != &c->lru) {
+            cache_drop(c, c->lru.prev->block);
+        }
+    }
+    free(list);
+    free(iov);
+    return rc;
+}
+
+uint8_t* vsfs_block_read(vsfs_t* fs, uint64_t block) {
+    vsfs_cache_t* c = &fs->cache;
+    vsfs_cache_entry_t* e = cache_find(c, block);
+    if (e) {
+        c->hits++;
+        if (!e->dirty) {
+            list_unlink(e);
+            list_push_front(&c->lru, e);
+        }
+        return e->data;
+    }
+    c->misses++;
+    e = cache_insert(c, block);
+    if (!e) return NULL;
+    if (read_blocks(fs, block, e->data, 1) != 0) {
+        cache_drop(c, block);
+        return NULL;
+    }
+    return e->data;
+}
+
+/* Cache entry for a block whose old contents do not matter; returned zeroed and dirty. */
+uint8_t* vsfs_block_zero(vsfs_t* fs, uint64_t block) {
+    vsfs_cache_entry_t* e = cache_find(&fs->cache, block);
+    if (!e) e = cache_insert(&fs->cache, block);
+    if (!e) return NULL;
+    memset(e->data, 0, BS);
+    vsfs_block_mark_dirty(fs, block);
+    return e->data;
+}
+
+int vsfs_block_mark_dirty(vsfs_t* fs, uint64_t block) {
+    vsfs_cache_entry_t* e = cache_find(&fs->cache, block);
+    if (!e) return -ENOENT;
+    if (!e->dirty) {
+        list_unlink(e);
+        list_push_front(&fs->cache.dirty, e);
+        e->dirty = 1;
+        fs->cache.ndirty++;
+    }
+    return 0;
+}
+
+/* ---- hash maps ---- */
+
+static uint64_t u32map_slot(const vsfs_u32map_t* m, uint32_t key) {
+    return ((uint64_t)key * 0x9E3779B97F4A7C15ull) >> 32 & m->mask;
+}
+
+static int u32map_insert(vsfs_u32map_t* m, uint32_t key, uint32_t value) {
+    if (!m->slots || (m->count + 1) * 2 > m->mask + 1) {
+        vsfs_u32map_t bigger = { .mask = m->slots ? m->mask * 2 + 1 : 63 };
+        bigger.slots = calloc(bigger.mask + 1, sizeof(*bigger.slots));
+        if (!bigger.slots) return -ENOMEM;
+        for (uint64_t i = 0; m->slots && i <= m->mask; i++) {
+            if (m->slots[i].value != 0) u32map_insert(&bigger, m->slots[i].key, m->slots[i].value);
+        }
+        free(m->slots);
+        *m = bigger;
+    }
+    uint64_t i = u32map_slot(m, key);
+    while (m->slots[i].value != 0) i = (i + 1) & m->mask;
+    m->slots[i].key = key;
+    m->slots[i].value = value;
+    m->count++;
+    return 0;
+}
+
+/* Value slot of the first entry for 'key', or NULL. */
+static uint32_t* u32map_find(const vsfs_u32map_t* m, uint32_t key) {
+    if (!m->slots) return NULL;
+    for (uint64_t i = u32map_slot(m, key); m->slots[i].value != 0; i = (i + 1) & m->mask) {
+        if (m->slots[i].key == key) return &m->slots[i].value;
+    }
+    return NULL;
+}
+
+static void u32map_free(vsfs_u32map_t* m) {
+    free(m->slots);
+    memset(m, 0, sizeof(*m));
+}
+
+static uint64_t dcache_slot(const vsfs_dcache_t* c, uint64_t parent, const char* name) {
+    return ((vsfs_dir_hash(name) ^ parent) * 0x9E3779B97F4A7C15ull) >> 32 & c->mask;
+}
+
+static uint64_t dcache_find(vsfs_dcache_t* c, uint64_t parent, const char* name) {
+    if (!c->slots) return 0;
+    for (uint64_t i = dcache_slot(c, parent, name); c->slots[i].ino != 0; i = (i + 1) & c->mask) {
+        if (c->slots[i].parent == parent && strncmp(c->slots[i].name, name, 58) == 0) return c->slots[i].ino;
+    }
+    return 0;
+}
+
+/* The cache only saves directory reads, so running out of memory just leaves an entry out. */
+static void dcache_insert(vsfs_dcache_t* c, uint64_t parent, const char* name, uint64_t ino) {
+    if (!c->slots || (c->count + 1) * 2 > c->mask + 1) {
+        vsfs_dcache_t bigger = { .mask = c->slots ? c->mask * 2 + 1 : 63, .hits = c->hits, .misses = c->misses };
+        bigger.slots = calloc(bigger.mask + 1, sizeof(*bigger.slots));
+        if (!bigger.slots) return;
+        for (uint64_t i = 0; c->slots && i <= c->mask; i++) {
+            if (c->slots[i].ino != 0) dcache_insert(&bigger, c->slots[i].parent, c->slots[i].name, c->slots[i].ino);
+        }
+        free(c->slots);
+        *c = bigger;
+    }
+    uint64_t i = dcache_slot(c, parent, name);
+    while (c->slots[i].ino != 0) i = (i + 1) & c->mask;
+    c->slots[i].parent = (uint32_t)parent;
+    c->slots[i].ino = (uint32_t)ino;
+    snprintf(c->slots[i].name, sizeof(c->slots[i].name), "%s", name);
+    c->count++;
+}
+
+static void dcache_free(vsfs_dcache_t* c) {
+    free(c->slots);
+    memset(c, 0, sizeof(*c));
+}
+
+/* Forget every entry but keep the counters; removing a directory is rare enough not to need more. */
+static void dcache_clear(vsfs_dcache_t* c) {
+    if (c->slots) memset(c->slots, 0, (c->mask + 1) * sizeof(*c->slots));
+    c->count = 0;
+}
+
+/* ---- open / flush / close ---- */
+
+int vsfs_open(vsfs_t* fs, const char* path, int mode) {
+    uint64_t t0 = vsfs_now_ns();
+    memset(fs, 0, sizeof(*fs));
+    fs->writable = mode == VSFS_OPEN_RDWR;
+    fs->fd = open(path, fs->writable ? O_RDWR : O_RDONLY);
+    if (fs->fd < 0) return -errno;
+    vsfs_ioq_init(&fs->ioq, fs->fd, fs->writable ? VSFS_IOQ_DEPTH : 0);
+
+    int rc = -EINVAL;
+    if (image_pread(fs, &fs->sb, sizeof(fs->sb), 0) != (ssize_t)sizeof(fs->sb)) {
+        rc = -EIO;
+        goto fail;
+    }
+    if (fs->sb.magic != VSFS_MAGIC) goto fail;
+    if (fs->sb.version == 0 || fs->sb.version > VSFS_VERSION || fs->sb.block_size != BS) {
+        rc = -EPROTONOSUPPORT;
+        goto fail;
+    }
+    if (fs->sb.flags & ~SUPPORTED_FEATURES) {
+        rc = -EPROTONOSUPPORT;
+        goto fail;
+    }
+    if (fs->sb.flags & FEATURE_JOURNAL) {
+        if (fs->sb.journal_blocks < MIN_JOURNAL_BLOCKS ||
+            fs->sb.journal_start + fs->sb.journal_blocks > fs->sb.data_region_start) {
+            rc = -EUCLEAN;
+            goto fail;
+        }
+        /* Replay may rewrite the superblock itself, so it is read again afterwards. */
+        uint8_t block0[BS];
+        if ((rc = fs->writable ? journal_recover(fs) : journal_overlay(fs)) != 0) goto fail;
+        if (read_blocks(fs, 0, block0, 1) != 0) {
+            rc = -EIO;
+            goto fail;
+        }
+        memcpy(&fs->sb, block0, sizeof(fs->sb));
+    }
+
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_SUPERBLOCK, t0);
+
+    t0 = vsfs_now_ns();
+    if ((rc = cache_init(&fs->cache, VSFS_DEFAULT_CACHE_BLOCKS)) != 0) goto fail;
+    rc = bitmap_load(fs, &fs->inode_bitmap, fs->sb.inode_bitmap_start, fs->sb.inode_bitmap_blocks, fs->sb.inode_count);
+    if (rc != 0) goto fail;
+    rc = bitmap_load(fs, &fs->data_bitmap, fs->sb.data_bitmap_start, fs->sb.data_bitmap_blocks, fs->sb.data_region_blocks);
+    if (rc != 0) goto fail;
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_BITMAP, t0);
+    return 0;
+
+fail:
+    vsfs_close(fs);
+    return rc;
+}
+
+int vsfs_flush(vsfs_t* fs) {
+    if (!fs->writable) return 0;
+    uint64_t t0 = vsfs_now_ns();
+    superblock_t* sb = &fs->sb;
+    for (uint64_t i = 0; i < fs->pending_free_count; i++) {
+        cache_drop(&fs->cache, fs->pending_free[i]);
+        vsfs_bitmap_clear_range(&fs->data_bitmap, fs->pending_free[i] - sb->data_region_start, 1);
+    }
+    fs->pending_free_count = 0;
+
+    int rc;
+    if ((rc = bitmap_stage(fs, &fs->inode_bitmap, sb->inode_bitmap_start)) != 0) return rc;
+    if ((rc = bitmap_stage(fs, &fs->data_bitmap, sb->data_bitmap_start)) != 0) return rc;
+    if (fs->sb_dirty) {
+        uint8_t* block = vsfs_block_read(fs, 0);
+        if (!block) return -EIO;
+        memcpy(block, sb, sizeof(*sb));
+        superblock_crc_finalize((superblock_t*)block);
+        vsfs_block_mark_dirty(fs, 0);
+        fs->sb_dirty = 0;
+    }
+    rc = cache_writeback(fs);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_FLUSH, t0);
+    return rc;
+}
+
+/* Upper bound on the blocks the next vsfs_flush() writes, counting staged bitmaps and the superblock. */
+uint64_t vsfs_dirty_blocks(const vsfs_t* fs) {
+    uint64_t n = fs->cache.ndirty + 1;
+    const vsfs_bitmap_t* bms[2] = { &fs->inode_bitmap, &fs->data_bitmap };
+    for (int i = 0; i < 2; i++) {
+        if (bms[i]->dirty) n += (bms[i]->dirty_hi - 1) / (BS * 8) - bms[i]->dirty_lo / (BS * 8) + 1;
+    }
+    return n + fs->pending_free_count;
+}
+
+int vsfs_close(vsfs_t* fs) {
+    int rc = 0;
+    vsfs_ioq_destroy(&fs->ioq);
+    if (fs->fd >= 0 && close(fs->fd) != 0) rc = -errno;
+    fs->fd = -1;
+    cache_destroy(&fs->cache);
+    free(fs->inode_bitmap.bits);
+    free(fs->data_bitmap.bits);
+    free(fs->pending_free);
+    u32map_free(&fs->dedup_index);
+    u32map_free(&fs->dedup_refs);
+    u32map_free(&fs->tail_refs);
+    u32map_free(&fs->overlay_index);
+    free(fs->overlay_buf);
+    fs->overlay_buf = NULL;
+    dcache_free(&fs->dcache);
+    fs->inode_bitmap.bits = fs->data_bitmap.bits = NULL;
+    fs->pending_free = NULL;
+    fs->pending_free_count = 0;
+    return rc;
+}
+
+/* Copy [off, off + len) of in to the same offset of out: copy_file_range(), then sendfile(), then pread/pwrite. */
+static int copy_extent(int in, int out, off_t off, off_t len) {
+    off_t end = off + len;
+    while (off < end) {
+        loff_t src = off, dst = off;
+        ssize_t n = copy_file_range(in, &src, out, &dst, end - off, 0);
+        if (n <= 0) break;
+        off += n;
+    }
+    if (off < end && lseek(out, off, SEEK_SET) < 0) return -errno;
+    while (off < end) {
+        off_t pos = off;
+        ssize_t n = sendfile(out, in, &pos, end - off);
+        if (n <= 0) break;
+        off += n;
+    }
+    uint8_t buffer[64 * 1024];
+    while (off < end) {
+        ssize_t n = pread(in, buffer, end - off < (off_t)sizeof(buffer) ? (size_t)(end - off) : sizeof(buffer), off);
+        if (n <= 0 || pwrite(out, buffer, n, off) != n) return -EIO;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * Without a reflink, only the data extents of the input are copied into an
+ * output truncated to the full size, so a sparse image stays sparse. Where
+ * SEEK_DATA is not supported the whole file counts as one extent.
+ */
+int vsfs_clone_image(const char* input_name, const char* output_name) {
+    int in = open(input_name, O_RDONLY);
+    if (in < 0) return -errno;
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        int rc = -errno;
+        close(in);
+        return rc;
+    }
+    int out = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        int rc = -errno;
+        close(in);
+        return rc;
+    }
+
+    int rc = 0;
+    if (ioctl(out, FICLONE, in) != 0) {
+        if (ftruncate(out, st.st_size) != 0) rc = -errno;
+        for (off_t pos = 0; rc == 0 && pos < st.st_size; ) {
+            off_t data = lseek(in, pos, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) break;
+            off_t hole = data < 0 ? st.st_size : lseek(in, data, SEEK_HOLE);
+            if (data < 0) data = pos;
+            if (hole < 0 || hole > st.st_size) hole = st.st_size;
+            rc = copy_extent(in, out, data, hole - data);
+            pos = hole;
+        }
+    }
+    close(in);
+    if (close(out) != 0 && rc == 0) rc = -errno;
+    return rc;
+}
+
+/* ---- inodes and allocation ---- */
+
+static uint8_t* inode_slot(vsfs_t* fs, uint64_t ino, uint64_t* block_out) {
+    if (ino == 0 || ino > fs->sb.inode_count) return NULL;
+    uint64_t byte = (ino - 1) * INODE_SIZE;
+    *block_out = fs->sb.inode_table_start + byte / BS;
+    uint8_t* block = vsfs_block_read(fs, *block_out);
+    return block ? block + byte % BS : NULL;
+}
+
+int vsfs_inode_read(vsfs_t* fs, uint64_t ino, inode_t* out) {
+    uint64_t block;
+    uint8_t* p = inode_slot(fs, ino, &block);
+    if (!p) return ino == 0 || ino > fs->sb.inode_count ? -EINVAL : -EIO;
+    memcpy(out, p, sizeof(*out));
+    return 0;
+}
+
+int vsfs_inode_write(vsfs_t* fs, uint64_t ino, inode_t* in) {
+    uint64_t block;
+    uint8_t* p = inode_slot(fs, ino, &block);
+    if (!p) return ino == 0 || ino > fs->sb.inode_count ? -EINVAL : -EIO;
+    inode_crc_finalize(in);
+    memcpy(p, in, sizeof(*in));
+    return vsfs_block_mark_dirty(fs, block);
+}
+
+int vsfs_alloc_inode(vsfs_t* fs, uint64_t* ino_out) {
+    uint64_t bit;
+    if (vsfs_bitmap_alloc_extent(&fs->inode_bitmap, 1, &bit) == 0) return -ENOSPC;
+    *ino_out = bit + 1;
+    return 0;
+}
+
+/* Allocate 'count' data blocks, as one contiguous extent when one is free. */
+int vsfs_alloc_blocks(vsfs_t* fs, uint64_t count, uint32_t* blocks) {
+    uint64_t start;
+    if (count > 1 && vsfs_bitmap_alloc_contiguous(&fs->data_bitmap, count, &start) == 0) {
+        for (uint64_t i = 0; i < count; i++) {
+            blocks[i] = (uint32_t)(fs->sb.data_region_start + start + i);
+        }
+        return 0;
+    }
+
+    uint64_t got = 0;
+    while (got < count) {
+        uint64_t len = vsfs_bitmap_alloc_extent(&fs->data_bitmap, count - got, &start);
+        if (len == 0) {
+            for (uint64_t i = 0; i < got; i++) {
+                vsfs_bitmap_clear_range(&fs->data_bitmap, blocks[i] - fs->sb.data_region_start, 1);
+            }
+            return -ENOSPC;
+        }
+        for (uint64_t i = 0; i < len; i++) {
+            blocks[got++] = (uint32_t)(fs->sb.data_region_start + start + i);
+        }
+    }
+    return 0;
+}
+
+/* Queue a block to be returned to the data bitmap by the next vsfs_flush(). */
+int vsfs_free_block_deferred(vsfs_t* fs, uint32_t block) {
+    uint32_t* list = realloc(fs->pending_free, (fs->pending_free_count + 1) * sizeof(uint32_t));
+    if (!list) return -ENOMEM;
+    fs->pending_free = list;
+    fs->pending_free[fs->pending_free_count++] = block;
+    return 0;
+}
+
+/* ---- block maps ---- */
+
+uint64_t vsfs_max_file_blocks(const superblock_t* sb) {
+    if (sb->version < 2) return DIRECT_MAX;
+    return DIRECT_MAX + PTRS_PER_BLOCK + (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+}
+
+uint64_t vsfs_index_blocks(uint64_t count) {
+    if (count <= DIRECT_MAX) return 0;
+    count -= DIRECT_MAX;
+    if (count <= PTRS_PER_BLOCK) return 1;
+    count -= PTRS_PER_BLOCK;
+    return 2 + (count + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+static int copy_ptrs(vsfs_t* fs, uint32_t block, uint32_t* out, uint64_t n) {
+    const uint8_t* p = block ? vsfs_block_read(fs, block) : NULL;
+    if (!p) return -EIO;
+    memcpy(out, p, n * sizeof(uint32_t));
+    return 0;
+}
+
+int vsfs_block_map_read(vsfs_t* fs, const inode_t* ino, uint64_t count, uint32_t* out) {
+    uint64_t pos = 0;
+    for (; pos < count && pos < DIRECT_MAX; pos++) out[pos] = ino->direct[pos];
+    if (pos == count) return 0;
+
+    uint64_t n = count - pos < PTRS_PER_BLOCK ? count - pos : PTRS_PER_BLOCK;
+    if (copy_ptrs(fs, ino->reserved_0, out + pos, n) != 0) return -EIO;
+    pos += n;
+    if (pos == count) return 0;
+
+    uint32_t dbl[PTRS_PER_BLOCK];
+    if (copy_ptrs(fs, ino->reserved_1, dbl, PTRS_PER_BLOCK) != 0) return -EIO;
+    for (uint64_t j = 0; j < PTRS_PER_BLOCK && pos < count; j++) {
+        n = count - pos < PTRS_PER_BLOCK ? count - pos : PTRS_PER_BLOCK;
+        if (copy_ptrs(fs, dbl[j], out + pos, n) != 0) return -EIO;
+        pos += n;
+    }
+    return pos == count ? 0 : -EFBIG;
+}
+
+/*
+ * Point the inode at 'count' data blocks: the first DIRECT_MAX go in direct[],
+ * the next PTRS_PER_BLOCK in the single indirect block (reserved_0), the rest
+ * behind the double indirect block (reserved_1). Index blocks are allocated
+ * here and staged in the cache.
+ */
+int vsfs_block_map_assign(vsfs_t* fs, inode_t* ino, const uint32_t* blocks, uint64_t count) {
+    if (count > vsfs_max_file_blocks(&fs->sb)) return -EFBIG;
+    for (uint64_t i = 0; i < count && i < DIRECT_MAX; i++) {
+        ino->direct[i] = blocks[i];
+    }
+    uint64_t nindex = vsfs_index_blocks(count);
+    if (nindex == 0) return 0;
+
+    uint32_t* index = malloc(nindex * sizeof(uint32_t));
+    if (!index) return -ENOMEM;
+    int rc = vsfs_alloc_blocks(fs, nindex, index);
+    if (rc != 0) {
+        free(index);
+        return rc;
+    }
+
+    uint64_t pos = DIRECT_MAX;
+    uint64_t next_index = 0;
+    uint32_t* ptrs = (uint32_t*)vsfs_block_zero(fs, index[next_index]);
+    if (!ptrs) goto nomem;
+    ino->reserved_0 = index[next_index++];
+    for (uint64_t i = 0; i < PTRS_PER_BLOCK && pos < count; i++) ptrs[i] = blocks[pos++];
+
+    if (pos < count) {
+        uint32_t dbl[PTRS_PER_BLOCK] = {0};
+        ino->reserved_1 = index[next_index++];
+        for (uint64_t j = 0; pos < count; j++) {
+            dbl[j] = index[next_index++];
+            ptrs = (uint32_t*)vsfs_block_zero(fs, dbl[j]);
+            if (!ptrs) goto nomem;
+            for (uint64_t i = 0; i < PTRS_PER_BLOCK && pos < count; i++) ptrs[i] = blocks[pos++];
+        }
+        uint8_t* p = vsfs_block_zero(fs, ino->reserved_1);
+        if (!p) goto nomem;
+        memcpy(p, dbl, sizeof(dbl));
+    }
+    free(index);
+    return 0;
+
+nomem:
+    free(index);
+    return -ENOMEM;
+}
+
+/* Release the indirect blocks of an inode that maps 'count' blocks. */
+int vsfs_block_map_release(vsfs_t* fs, inode_t* ino, uint64_t count) {
+    int rc;
+    if (count > DIRECT_MAX && (rc = vsfs_free_block_deferred(fs, ino->reserved_0)) != 0) return rc;
+    if (count > DIRECT_MAX + PTRS_PER_BLOCK) {
+        uint32_t dbl[PTRS_PER_BLOCK];
+        if (copy_ptrs(fs, ino->reserved_1, dbl, PTRS_PER_BLOCK) != 0) return -EIO;
+        uint64_t tables = (count - DIRECT_MAX - PTRS_PER_BLOCK + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+        for (uint64_t j = 0; j < tables; j++) {
+            if ((rc = vsfs_free_block_deferred(fs, dbl[j])) != 0) return rc;
+        }
+        if ((rc = vsfs_free_block_deferred(fs, ino->reserved_1)) != 0) return rc;
+    }
+    ino->reserved_0 = 0;
+    ino->reserved_1 = 0;
+    return 0;
+}
+
+/* ---- packed small files ---- */
+
+int vsfs_inode_packed(const inode_t* ino) {
+    return (ino->reserved_2 & (INODE_FLAG_INLINE | INODE_FLAG_TAIL)) != 0;
+}
+
+static uint8_t* inline_area(inode_t* ino) {
+    return (uint8_t*)ino + offsetof(inode_t, direct);
+}
+
+/* Copy the size_bytes of a packed file into 'out'. */
+int vsfs_packed_read(vsfs_t* fs, const inode_t* ino, uint8_t* out) {
+    if (ino->reserved_2 & INODE_FLAG_INLINE) {
+        if (ino->size_bytes > VSFS_INLINE_MAX) return -EIO;
+        memcpy(out, (const uint8_t*)ino + offsetof(inode_t, direct), ino->size_bytes);
+        return 0;
+    }
+    if (!(ino->reserved_2 & INODE_FLAG_TAIL)) return -EINVAL;
+    if (ino->direct[1] > BS || ino->size_bytes > BS - ino->direct[1]) return -EIO;
+    const uint8_t* block = vsfs_block_read(fs, ino->direct[0]);
+    if (!block) return -EIO;
+    memcpy(out, block + ino->direct[1], ino->size_bytes);
+    return 0;
+}
+
+/*
+ * Room for 'size' bytes in this session's tail block, starting a new one when
+ * it is full. Tail blocks go through the block cache like metadata, so many
+ * small files cost one block write and are covered by the journal.
+ */
+static uint8_t* tail_reserve(vsfs_t* fs, uint64_t size, uint32_t* block, uint32_t* offset) {
+    uint8_t* p;
+    if (fs->tail_block && fs->tail_used + size <= BS) {
+        p = vsfs_block_read(fs, fs->tail_block);
+        if (!p) return NULL;
+        vsfs_block_mark_dirty(fs, fs->tail_block);
+    } else {
+        uint32_t b;
+        if (vsfs_alloc_blocks(fs, 1, &b) != 0) return NULL;
+        p = vsfs_block_zero(fs, b);
+        if (!p) return NULL;
+        fs->tail_block = b;
+        fs->tail_used = 0;
+    }
+    *block = (uint32_t)fs->tail_block;
+    *offset = (uint32_t)fs->tail_used;
+    fs->tail_used += size;
+    return p + *offset;
+}
+
+/*
+ * Tail blocks carry no reference count on disk, so the first removal of a
+ * packed file counts the files in every tail block from the inode table.
+ * Counts are stored one high: a block whose last file is gone keeps its slot.
+ */
+static int tail_refs_load(vsfs_t* fs) {
+    if (fs->tail_refs_loaded) return 0;
+    for (uint64_t ino = 1; ino <= fs->sb.inode_count; ino++) {
+        uint64_t bit = ino - 1;
+        if (!((fs->inode_bitmap.bits[bit / 8] >> (bit % 8)) & 1)) continue;
+        inode_t inode;
+        int rc;
+        if ((rc = vsfs_inode_read(fs, ino, &inode)) != 0) return rc;
+        if (!(inode.reserved_2 & INODE_FLAG_TAIL)) continue;
+        uint32_t* refs = u32map_find(&fs->tail_refs, inode.direct[0]);
+        if (refs) {
+            (*refs)++;
+        } else if ((rc = u32map_insert(&fs->tail_refs, inode.direct[0], 2)) != 0) {
+            return rc;
+        }
+    }
+    fs->tail_refs_loaded = 1;
+    return 0;
+}
+
+static int tail_ref(vsfs_t* fs, uint32_t block) {
+    if (!fs->tail_refs_loaded) return 0;
+    uint32_t* refs = u32map_find(&fs->tail_refs, block);
+    if (refs) {
+        (*refs)++;
+        return 0;
+    }
+    return u32map_insert(&fs->tail_refs, block, 2);
+}
+
+/* Drop one packed file from its tail block, freeing the block with the last one. */
+static int tail_unref(vsfs_t* fs, uint32_t block) {
+    int rc;
+    if ((rc = tail_refs_load(fs)) != 0) return rc;
+    uint32_t* refs = u32map_find(&fs->tail_refs, block);
+    if (!refs || *refs < 2) return -EIO;
+    if (--*refs > 1) return 0;
+    if (fs->tail_block == block) fs->tail_block = 0;
+    return vsfs_free_block_deferred(fs, block);
+}
+
+/* ---- directories ---- */
+
+/* 32-bit FNV-1a over the NUL-terminated on-disk name. */
+uint32_t vsfs_dir_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 58 && name[i]; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint64_t dir_depth(const inode_t* ino) {
+    if (!(ino->reserved_2 & INODE_FLAG_HASHED_DIR)) return 0;
+    return ino->reserved_2 >> INODE_DIR_DEPTH_SHIFT;
+}
+
+/*
+ * A directory is 2^depth blocks used as hash buckets: an entry lives in block
+ * (vsfs_dir_hash(name) & (nblocks - 1)). Depth 0 is the original single-block
+ * layout.
+ */
+uint64_t vsfs_dir_blocks(const inode_t* dir) {
+    return 1ull << dir_depth(dir);
+}
+
+static int dir_bucket(vsfs_t* fs, const inode_t* dir, const char* name, uint64_t* idx, uint32_t* phys) {
+    *idx = vsfs_dir_hash(name) & (vsfs_dir_blocks(dir) - 1);
+    if (*idx < DIRECT_MAX) {
+        *phys = dir->direct[*idx];
+        return *phys ? 0 : -EIO;
+    }
+    uint32_t* map = malloc((*idx + 1) * sizeof(uint32_t));
+    if (!map) return -ENOMEM;
+    int rc = vsfs_block_map_read(fs, dir, *idx + 1, map);
+    *phys = map[*idx];
+    free(map);
+    return rc;
+}
+
+int vsfs_dir_lookup(vsfs_t* fs, uint64_t dir_ino, const char* name, uint64_t* ino_out) {
+    inode_t dir;
+    uint64_t idx;
+    uint32_t phys;
+    int rc;
+    if ((rc = vsfs_inode_read(fs, dir_ino, &dir)) != 0) return rc;
+    if (dir_depth(&dir) > MAX_DIR_DEPTH) return -EIO;
+    if ((rc = dir_bucket(fs, &dir, name, &idx, &phys)) != 0) return rc;
+
+    const dirent64_t* entries = (const dirent64_t*)vsfs_block_read(fs, phys);
+    if (!entries) return -EIO;
+    for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no != 0 && strncmp(entries[i].name, name, 58) == 0) {
+            if (ino_out) *ino_out = entries[i].inode_no;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+/* All live entries of a directory except "." and "..", in bucket order, as one malloc'd array. */
+int vsfs_dir_list(vsfs_t* fs, uint64_t dir_ino, dirent64_t** out, uint64_t* count) {
+    inode_t dir;
+    int rc;
+    *out = NULL;
+    *count = 0;
+    if ((rc = vsfs_inode_read(fs, dir_ino, &dir)) != 0) return rc;
+    if (dir_depth(&dir) > MAX_DIR_DEPTH) return -EIO;
+
+    uint64_t nblocks = vsfs_dir_blocks(&dir);
+    uint32_t* phys = malloc(nblocks * sizeof(uint32_t));
+    dirent64_t* list = malloc(nblocks * DIRENTS_PER_BLOCK * sizeof(dirent64_t));
+    if (!phys || !list) {
+        rc = -ENOMEM;
+        goto fail;
+    }
+    if ((rc = vsfs_block_map_read(fs, &dir, nblocks, phys)) != 0) goto fail;
+
+    uint64_t n = 0;
+    for (uint64_t b = 0; b < nblocks; b++) {
+        const dirent64_t* entries = (const dirent64_t*)vsfs_block_read(fs, phys[b]);
+        if (!entries) {
+            rc = -EIO;
+            goto fail;
+        }
+        for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no == 0) continue;
+            if (strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) continue;
+            list[n] = entries[i];
+            list[n].name[57] = '\0';
+            n++;
+        }
+    }
+    free(phys);
+    *out = list;
+    *count = n;
+    return 0;
+
+fail:
+    free(phys);
+    free(list);
+    return rc;
+}
+
+/*
+ * Double the number of buckets. Bucket i splits into i and i + n on the next
+ * hash bit, so each entry either stays put or moves to the same slot of its
+ * new sibling block. Both halves go to newly allocated blocks and the old
+ * ones are freed, so the split never rewrites a block the image still uses.
+ */
+static int dir_grow(vsfs_t* fs, uint64_t dir_ino, inode_t* dir) {
+    uint64_t depth = dir_depth(dir);
+    uint64_t n = 1ull << depth;
+    if (fs->sb.version < 2 || depth >= MAX_DIR_DEPTH || 2 * n > vsfs_max_file_blocks(&fs->sb)) return -ENOSPC;
+
+    uint32_t* phys = malloc(3 * n * sizeof(uint32_t));
+    if (!phys) return -ENOMEM;
+    uint32_t* old = phys + 2 * n;
+    int rc = vsfs_block_map_read(fs, dir, n, old);
+    if (rc == 0) rc = vsfs_alloc_blocks(fs, 2 * n, phys);
+    if (rc != 0) {
+        free(phys);
+        return rc;
+    }
+
+    uint8_t lo[BS], hi[BS];
+    for (uint64_t b = 0; b < n; b++) {
+        const uint8_t* src = vsfs_block_read(fs, old[b]);
+        if (!src) {
+            free(phys);
+            return -EIO;
+        }
+        memcpy(lo, src, BS);
+        memset(hi, 0, BS);
+        dirent64_t* from = (dirent64_t*)lo;
+        dirent64_t* to = (dirent64_t*)hi;
+        for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (from[i].inode_no != 0 && (vsfs_dir_hash(from[i].name) & n)) {
+                to[i] = from[i];
+                memset(&from[i], 0, sizeof(from[i]));
+            }
+        }
+        uint8_t* p = vsfs_block_zero(fs, phys[b]);
+        uint8_t* q = p ? vsfs_block_zero(fs, phys[b + n]) : NULL;
+        if (!q) {
+            free(phys);
+            return -ENOMEM;
+        }
+        memcpy(p, lo, BS);
+        memcpy(q, hi, BS);
+    }
+
+    for (uint64_t b = 0; b < n && rc == 0; b++) rc = vsfs_free_block_deferred(fs, old[b]);
+    if (rc == 0 && (rc = vsfs_block_map_release(fs, dir, n)) == 0) {
+        rc = vsfs_block_map_assign(fs, dir, phys, 2 * n);
+    }
+    free(phys);
+    if (rc != 0) return rc;
+
+    dir->reserved_2 &= ~(0xFFu << INODE_DIR_DEPTH_SHIFT);
+    dir->reserved_2 |= INODE_FLAG_HASHED_DIR | (uint32_t)((depth + 1) << INODE_DIR_DEPTH_SHIFT);
+    if ((rc = vsfs_inode_write(fs, dir_ino, dir)) != 0) return rc;
+
+    if (!(fs->sb.flags & FEATURE_HASHED_DIR)) {
+        fs->sb.flags |= FEATURE_HASHED_DIR;
+        fs->sb_dirty = 1;
+    }
+    return 0;
+}
+
+int vsfs_dir_insert(vsfs_t* fs, uint64_t dir_ino, const char* name, uint64_t ino, uint8_t type) {
+    inode_t dir;
+    int rc;
+    if ((rc = vsfs_inode_read(fs, dir_ino, &dir)) != 0) return rc;
+    if (dir_depth(&dir) > MAX_DIR_DEPTH) return -EIO;
+
+    for (;;) {
+        uint64_t idx;
+        uint32_t phys;
+        if ((rc = dir_bucket(fs, &dir, name, &idx, &phys)) != 0) return rc;
+        dirent64_t* entries = (dirent64_t*)vsfs_block_read(fs, phys);
+        if (!entries) return -EIO;
+
+        for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no == 0) {
+                memset(&entries[i], 0, sizeof(entries[i]));
+                entries[i].inode_no = (uint32_t)ino;
+                entries[i].type = type;
+                strncpy(entries[i].name, name, 57);
+                entries[i].name[57] = '\0';
+                dirent_checksum_finalize(&entries[i]);
+                vsfs_block_mark_dirty(fs, phys);
+
+                dir.size_bytes += sizeof(dirent64_t);
+                dir.mtime = time(NULL);
+                return vsfs_inode_write(fs, dir_ino, &dir);
+            }
+        }
+
+        if ((rc = dir_grow(fs, dir_ino, &dir)) != 0) return rc;
+    }
+}
+
+/* Clear an entry and drop it from the directory's link count; the inverse of dir_link(). */
+static int dir_unlink(vsfs_t* fs, uint64_t dir_ino, const char* name) {
+    inode_t dir;
+    uint64_t idx;
+    uint32_t phys;
+    int rc;
+    if ((rc = vsfs_inode_read(fs, dir_ino, &dir)) != 0) return rc;
+    if (dir_depth(&dir) > MAX_DIR_DEPTH) return -EIO;
+    if ((rc = dir_bucket(fs, &dir, name, &idx, &phys)) != 0) return rc;
+
+    dirent64_t* entries = (dirent64_t*)vsfs_block_read(fs, phys);
+    if (!entries) return -EIO;
+    for (uint64_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no != 0 && strncmp(entries[i].name, name, 58) == 0) {
+            memset(&entries[i], 0, sizeof(entries[i]));
+            vsfs_block_mark_dirty(fs, phys);
+            dir.size_bytes -= sizeof(dirent64_t);
+            dir.links--;
+            dir.mtime = time(NULL);
+            return vsfs_inode_write(fs, dir_ino, &dir);
+        }
+    }
+    return -ENOENT;
+}
+
+/* Insert an entry and count it in the directory's link count, as every entry added by the tools is. */
+static int dir_link(vsfs_t* fs, uint64_t dir_ino, const char* name, uint64_t ino, uint8_t type) {
+    int rc;
+    if ((rc = vsfs_dir_insert(fs, dir_ino, name, ino, type)) != 0) return rc;
+    inode_t dir;
+    if ((rc = vsfs_inode_read(fs, dir_ino, &dir)) != 0) return rc;
+    dir.links++;
+    return vsfs_inode_write(fs, dir_ino, &dir);
+}
+
+int vsfs_mkdir(vsfs_t* fs, uint64_t parent, const char* name, uint64_t* ino_out) {
+    if (name[0] == '\0' || strlen(name) > VSFS_NAME_MAX || strchr(name, '/')) return -EINVAL;
+    int rc = vsfs_dir_lookup(fs, parent, name, NULL);
+    if (rc != -ENOENT) return rc == 0 ? -EEXIST : rc;
+
+    uint64_t ino;
+    uint32_t block;
+    if ((rc = vsfs_alloc_inode(fs, &ino)) != 0) return rc;
+    if ((rc = vsfs_alloc_blocks(fs, 1, &block)) != 0) {
+        vsfs_bitmap_clear_range(&fs->inode_bitmap, ino - 1, 1);
+        return rc;
+    }
+
+    dirent64_t* entries = (dirent64_t*)vsfs_block_zero(fs, block);
+    if (!entries) {
+        rc = -ENOMEM;
+        goto fail;
+    }
+    const char* names[2] = { ".", ".." };
+    uint64_t targets[2] = { ino, parent };
+    for (int i = 0; i < 2; i++) {
+        entries[i].inode_no = (uint32_t)targets[i];
+        entries[i].type = DIRENT_DIR;
+        strcpy(entries[i].name, names[i]);
+        dirent_checksum_finalize(&entries[i]);
+    }
+
+    inode_t dir = {0};
+    dir.mode = 0040000;
+    dir.links = 2;
+    dir.size_bytes = 2 * sizeof(dirent64_t);
+    dir.atime = dir.mtime = dir.ctime = time(NULL);
+    dir.direct[0] = block;
+    dir.proj_id = 13;
+    if ((rc = vsfs_inode_write(fs, ino, &dir)) != 0) goto fail;
+    if ((rc = dir_link(fs, parent, name, ino, DIRENT_DIR)) != 0) goto fail;
+
+    dcache_insert(&fs->dcache, parent, name, ino);
+    if (ino_out) *ino_out = ino;
+    return 0;
+
+fail:
+    cache_drop(&fs->cache, block);
+    vsfs_bitmap_clear_range(&fs->data_bitmap, block - fs->sb.data_region_start, 1);
+    vsfs_bitmap_clear_range(&fs->inode_bitmap, ino - 1, 1);
+    return rc;
+}
+
+int vsfs_path_lookup(vsfs_t* fs, uint64_t dir_ino, const char* path, int create, uint64_t* ino_out) {
+    uint64_t ino = dir_ino;
+    while (*path) {
+        size_t len = strcspn(path, "/");
+        if (len > VSFS_NAME_MAX) return -ENAMETOOLONG;
+        char name[58];
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len + (path[len] == '/');
+        if (len == 0 || strcmp(name, ".") == 0) continue;
+
+        uint64_t next = dcache_find(&fs->dcache, ino, name);
+        if (next) {
+            fs->dcache.hits++;
+            ino = next;
+            continue;
+        }
+        fs->dcache.misses++;
+        int rc = vsfs_dir_lookup(fs, ino, name, &next);
+        if (rc == -ENOENT && create) {
+            if ((rc = vsfs_mkdir(fs, ino, name, &next)) != 0) return rc;
+            if (fs->verbose) printf("Created directory: %s -> inode %lu\n", name, (unsigned long)next);
+        } else if (rc != 0) {
+            return rc;
+        } else {
+            inode_t inode;
+            if ((rc = vsfs_inode_read(fs, next, &inode)) != 0) return rc;
+            if ((inode.mode & 0170000) != 0040000) return -ENOTDIR;
+            dcache_insert(&fs->dcache, ino, name, next);
+        }
+        ino = next;
+    }
+    *ino_out = ino;
+    return 0;
+}
+
+/* ---- deduplication ---- */
+
+#define DEDUP_TOMBSTONE UINT32_MAX
+
+/* Length of the run of physically consecutive blocks starting at blocks[i]. */
+uint64_t vsfs_block_run_length(const uint32_t* blocks, uint64_t i, uint64_t count) {
+    uint64_t n = 1;
+    while (i + n < count && blocks[i + n] == blocks[i] + n) n++;
+    return n;
+}
+
+static int block_in_use(const vsfs_t* fs, uint32_t block) {
+    uint64_t bit = block - fs->sb.data_region_start;
+    return block >= fs->sb.data_region_start && bit < fs->data_bitmap.nbits &&
+           ((fs->data_bitmap.bits[bit / 8] >> (bit % 8)) & 1);
+}
+
+/* An allocated data block whose contents equal 'data' (one full block), or 0. */
+static uint32_t dedup_find(vsfs_t* fs, const uint8_t* data, uint32_t crc) {
+    const vsfs_u32map_t* m = &fs->dedup_index;
+    if (!m->slots) return 0;
+    uint8_t existing[BS];
+    for (uint64_t i = u32map_slot(m, crc); m->slots[i].value != 0; i = (i + 1) & m->mask) {
+        uint32_t block = m->slots[i].value;
+        if (m->slots[i].key != crc || block == DEDUP_TOMBSTONE || !block_in_use(fs, block)) continue;
+        if (read_blocks(fs, block, existing, 1) == 0 && memcmp(existing, data, BS) == 0) return block;
+    }
+    return 0;
+}
+
+static int dedup_ref(vsfs_t* fs, uint32_t block) {
+    uint32_t* refs = u32map_find(&fs->dedup_refs, block);
+    if (refs) {
+        (*refs)++;
+        return 0;
+    }
+    return u32map_insert(&fs->dedup_refs, block, 2);
+}
+
+uint32_t vsfs_block_refs(const vsfs_t* fs, uint32_t block) {
+    const uint32_t* refs = u32map_find(&fs->dedup_refs, block);
+    if (refs) return *refs;
+    return block_in_use(fs, block) ? 1 : 0;
+}
+
+/* Take a block out of the dedup index before its contents change or it is freed. */
+static void dedup_forget(vsfs_t* fs, uint32_t block) {
+    if (!fs->dedup || !fs->dedup_index.slots) return;
+    uint8_t data[BS];
+    if (read_blocks(fs, block, data, 1) != 0) return;
+    const vsfs_u32map_t* m = &fs->dedup_index;
+    uint32_t crc = crc32(data, BS);
+    for (uint64_t i = u32map_slot(m, crc); m->slots[i].value != 0; i = (i + 1) & m->mask) {
+        if (m->slots[i].key == crc && m->slots[i].value == block) m->slots[i].value = DEDUP_TOMBSTONE;
+    }
+}
+
+/*
+ * Drop one file's reference to a data block, freeing it (at the next flush)
+ * with the last one. A freed block is also removed from the dedup index so
+ * no new file can share it before the flush.
+ */
+int vsfs_block_unref(vsfs_t* fs, uint32_t block) {
+    uint32_t* refs = u32map_find(&fs->dedup_refs, block);
+    if (refs && *refs > 1) {
+        (*refs)--;
+        return 0;
+    }
+    dedup_forget(fs, block);
+    return vsfs_free_block_deferred(fs, block);
+}
+
+/*
+ * Build the dedup index and reference counts from every regular file, reading
+ * each run of consecutive data blocks with one pread. Blocks mapped by more
+ * than one file are counted in dedup_refs; the rest implicitly have one.
+ */
+int vsfs_dedup_load(vsfs_t* fs) {
+    enum { CHUNK = 64 };
+    uint8_t* seen = calloc((fs->sb.data_region_blocks + 7) / 8, 1);
+    uint8_t* buf = malloc(CHUNK * BS);
+    uint32_t* blocks = NULL;
+    int rc = 0;
+    if (!seen || !buf) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    fs->dedup = 1;
+
+    for (uint64_t ino = 1; ino <= fs->sb.inode_count && rc == 0; ino++) {
+        uint64_t bit = ino - 1;
+        if (!((fs->inode_bitmap.bits[bit / 8] >> (bit % 8)) & 1)) continue;
+        inode_t inode;
+        if ((rc = vsfs_inode_read(fs, ino, &inode)) != 0) break;
+        if ((inode.mode & 0170000) != 0100000 || vsfs_inode_packed(&inode)) continue;
+
+        uint64_t count = vsfs_file_blocks(&inode);
+        if (count > vsfs_max_file_blocks(&fs->sb)) {
+            rc = -EIO;
+            break;
+        }
+        uint32_t* more = realloc(blocks, (count ? count : 1) * sizeof(uint32_t));
+        if (!more) {
+            rc = -ENOMEM;
+            break;
+        }
+        blocks = more;
+        if ((rc = vsfs_block_map_read(fs, &inode, count, blocks)) != 0) break;
+
+        for (uint64_t i = 0; i < count && rc == 0; ) {
+            uint64_t run = vsfs_block_run_length(blocks, i, count);
+            if (run > CHUNK) run = CHUNK;
+            if (!block_in_use(fs, blocks[i]) || !block_in_use(fs, (uint32_t)(blocks[i] + run - 1))) {
+                rc = -EIO;
+                break;
+            }
+            if ((rc = read_blocks(fs, blocks[i], buf, run)) != 0) break;
+            for (uint64_t j = 0; j < run && rc == 0; j++) {
+                uint32_t block = (uint32_t)(blocks[i] + j);
+                uint64_t b = block - fs->sb.data_region_start;
+                if ((seen[b / 8] >> (b % 8)) & 1) {
+                    rc = dedup_ref(fs, block);
+                } else {
+                    seen[b / 8] |= (uint8_t)(1u << (b % 8));
+                    rc = u32map_insert(&fs->dedup_index, crc32(buf + j * BS, BS), block);
+                }
+            }
+            i += run;
+        }
+    }
+
+out:
+    if (rc == 0) fs->dedup_loaded = 1;
+    free(seen);
+    free(buf);
+    free(blocks);
+    return rc;
+}
+
+/* Blocks of an image that has ever shared one may only be released once the reference counts are known. */
+static int dedup_refs_ready(vsfs_t* fs) {
+    if (!(fs->sb.flags & FEATURE_DEDUP) || fs->dedup_loaded) return 0;
+    int dedup = fs->dedup;
+    int rc = vsfs_dedup_load(fs);
+    fs->dedup = dedup;
+    return rc;
+}
+
+/*
+ * Look up every block of the file in the dedup index. Matches are shared and
+ * referenced; the remaining blocks are allocated together, contiguously when
+ * possible, and are indexed once the file is committed.
+ */
+static int dedup_prepare(vsfs_t* fs, vsfs_new_file_t* nf) {
+    nf->crcs = malloc(nf->nblocks * sizeof(uint32_t));
+    nf->shared = calloc(nf->nblocks, 1);
+    if (!nf->crcs || !nf->shared) return -ENOMEM;
+    for (uint64_t i = 0; i < nf->nblocks; i++) nf->blocks[i] = 0;
+
+    /* A compressed file is deduplicated by the blocks of its stream. */
+    const uint8_t* map = nf->stream;
+    uint64_t size = nf->stream ? nf->stream_size : nf->size;
+    if (!map) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, nf->src_fd, 0);
+        if (map == MAP_FAILED) return -errno;
+        madvise((void*)map, size, MADV_SEQUENTIAL);
+    }
+
+    int rc = 0;
+    uint8_t last[BS];
+    for (uint64_t i = 0; i < nf->nblocks && rc == 0; i++) {
+        const uint8_t* data = map + i * BS;
+        if ((i + 1) * BS > size) {
+            memset(last, 0, BS);
+            memcpy(last, data, size - i * BS);
+            data = last;
+        }
+        nf->crcs[i] = crc32(data, BS);
+        uint32_t block = dedup_find(fs, data, nf->crcs[i]);
+        if (block && (rc = dedup_ref(fs, block)) == 0) {
+            nf->blocks[i] = block;
+            nf->shared[i] = 1;
+            nf->nshared++;
+        }
+    }
+    if (!nf->stream) munmap((void*)map, size);
+    if (rc != 0) return rc;
+
+    uint64_t nnew = nf->nblocks - nf->nshared;
+    if (nnew == 0) return 0;
+    uint32_t* fresh = malloc(nnew * sizeof(uint32_t));
+    if (!fresh) return -ENOMEM;
+    if ((rc = vsfs_alloc_blocks(fs, nnew, fresh)) == 0) {
+        for (uint64_t i = 0, j = 0; i < nf->nblocks; i++) {
+            if (!nf->shared[i]) nf->blocks[i] = fresh[j++];
+        }
+    }
+    free(fresh);
+    return rc;
+}
+
+/* ---- compressed files ---- */
+
+unsigned vsfs_inode_codec(const inode_t* ino) {
+    if (!(ino->reserved_2 & INODE_FLAG_COMPRESSED)) return VSFS_CODEC_NONE;
+    return (ino->reserved_2 >> INODE_CODEC_SHIFT) & 0xFF;
+}
+
+/* Number of data blocks a regular file maps. */
+uint64_t vsfs_file_blocks(const inode_t* ino) {
+    if (vsfs_inode_packed(ino)) return 0;
+    if (ino->reserved_2 & INODE_FLAG_COMPRESSED) return (ino->xattr_ptr + BS - 1) / BS;
+    return (ino->size_bytes + BS - 1) / BS;
+}
+
+/* Total length, header included, of the frame starting with 'header'. */
+uint64_t vsfs_frame_length(const uint8_t* header) {
+    uint32_t h;
+    memcpy(&h, header, sizeof(h));
+    return 4 + (le32toh(h) & ~VSFS_FRAME_STORED);
+}
+
+int vsfs_frame_decode(unsigned codec, const uint8_t* frame, uint64_t len, uint8_t* out, uint64_t out_len) {
+    uint32_t h;
+    if (len < 4 || vsfs_frame_length(frame) != len) return -EIO;
+    memcpy(&h, frame, sizeof(h));
+    if (le32toh(h) & VSFS_FRAME_STORED) {
+        if (len - 4 != out_len) return -EIO;
+        memcpy(out, frame + 4, out_len);
+        return 0;
+    }
+    return vsfs_decompress(codec, frame + 4, len - 4, out, out_len);
+}
+
+/*
+ * Compress the source into nf->stream, one frame per VSFS_FRAME_SIZE bytes.
+ * The stream is dropped, and the file stored as is, as soon as it can no
+ * longer come out at least one block shorter than the data.
+ */
+static int compress_prepare(vsfs_t* fs, vsfs_new_file_t* nf) {
+    uint64_t limit = (nf->nblocks - 1) * BS;
+    const uint8_t* map = mmap(NULL, nf->size, PROT_READ, MAP_PRIVATE, nf->src_fd, 0);
+    if (map == MAP_FAILED) return -errno;
+    madvise((void*)map, nf->size, MADV_SEQUENTIAL);
+
+    uint64_t cap = 0, pos = 0;
+    uint8_t* stream = NULL;
+    int rc = 0;
+    for (uint64_t off = 0; off < nf->size; off += VSFS_FRAME_SIZE) {
+        uint64_t n = nf->size - off < VSFS_FRAME_SIZE ? nf->size - off : VSFS_FRAME_SIZE;
+        if (cap - pos < 4 + n && cap < limit) {
+            uint64_t grow = cap ? cap * 2 : 1u << 20;
+            if (grow > limit) grow = limit;
+            uint8_t* more = realloc(stream, grow);
+            if (!more) {
+                rc = -ENOMEM;
+                break;
+            }
+            stream = more;
+            cap = grow;
+        }
+        if (cap - pos < 4) {
+            pos = 0;
+            break;
+        }
+        uint64_t room = cap - pos - 4;
+        uint32_t h = (uint32_t)vsfs_compress(fs->compress, map + off, n, stream + pos + 4, room < n - 1 ? room : n - 1);
+        if (h == 0) {
+            if (room < n) {
+                pos = 0;
+                break;
+            }
+            memcpy(stream + pos + 4, map + off, n);
+            h = (uint32_t)n | VSFS_FRAME_STORED;
+        }
+        h = htole32(h);
+        memcpy(stream + pos, &h, sizeof(h));
+        pos += vsfs_frame_length(stream + pos);
+    }
+    munmap((void*)map, nf->size);
+
+    if (rc != 0 || pos == 0) {
+        free(stream);
+        return rc;
+    }
+    nf->stream = stream;
+    nf->stream_size = pos;
+    nf->codec = fs->compress;
+    nf->nblocks = (pos + BS - 1) / BS;
+    if (fs->verbose) {
+        printf("Compressed %lu bytes to %lu with %s\n", (unsigned long)nf->size, (unsigned long)pos,
+               vsfs_codec_name(nf->codec));
+    }
+    return 0;
+}
+
+/* Read bytes [pos, pos + len) of a file's stream, one pread() per run of consecutive blocks. */
+static int stream_read(vsfs_t* fs, const uint32_t* blocks, uint64_t count, uint64_t pos, uint64_t len, uint8_t* dst) {
+    while (len) {
+        uint64_t i = pos / BS;
+        uint64_t n = vsfs_block_run_length(blocks, i, count) * BS - pos % BS;
+        if (n > len) n = len;
+        if (image_pread(fs, dst, n, blocks[i] * (uint64_t)BS + pos % BS) != (ssize_t)n) return -EIO;
+        pos += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* ---- files ---- */
+
+/* copy_file_range() from src_off to dst_off; returns the number of bytes copied. */
+static uint64_t copy_range(int src_fd, uint64_t src_off, int dst_fd, uint64_t dst_off, uint64_t len) {
+    loff_t in = (loff_t)src_off, out = (loff_t)dst_off;
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, len - done, 0);
+        if (n <= 0) break;
+        done += (uint64_t)n;
+    }
+    return done;
+}
+
+/*
+ * Copy blocks [first, first + count) of src_fd (a file of 'size' bytes) into
+ * the matching entries of 'blocks' without staging them in user space: each
+ * run of consecutive blocks is one copy_file_range() into the image, falling
+ * back to pwrite() straight from an mmap of the source when the kernel or
+ * filesystem cannot copy between the two files. Only the tail of the last
+ * block is zero-filled.
+ */
+static int write_payload(vsfs_t* fs, int src_fd, const uint32_t* blocks, uint64_t first, uint64_t count,
+                         uint64_t size) {
+    static const uint8_t zeros[BS];
+    const uint8_t* map = NULL;
+    int use_copy = 1;
+    int rc = 0;
+
+    for (uint64_t i = first; i < first + count; ) {
+        uint64_t run = vsfs_block_run_length(blocks, i, first + count);
+        uint64_t src_off = i * (uint64_t)BS;
+        uint64_t dst_off = blocks[i] * (uint64_t)BS;
+        uint64_t len = run * (uint64_t)BS;
+        if (src_off + len > size) len = size - src_off;
+
+        uint64_t done = use_copy ? copy_range(src_fd, src_off, fs->fd, dst_off, len) : 0;
+        if (done) vsfs_stats_io(&fs->stats, 1, dst_off, done);
+        if (done < len) {
+            use_copy = 0;
+            if (!map) {
+                map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+                if (map == MAP_FAILED) {
+                    map = NULL;
+                    rc = -errno;
+                    break;
+                }
+                madvise((void*)map, size, MADV_SEQUENTIAL);
+            }
+            while (done < len) {
+                ssize_t w = image_pwrite(fs, map + src_off + done, len - done, dst_off + done);
+                if (w <= 0) break;
+                done += (uint64_t)w;
+            }
+            if (done < len) {
+                rc = -EIO;
+                break;
+            }
+        }
+        if (len % BS) {
+            uint64_t pad = BS - len % BS;
+            if (image_pwrite(fs, zeros, pad, dst_off + len) != (ssize_t)pad) {
+                rc = -EIO;
+                break;
+            }
+        }
+
+        if (fs->verbose) {
+            printf("Written %llu bytes to blocks %u-%u\n", (unsigned long long)len,
+                   blocks[i], (uint32_t)(blocks[i] + run - 1));
+        }
+        i += run;
+    }
+    if (map) munmap((void*)map, size);
+    return rc;
+}
+
+/* Like write_payload() for a payload already in memory, such as a compressed stream. */
+static int write_buffer(vsfs_t* fs, const uint8_t* buf, uint64_t size, const uint32_t* blocks, uint64_t first,
+                        uint64_t count) {
+    static const uint8_t zeros[BS];
+    for (uint64_t i = first; i < first + count; ) {
+        uint64_t run = vsfs_block_run_length(blocks, i, first + count);
+        uint64_t src_off = i * (uint64_t)BS;
+        uint64_t dst_off = blocks[i] * (uint64_t)BS;
+        uint64_t len = run * (uint64_t)BS;
+        if (src_off + len > size) len = size - src_off;
+
+        for (uint64_t done = 0; done < len; ) {
+            ssize_t w = image_pwrite(fs, buf + src_off + done, len - done, dst_off + done);
+            if (w <= 0) return -EIO;
+            done += (uint64_t)w;
+        }
+        if (len % BS) {
+            uint64_t pad = BS - len % BS;
+            if (image_pwrite(fs, zeros, pad, dst_off + len) != (ssize_t)pad) return -EIO;
+        }
+        if (fs->verbose) {
+            printf("Written %llu bytes to blocks %u-%u\n", (unsigned long long)len,
+                   blocks[i], (uint32_t)(blocks[i] + run - 1));
+        }
+        i += run;
+    }
+    return 0;
+}
+
+static int copy_blocks(vsfs_t* fs, vsfs_new_file_t* nf, uint64_t first, uint64_t count) {
+    if (nf->stream) return write_buffer(fs, nf->stream, nf->stream_size, nf->blocks, first, count);
+    return write_payload(fs, nf->src_fd, nf->blocks, first, count, nf->size);
+}
+
+/*
+ * Open the host file, check that 'name' is free in dir_ino and reserve an
+ * inode and the file's data blocks. Nothing is linked until
+ * vsfs_add_commit(); vsfs_add_abort() returns the reservation.
+ */
+int vsfs_add_prepare(vsfs_t* fs, uint64_t dir_ino, const char* path, const char* name, vsfs_new_file_t* nf) {
+    memset(nf, 0, sizeof(*nf));
+    nf->src_fd = open(path, O_RDONLY);
+    if (nf->src_fd < 0) return -errno;
+    snprintf(nf->name, sizeof(nf->name), "%s", name);
+
+    struct stat file_stat;
+    int rc;
+    if (fstat(nf->src_fd, &file_stat) != 0) {
+        rc = -errno;
+        goto fail;
+    }
+    nf->size = (uint64_t)file_stat.st_size;
+    nf->mtime = (uint64_t)file_stat.st_mtime;
+    nf->nblocks = (nf->size + BS - 1) / BS;
+    if (nf->nblocks > vsfs_max_file_blocks(&fs->sb)) {
+        rc = -EFBIG;
+        goto fail;
+    }
+
+    uint64_t t0 = vsfs_now_ns();
+    rc = vsfs_dir_lookup(fs, dir_ino, nf->name, NULL);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_DIRECTORY, t0);
+    if (rc != -ENOENT) {
+        if (rc == 0) rc = -EEXIST;
+        goto fail;
+    }
+
+    t0 = vsfs_now_ns();
+    rc = vsfs_alloc_inode(fs, &nf->ino);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_BITMAP, t0);
+    if (rc != 0) goto fail;
+    if (fs->verbose) printf("Allocated inode: %lu\n", (unsigned long)nf->ino);
+
+    if (fs->pack_small && fs->sb.version >= 2 && nf->size > 0 && nf->size <= VSFS_TAIL_MAX) {
+        nf->nblocks = 0;
+        nf->packed = malloc(nf->size);
+        if (!nf->packed) {
+            rc = -ENOMEM;
+            goto fail;
+        }
+        return 0;
+    }
+
+    t0 = vsfs_now_ns();
+    if (fs->compress && fs->sb.version >= 2 && nf->nblocks > 1) rc = compress_prepare(fs, nf);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_PAYLOAD, t0);
+    if (rc != 0) goto fail;
+
+    nf->blocks = malloc((nf->nblocks ? nf->nblocks : 1) * sizeof(uint32_t));
+    if (!nf->blocks) {
+        rc = -ENOMEM;
+        goto fail;
+    }
+    /* With dedup, looking up the blocks is payload work and allocation is part of it. */
+    t0 = vsfs_now_ns();
+    if (fs->dedup && nf->nblocks > 0) {
+        rc = dedup_prepare(fs, nf);
+        vsfs_stats_phase(&fs->stats, VSFS_PHASE_PAYLOAD, t0);
+        if (rc != 0) goto fail;
+    } else {
+        rc = vsfs_alloc_blocks(fs, nf->nblocks, nf->blocks);
+        vsfs_stats_phase(&fs->stats, VSFS_PHASE_BITMAP, t0);
+        if (rc != 0) {
+            free(nf->blocks);
+            nf->blocks = NULL;
+            goto fail;
+        }
+    }
+    if (fs->verbose && nf->nshared) {
+        printf("Shared %lu of %lu data blocks with existing files\n", (unsigned long)nf->nshared,
+               (unsigned long)nf->nblocks);
+    }
+    for (uint64_t i = 0; fs->verbose && i < nf->nblocks; ) {
+        uint64_t run = vsfs_block_run_length(nf->blocks, i, nf->nblocks);
+        if (!nf->shared || !nf->shared[i]) {
+            printf("Allocated data blocks: %u-%u\n", nf->blocks[i], (uint32_t)(nf->blocks[i] + run - 1));
+        }
+        i += run;
+    }
+    return 0;
+
+fail:
+    vsfs_add_abort(fs, nf);
+    return rc;
+}
+
+static int copy_payload(vsfs_t* fs, vsfs_new_file_t* nf) {
+    if (nf->packed) {
+        ssize_t r = pread(nf->src_fd, nf->packed, nf->size, 0);
+        return r == (ssize_t)nf->size ? 0 : -EIO;
+    }
+    if (!nf->shared) return copy_blocks(fs, nf, 0, nf->nblocks);
+
+    /* Only the blocks that were not found in the dedup index are written. */
+    for (uint64_t i = 0; i < nf->nblocks; ) {
+        uint64_t n = 0;
+        while (i + n < nf->nblocks && nf->shared[i + n] == nf->shared[i]) n++;
+        if (!nf->shared[i]) {
+            int rc = copy_blocks(fs, nf, i, n);
+            if (rc != 0) return rc;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+/* Copy the payload into the reserved blocks. Only fs->fd is used, so files may be copied concurrently. */
+int vsfs_add_copy(vsfs_t* fs, vsfs_new_file_t* nf) {
+    uint64_t t0 = vsfs_now_ns();
+    int rc = copy_payload(fs, nf);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_PAYLOAD, t0);
+    return rc;
+}
+
+/* Build and write the inode of a prepared file. */
+static int write_file_inode(vsfs_t* fs, vsfs_new_file_t* nf) {
+    int rc;
+    inode_t new_inode = {0};
+    new_inode.mode = 0100000;
+    new_inode.links = 1;
+    new_inode.size_bytes = nf->size;
+    new_inode.atime = time(NULL);
+    new_inode.mtime = nf->mtime;
+    new_inode.ctime = time(NULL);
+    new_inode.proj_id = 13;
+    if (nf->packed && nf->size <= VSFS_INLINE_MAX) {
+        memcpy(inline_area(&new_inode), nf->packed, nf->size);
+        new_inode.reserved_2 = INODE_FLAG_INLINE;
+    } else if (nf->packed) {
+        uint32_t block, offset;
+        uint8_t* p = tail_reserve(fs, nf->size, &block, &offset);
+        if (!p) return -ENOSPC;
+        memcpy(p, nf->packed, nf->size);
+        if ((rc = tail_ref(fs, block)) != 0) return rc;
+        new_inode.direct[0] = block;
+        new_inode.direct[1] = offset;
+        new_inode.reserved_2 = INODE_FLAG_TAIL;
+        if (fs->verbose) printf("Packed %lu bytes into tail block %u at offset %u\n", (unsigned long)nf->size, block, offset);
+    } else if ((rc = vsfs_block_map_assign(fs, &new_inode, nf->blocks, nf->nblocks)) != 0) {
+        return rc;
+    }
+    if (nf->stream) {
+        new_inode.reserved_2 = INODE_FLAG_COMPRESSED | nf->codec << INODE_CODEC_SHIFT;
+        new_inode.xattr_ptr = nf->stream_size;
+        if (!(fs->sb.flags & FEATURE_COMPRESSED)) {
+            fs->sb.flags |= FEATURE_COMPRESSED;
+            fs->sb_dirty = 1;
+        }
+    }
+    if (nf->packed && !(fs->sb.flags & FEATURE_PACKED_FILES)) {
+        fs->sb.flags |= FEATURE_PACKED_FILES;
+        fs->sb_dirty = 1;
+    }
+    return vsfs_inode_write(fs, nf->ino, &new_inode);
+}
+
+/* Write the inode and link it into dir_ino; the name is checked again for duplicates within a batch. */
+int vsfs_add_commit(vsfs_t* fs, uint64_t dir_ino, vsfs_new_file_t* nf) {
+    uint64_t t0 = vsfs_now_ns();
+    int rc = vsfs_dir_lookup(fs, dir_ino, nf->name, NULL);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_DIRECTORY, t0);
+    if (rc != -ENOENT) return rc == 0 ? -EEXIST : rc;
+
+    t0 = vsfs_now_ns();
+    rc = write_file_inode(fs, nf);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_INODE, t0);
+    if (rc != 0) return rc;
+
+    t0 = vsfs_now_ns();
+    rc = dir_link(fs, dir_ino, nf->name, nf->ino, DIRENT_FILE);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_DIRECTORY, t0);
+    if (rc != 0) {
+        /* Give back what the inode took, so the files committed before this one can still be flushed. */
+        inode_t inode;
+        if (vsfs_inode_read(fs, nf->ino, &inode) == 0) {
+            if (inode.reserved_2 & INODE_FLAG_TAIL) {
+                tail_unref(fs, inode.direct[0]);
+            } else if (!(inode.reserved_2 & INODE_FLAG_INLINE)) {
+                vsfs_block_map_release(fs, &inode, vsfs_file_blocks(&inode));
+            }
+            inode_t empty = {0};
+            vsfs_inode_write(fs, nf->ino, &empty);
+        }
+        return rc;
+    }
+
+    nf->linked = 1;
+
+    /* The index only lists blocks whose contents are on disk; it is a cache, so running out of memory is harmless. */
+    for (uint64_t i = 0; nf->shared && i < nf->nblocks; i++) {
+        if (!nf->shared[i] && u32map_insert(&fs->dedup_index, nf->crcs[i], nf->blocks[i]) != 0) break;
+    }
+    if (nf->nshared && !(fs->sb.flags & FEATURE_DEDUP)) {
+        fs->sb.flags |= FEATURE_DEDUP;
+        fs->sb_dirty = 1;
+    }
+    return 0;
+}
+
+/* Close the source file and, unless the file was linked, give back its inode and data blocks. */
+void vsfs_add_abort(vsfs_t* fs, vsfs_new_file_t* nf) {
+    if (!nf->linked) {
+        if (nf->ino) vsfs_bitmap_clear_range(&fs->inode_bitmap, nf->ino - 1, 1);
+        for (uint64_t i = 0; nf->blocks && i < nf->nblocks; i++) {
+            if (nf->shared && nf->shared[i]) {
+                /* dedup_ref() counted the reservation, so the entry is there unless the map is corrupt. */
+                uint32_t* refs = u32map_find(&fs->dedup_refs, nf->blocks[i]);
+                if (refs && *refs > 1) (*refs)--;
+            } else if (nf->blocks[i]) {
+                vsfs_bitmap_clear_range(&fs->data_bitmap, nf->blocks[i] - fs->sb.data_region_start, 1);
+            }
+        }
+    }
+    if (nf->src_fd >= 0) close(nf->src_fd);
+    free(nf->blocks);
+    free(nf->packed);
+    free(nf->crcs);
+    free(nf->shared);
+    free(nf->stream);
+    nf->src_fd = -1;
+    nf->blocks = NULL;
+    nf->packed = NULL;
+    nf->crcs = NULL;
+    nf->shared = NULL;
+    nf->stream = NULL;
+    nf->ino = 0;
+}
+
+int vsfs_add_file(vsfs_t* fs, uint64_t dir_ino, const char* path, const char* name, uint64_t* ino_out) {
+    vsfs_new_file_t nf;
+    int rc = vsfs_add_prepare(fs, dir_ino, path, name, &nf);
+    if (rc != 0) return rc;
+    if ((rc = vsfs_add_copy(fs, &nf)) == 0 && (rc = vsfs_add_commit(fs, dir_ino, &nf)) == 0 && ino_out) {
+        *ino_out = nf.ino;
+    }
+    vsfs_add_abort(fs, &nf);
+    return rc;
+}
+
+/* ---- removal ---- */
+
+/* Give back everything an inode maps; the inode itself is left to the caller. */
+static int release_storage(vsfs_t* fs, inode_t* inode) {
+    if (inode->reserved_2 & INODE_FLAG_INLINE) return 0;
+    if (inode->reserved_2 & INODE_FLAG_TAIL) return tail_unref(fs, inode->direct[0]);
+
+    int is_dir = (inode->mode & 0170000) == 0040000;
+    if (is_dir && dir_depth(inode) > MAX_DIR_DEPTH) return -EIO;
+    uint64_t count = is_dir ? vsfs_dir_blocks(inode) : vsfs_file_blocks(inode);
+    if (count > vsfs_max_file_blocks(&fs->sb)) return -EIO;
+    int rc;
+    if (!is_dir && (rc = dedup_refs_ready(fs)) != 0) return rc;
+
+    uint32_t* blocks = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!blocks) return -ENOMEM;
+    rc = vsfs_block_map_read(fs, inode, count, blocks);
+    /* Directory blocks are never shared; file blocks may be. */
+    for (uint64_t i = 0; i < count && rc == 0; i++) {
+        rc = is_dir ? vsfs_free_block_deferred(fs, blocks[i]) : vsfs_block_unref(fs, blocks[i]);
+    }
+    if (rc == 0) rc = vsfs_block_map_release(fs, inode, count);
+    free(blocks);
+    return rc;
+}
+
+int vsfs_unlink(vsfs_t* fs, uint64_t dir_ino, const char* name) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return -EINVAL;
+    uint64_t ino;
+    inode_t inode;
+    int rc;
+    if ((rc = vsfs_dir_lookup(fs, dir_ino, name, &ino)) != 0) return rc;
+    if (ino == ROOT_INO) return -EBUSY;
+    if ((rc = vsfs_inode_read(fs, ino, &inode)) != 0) return rc;
+    int is_dir = (inode.mode & 0170000) == 0040000;
+    if (is_dir && inode.size_bytes > 2 * sizeof(dirent64_t)) return -ENOTEMPTY;
+
+    uint64_t t0 = vsfs_now_ns();
+    rc = release_storage(fs, &inode);
+    t0 = vsfs_stats_phase(&fs->stats, VSFS_PHASE_BITMAP, t0);
+    if (rc != 0) return rc;
+    if ((rc = dir_unlink(fs, dir_ino, name)) != 0) return rc;
+    t0 = vsfs_stats_phase(&fs->stats, VSFS_PHASE_DIRECTORY, t0);
+
+    inode_t empty = {0};
+    if ((rc = vsfs_inode_write(fs, ino, &empty)) != 0) return rc;
+    vsfs_bitmap_clear_range(&fs->inode_bitmap, ino - 1, 1);
+    vsfs_stats_phase(&fs->stats, VSFS_PHASE_INODE, t0);
+    /* Cached paths may run through the directory, and its inode number can now be reused. */
+    if (is_dir) dcache_clear(&fs->dcache);
+    if (fs->verbose) printf("Removed %s -> inode %lu\n", name, (unsigned long)ino);
+    return 0;
+}
+
+int vsfs_overwrite(vsfs_t* fs, uint64_t ino, const char* path) {
+    inode_t inode;
+    int rc;
+    if ((rc = vsfs_inode_read(fs, ino, &inode)) != 0) return rc;
+    if ((inode.mode & 0170000) != 0100000) return -EISDIR;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -errno;
+    struct stat st;
+    uint32_t* blocks = NULL;
+    uint64_t count = 0;
+    int allocated = 0;
+    if (fstat(fd, &st) != 0) {
+        rc = -errno;
+        goto out;
+    }
+    uint64_t size = (uint64_t)st.st_size;
+    count = (size + BS - 1) / BS;
+    if ((fs->pack_small && size > 0 && size <= VSFS_TAIL_MAX) || (fs->compress && count > 1) ||
+        (fs->dedup && count > 0)) {
+        rc = -EOPNOTSUPP;
+    } else if (count > vsfs_max_file_blocks(&fs->sb)) {
+        rc = -EFBIG;
+    } else if (!(blocks = malloc((count ? count : 1) * sizeof(uint32_t)))) {
+        rc = -ENOMEM;
+    }
+    if (rc != 0) goto out;
+
+    uint64_t t0 = vsfs_now_ns();
+    rc = vsfs_alloc_blocks(fs, count, blocks);
+    t0 = vsfs_stats_phase(&fs->stats, VSFS_PHASE_BITMAP, t0);
+    if (rc != 0) goto out;
+    allocated = 1;
+    rc = write_payload(fs, fd, blocks, 0, count, size);
+    t0 = vsfs_stats_phase(&fs->stats, VSFS_PHASE_PAYLOAD, t0);
+    if (rc != 0) goto out;
+
+    /* From here the new blocks belong to the inode; the old ones are freed at the commit. */
+    allocated = 0;
+    rc = release_storage(fs, &inode);
+    if (rc == 0) {
+        memset(inode.direct, 0, sizeof(inode.direct));
+        inode.reserved_0 = inode.reserved_1 = 0;
+        inode.reserved_2 &= ~(INODE_FLAG_INLINE | INODE_FLAG_TAIL | INODE_FLAG_COMPRESSED | 0xffu << INODE_CODEC_SHIFT);
+        inode.xattr_ptr = 0;
+        rc = vsfs_block_map_assign(fs, &inode, blocks, count);
+    }
+    t0 = vsfs_stats_phase(&fs->stats, VSFS_PHASE_BITMAP, t0);
+    if (rc == 0) {
+        inode.size_bytes = size;
+        inode.mtime = (uint64_t)st.st_mtime;
+        inode.ctime = time(NULL);
+        rc = vsfs_inode_write(fs, ino, &inode);
+        vsfs_stats_phase(&fs->stats, VSFS_PHASE_INODE, t0);
+    }
+    if (rc == 0 && fs->verbose) {
+        printf("Rewrote inode %lu into %lu new block(s)\n", (unsigned long)ino, (unsigned long)count);
+    }
+
+out:
+    for (uint64_t i = 0; allocated && i < count; i++) {
+        vsfs_bitmap_clear_range(&fs->data_bitmap, blocks[i] - fs->sb.data_region_start, 1);
+    }
+    free(blocks);
+    close(fd);
+    return rc;
+}
+
+/* Bytes moved from in_fd at 'off' to the current position of out_fd by sendfile(). */
+static uint64_t send_range(int in_fd, uint64_t off, int out_fd, uint64_t len) {
+    off_t pos = (off_t)off;
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = sendfile(out_fd, in_fd, &pos, len - done);
+        if (n <= 0) break;
+        done += (uint64_t)n;
+    }
+    return done;
+}
+
+/*
+ * Stream the first 'size' bytes mapped by 'blocks' to the current position of
+ * out_fd: one copy_file_range() per run of consecutive blocks, then sendfile()
+ * for outputs it cannot reach (pipes, other filesystems), then pread/write.
+ * Only fs->fd is used, with explicit offsets, so several threads may copy
+ * different files of one image at once.
+ */
+int vsfs_copy_out(vsfs_t* fs, const uint32_t* blocks, uint64_t size, int out_fd) {
+    uint64_t count = (size + BS - 1) / BS;
+    int method = 0;
+
+    for (uint64_t i = 0; i < count; ) {
+        uint64_t run = vsfs_block_run_length(blocks, i, count);
+        uint64_t src_off = blocks[i] * (uint64_t)BS;
+        uint64_t len = run * (uint64_t)BS;
+        if (i * (uint64_t)BS + len > size) len = size - i * (uint64_t)BS;
+
+        uint64_t done = 0;
+        if (method == 0) {
+            loff_t in = (loff_t)src_off;
+            while (done < len) {
+                ssize_t n = copy_file_range(fs->fd, &in, out_fd, NULL, len - done, 0);
+                if (n <= 0) break;
+                done += (uint64_t)n;
+            }
+            if (done < len) method = 1;
+        }
+        if (method == 1 && done < len) {
+            done += send_range(fs->fd, src_off + done, out_fd, len - done);
+            if (done < len) method = 2;
+        }
+        if (done) vsfs_stats_io(&fs->stats, 0, src_off, done);
+        while (done < len) {
+            uint8_t buffer[64 * 1024];
+            uint64_t want = len - done < sizeof(buffer) ? len - done : sizeof(buffer);
+            ssize_t r = image_pread(fs, buffer, want, src_off + done);
+            if (r <= 0) return -EIO;
+            for (ssize_t w = 0; w < r; ) {
+                ssize_t n = write(out_fd, buffer + w, (size_t)(r - w));
+                if (n <= 0) return -EIO;
+                w += n;
+            }
+            done += (uint64_t)r;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/*
+ * Decode a compressed file frame by frame into out_fd. The stream is read in
+ * chunks of several frames; a frame cut off at the end of a chunk is moved to
+ * the front of the buffer before the next read.
+ */
+int vsfs_copy_out_compressed(vsfs_t* fs, const inode_t* ino, const uint32_t* blocks, int out_fd) {
+    enum { CHUNK = 4 * (VSFS_FRAME_SIZE + 4) };
+    unsigned codec = vsfs_inode_codec(ino);
+    if (!vsfs_codec_available(codec)) return -EOPNOTSUPP;
+    uint64_t count = vsfs_file_blocks(ino);
+    uint8_t* in = malloc(CHUNK);
+    uint8_t* out = malloc(VSFS_FRAME_SIZE);
+    int rc = in && out ? 0 : -ENOMEM;
+
+    uint64_t pos = 0, have = 0, used = 0;
+    for (uint64_t off = 0; off < ino->size_bytes && rc == 0; ) {
+        uint64_t n = ino->size_bytes - off < VSFS_FRAME_SIZE ? ino->size_bytes - off : VSFS_FRAME_SIZE;
+        uint64_t len = have - used >= 4 ? vsfs_frame_length(in + used) : 0;
+        if (len == 0 || have - used < len) {
+            memmove(in, in + used, have - used);
+            have -= used;
+            used = 0;
+            uint64_t want = CHUNK - have < ino->xattr_ptr - pos ? CHUNK - have : ino->xattr_ptr - pos;
+            if ((rc = stream_read(fs, blocks, count, pos, want, in + have)) != 0) break;
+            pos += want;
+            have += want;
+            if (have < 4 || (len = vsfs_frame_length(in)) > have) {
+                rc = -EIO;
+                break;
+            }
+        }
+        if ((rc = vsfs_frame_decode(codec, in + used, len, out, n)) != 0) break;
+        for (uint64_t w = 0; w < n && rc == 0; ) {
+            ssize_t k = write(out_fd, out + w, n - w);
+            if (k <= 0) rc = -EIO;
+            else w += (uint64_t)k;
+        }
+        used += len;
+        off += n;
+    }
+    if (rc == 0 && (used != have || pos != ino->xattr_ptr)) rc = -EIO;
+    free(in);
+    free(out);
+    return rc;
+}
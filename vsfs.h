@@ -0,0 +1,464 @@
+#ifndef VSFS_H
+#define VSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vsfs_codec.h"
+#include "vsfs_crc32.h"
+#include "vsfs_ioq.h"
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define VSFS_MAGIC 0x4D565346u
+#define VSFS_VERSION 2u
+#define PTRS_PER_BLOCK (BS / sizeof(uint32_t))
+#define DIRENTS_PER_BLOCK (BS / sizeof(dirent64_t))
+
+#define INODE_FLAG_HASHED_DIR 0x1u
+#define INODE_FLAG_INLINE 0x2u        /* file data stored in direct[] .. reserved_1 */
+#define INODE_FLAG_TAIL 0x4u          /* file data at byte direct[1] of the shared tail block direct[0] */
+#define INODE_FLAG_COMPRESSED 0x8u    /* data blocks hold xattr_ptr bytes of compressed frames */
+#define INODE_CODEC_SHIFT 8           /* VSFS_CODEC_* of a compressed file, bits 8..15 */
+#define INODE_DIR_DEPTH_SHIFT 24
+#define VSFS_NAME_MAX 57u
+
+#define DIRENT_FILE 1u
+#define DIRENT_DIR 2u
+#define MAX_DIR_DEPTH 20u
+
+#define FEATURE_HASHED_DIR 0x1u
+#define FEATURE_JOURNAL 0x2u
+#define FEATURE_PACKED_FILES 0x4u
+#define FEATURE_DEDUP 0x8u            /* file data blocks may be shared between files */
+#define FEATURE_COMPRESSED 0x10u
+#define SUPPORTED_FEATURES (FEATURE_HASHED_DIR | FEATURE_JOURNAL | FEATURE_PACKED_FILES | FEATURE_DEDUP | \
+                            FEATURE_COMPRESSED)
+
+#define VSFS_INLINE_MAX 56u
+#define VSFS_TAIL_MAX (BS / 4)
+
+#define VSFS_FRAME_SIZE (16 * BS)
+#define VSFS_FRAME_STORED 0x80000000u
+
+#define VSFS_JOURNAL_MAGIC 0x4A534656u
+#define JOURNAL_DESCRIPTOR 1u
+#define JOURNAL_COMMIT 2u
+#define MIN_JOURNAL_BLOCKS 16u      /* smallest journal an image may have; mkfs_builder plans a larger one */
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;               /* FEATURE_* bits */
+    uint32_t checksum;
+    uint64_t journal_start;       /* FEATURE_JOURNAL: between the inode table and the data region */
+    uint64_t journal_blocks;
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 132, "superblock must fit in one block");
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t direct[12];
+    uint32_t reserved_0;          /* v2: single indirect block */
+    uint32_t reserved_1;          /* v2: double indirect block */
+    uint32_t reserved_2;          /* v2: INODE_FLAG_* and hashed directory depth */
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t type;
+    char name[58];
+    uint8_t checksum;
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+/*
+ * The journal is split into two halves used alternately, so committing a
+ * transaction never overwrites the previous one. A transaction is a
+ * descriptor (this header followed by the home block number of every logged
+ * block, spilling into as many blocks as needed), the logged blocks, and a
+ * commit block carrying the same header plus a CRC of everything before it.
+ */
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+    uint64_t nblocks;
+    uint32_t crc;                 /* commit block only */
+    uint32_t pad;
+} journal_header_t;
+#pragma pack(pop)
+_Static_assert(sizeof(journal_header_t) == 32, "journal header size mismatch");
+
+/* A committed transaction found in a journal half; pointers refer into the scanned buffer. */
+typedef struct {
+    uint64_t sequence;
+    uint64_t nblocks;
+    const uint8_t* targets;       /* nblocks little-endian uint64_t home block numbers */
+    const uint8_t* data;          /* nblocks logged blocks */
+} journal_txn_t;
+
+uint64_t vsfs_journal_desc_blocks(uint64_t nblocks);
+uint64_t vsfs_journal_txn_capacity(const superblock_t* sb);
+int vsfs_journal_parse(const uint8_t* half, uint64_t half_blocks, journal_txn_t* txn);
+/*
+ * For a whole image mapped in memory: 1 if the newest committed transaction
+ * has not been replayed (*txn then points into the mapping), 0 if there is
+ * none or it has, -EIO if it targets a block outside the image.
+ */
+int vsfs_journal_pending(const uint8_t* image, const superblock_t* sb, journal_txn_t* txn);
+/* Copy a transaction over its home blocks in a writable (for example MAP_PRIVATE) mapping. */
+void vsfs_journal_apply(uint8_t* image, const journal_txn_t* txn);
+
+/*
+ * A delta (mkfs_diff / mkfs_patch) turns one image into another of the same
+ * layout: this header, then one record per changed block in ascending block
+ * order, each followed by the block's new contents unless DELTA_ZERO is set.
+ */
+#define VSFS_DELTA_MAGIC 0x44534656u
+#define VSFS_DELTA_VERSION 1u
+#define DELTA_ZERO 0x1u               /* the new contents are all zero and not stored */
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t flags;
+    uint64_t total_blocks;        /* of both images */
+    uint64_t nrecords;
+    uint32_t crc;                 /* of this header with crc = 0 */
+    uint32_t pad;
+} delta_header_t;
+
+typedef struct {
+    uint64_t block;
+    uint32_t base_crc;            /* CRC32 of the block in the image the delta applies to */
+    uint32_t crc;                 /* CRC32 of the new contents */
+    uint32_t flags;
+    uint32_t pad;
+} delta_record_t;
+#pragma pack(pop)
+_Static_assert(sizeof(delta_header_t) == 40, "delta header size mismatch");
+_Static_assert(sizeof(delta_record_t) == 24, "delta record size mismatch");
+
+/* sb must point at the start of a full, zero-padded BS-byte superblock block. */
+uint32_t superblock_crc_finalize(superblock_t *sb);
+void inode_crc_finalize(inode_t* ino);
+void dirent_checksum_finalize(dirent64_t* de);
+
+/* In-memory bitmap; bits past nbits read as allocated. */
+typedef struct {
+    uint8_t* bits;
+    uint64_t nbits;
+    uint64_t hint;
+    int dirty;
+    uint64_t dirty_lo;
+    uint64_t dirty_hi;
+} vsfs_bitmap_t;
+
+uint64_t vsfs_bitmap_scan(const vsfs_bitmap_t* bm, uint64_t from, int set);
+void vsfs_bitmap_set_range(vsfs_bitmap_t* bm, uint64_t start, uint64_t count);
+void vsfs_bitmap_clear_range(vsfs_bitmap_t* bm, uint64_t start, uint64_t count);
+uint64_t vsfs_bitmap_alloc_extent(vsfs_bitmap_t* bm, uint64_t want, uint64_t* start);
+int vsfs_bitmap_alloc_contiguous(vsfs_bitmap_t* bm, uint64_t count, uint64_t* start);
+
+typedef struct vsfs_cache_entry {
+    uint64_t block;
+    int dirty;
+    struct vsfs_cache_entry* prev;
+    struct vsfs_cache_entry* next;
+    struct vsfs_cache_entry* hash_next;
+    uint8_t data[BS];
+} vsfs_cache_entry_t;
+
+/*
+ * Write-back cache of metadata blocks. Clean blocks sit on an LRU list and
+ * are evicted once the cache holds 'capacity' blocks; dirty blocks move to a
+ * separate dirty list and are never evicted, so nothing reaches the image
+ * before vsfs_flush().
+ */
+typedef struct {
+    vsfs_cache_entry_t** buckets;
+    uint64_t nbuckets;
+    vsfs_cache_entry_t lru;
+    vsfs_cache_entry_t dirty;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t ndirty;
+    uint64_t hits;
+    uint64_t misses;
+} vsfs_cache_t;
+
+/* Open-addressed uint32 -> uint32 multimap; a slot with value 0 is empty. */
+typedef struct {
+    struct {
+        uint32_t key;
+        uint32_t value;
+    }* slots;
+    uint64_t mask;
+    uint64_t count;
+} vsfs_u32map_t;
+
+/*
+ * Cache of directory entries that name directories, keyed by (parent inode,
+ * name), so resolving a path reads each directory at most once per session.
+ * A slot with ino 0 is empty.
+ */
+typedef struct {
+    struct vsfs_dentry {
+        uint32_t parent;
+        uint32_t ino;
+        char name[58];
+    }* slots;
+    uint64_t mask;
+    uint64_t count;
+    uint64_t hits;
+    uint64_t misses;
+} vsfs_dcache_t;
+
+/*
+ * Where a tool spends its time, and how much image I/O it does. Phases are
+ * timed at the call sites that start them, so a phase run on several threads
+ * at once (payload copies) adds up the time of every thread. A seek is an
+ * access that does not continue where the previous one ended.
+ */
+typedef enum {
+    VSFS_PHASE_CLONE,
+    VSFS_PHASE_SUPERBLOCK,
+    VSFS_PHASE_BITMAP,
+    VSFS_PHASE_INODE,
+    VSFS_PHASE_PAYLOAD,
+    VSFS_PHASE_DIRECTORY,
+    VSFS_PHASE_FLUSH,
+    VSFS_PHASE_COUNT
+} vsfs_phase_t;
+
+typedef struct {
+    uint64_t phase_ns[VSFS_PHASE_COUNT];
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t seeks;
+    uint64_t syncs;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t next_offset;         /* where a sequential access would continue */
+} vsfs_stats_t;
+
+uint64_t vsfs_now_ns(void);
+/* Charge the time since start_ns to phase; returns now, to start the next phase from. */
+uint64_t vsfs_stats_phase(vsfs_stats_t* st, vsfs_phase_t phase, uint64_t start_ns);
+void vsfs_stats_io(vsfs_stats_t* st, int write, uint64_t offset, uint64_t len);
+/* Print the counters as text, or as one JSON object on a line of its own. */
+void vsfs_stats_print(const vsfs_stats_t* st, const char* tool, uint64_t total_ns, int json);
+
+#define VSFS_OPEN_RDONLY 0
+#define VSFS_OPEN_RDWR 1
+#define VSFS_DEFAULT_CACHE_BLOCKS 1024u
+
+typedef struct {
+    int fd;
+    int writable;
+    int verbose;
+    superblock_t sb;
+    int sb_dirty;
+    vsfs_bitmap_t inode_bitmap;
+    vsfs_bitmap_t data_bitmap;
+    vsfs_cache_t cache;
+    uint32_t* pending_free;
+    uint64_t pending_free_count;
+    uint64_t journal_seq;         /* sequence number of the next transaction */
+    uint64_t journal_half;        /* half of the journal it goes to */
+    int pack_small;               /* store small files inline or in tail blocks */
+    uint64_t tail_block;          /* tail block being filled this session, 0 if none */
+    uint64_t tail_used;
+    int dedup;                    /* set by vsfs_dedup_load() */
+    int dedup_loaded;             /* dedup_refs covers every file in the image */
+    vsfs_u32map_t dedup_index;    /* CRC32 of block contents -> data block */
+    vsfs_u32map_t dedup_refs;     /* data block -> number of files mapping it, once shared */
+    int tail_refs_loaded;
+    vsfs_u32map_t tail_refs;      /* tail block -> files packed into it + 1, once a packed file is removed */
+    unsigned compress;            /* VSFS_CODEC_* for new files, VSFS_CODEC_NONE to store them as is */
+    vsfs_dcache_t dcache;
+    uint8_t* overlay_buf;         /* read-only open: unreplayed transaction, NULL if none */
+    journal_txn_t overlay;
+    vsfs_u32map_t overlay_index;  /* home block -> logged block + 1 */
+    vsfs_ioq_t ioq;               /* journal, replay and home writes of a flush */
+    vsfs_stats_t stats;
+} vsfs_t;
+
+/*
+ * All functions returning int return 0 on success and a negative errno value
+ * on failure. Changes are buffered in memory until vsfs_flush(); closing
+ * without flushing discards them. On images with FEATURE_JOURNAL each flush
+ * is one journal transaction, and opening read-write first replays the newest
+ * committed transaction; opening read-only reads through it instead without
+ * writing anything (overlay_buf is then set). vsfs_open() returns -EINVAL
+ * for a bad magic number and -EUCLEAN when the superblock describes a journal
+ * or bitmaps that do not fit the layout.
+ */
+int vsfs_open(vsfs_t* fs, const char* path, int mode);
+int vsfs_flush(vsfs_t* fs);
+int vsfs_close(vsfs_t* fs);
+uint64_t vsfs_dirty_blocks(const vsfs_t* fs);
+
+/* Copy an image file, preferring a reflink clone so unchanged blocks are shared. */
+int vsfs_clone_image(const char* input_name, const char* output_name);
+
+uint8_t* vsfs_block_read(vsfs_t* fs, uint64_t block);
+uint8_t* vsfs_block_zero(vsfs_t* fs, uint64_t block);
+int vsfs_block_mark_dirty(vsfs_t* fs, uint64_t block);
+
+int vsfs_inode_read(vsfs_t* fs, uint64_t ino, inode_t* out);
+int vsfs_inode_write(vsfs_t* fs, uint64_t ino, inode_t* in);
+
+int vsfs_alloc_inode(vsfs_t* fs, uint64_t* ino_out);
+int vsfs_alloc_blocks(vsfs_t* fs, uint64_t count, uint32_t* blocks);
+int vsfs_free_block_deferred(vsfs_t* fs, uint32_t block);
+
+uint64_t vsfs_max_file_blocks(const superblock_t* sb);
+/* Number of single/double indirect blocks needed to map 'count' data blocks. */
+uint64_t vsfs_index_blocks(uint64_t count);
+int vsfs_block_map_read(vsfs_t* fs, const inode_t* ino, uint64_t count, uint32_t* out);
+int vsfs_block_map_assign(vsfs_t* fs, inode_t* ino, const uint32_t* blocks, uint64_t count);
+int vsfs_block_map_release(vsfs_t* fs, inode_t* ino, uint64_t count);
+
+/*
+ * Small files (with pack_small set) skip the block map: up to VSFS_INLINE_MAX
+ * bytes live in the inode itself, up to VSFS_TAIL_MAX bytes are packed back to
+ * back into a shared tail block. Neither owns a data block of its own.
+ */
+int vsfs_inode_packed(const inode_t* ino);
+int vsfs_packed_read(vsfs_t* fs, const inode_t* ino, uint8_t* out);
+
+/*
+ * A compressed file (with fs->compress set) maps only the blocks its stream
+ * needs: xattr_ptr bytes of frames, one per VSFS_FRAME_SIZE bytes of file
+ * data. A frame is a 32-bit little-endian length, with VSFS_FRAME_STORED set
+ * when the data did not shrink and is kept as is, followed by that many
+ * bytes. Frames decode independently, so a reader can start at any of them.
+ * Files that would not save a whole block are stored uncompressed.
+ */
+unsigned vsfs_inode_codec(const inode_t* ino);
+uint64_t vsfs_file_blocks(const inode_t* ino);
+/* Length of the run of consecutive block numbers starting at blocks[i], at most count - i. */
+uint64_t vsfs_block_run_length(const uint32_t* blocks, uint64_t i, uint64_t count);
+uint64_t vsfs_frame_length(const uint8_t* header);
+int vsfs_frame_decode(unsigned codec, const uint8_t* frame, uint64_t len, uint8_t* out, uint64_t out_len);
+
+uint32_t vsfs_dir_hash(const char* name);
+uint64_t vsfs_dir_blocks(const inode_t* dir);
+int vsfs_dir_lookup(vsfs_t* fs, uint64_t dir_ino, const char* name, uint64_t* ino_out);
+int vsfs_dir_insert(vsfs_t* fs, uint64_t dir_ino, const char* name, uint64_t ino, uint8_t type);
+int vsfs_dir_list(vsfs_t* fs, uint64_t dir_ino, dirent64_t** out, uint64_t* count);
+
+/* Create an empty directory 'name' in parent, with "." and ".." and one block of entries. */
+int vsfs_mkdir(vsfs_t* fs, uint64_t parent, const char* name, uint64_t* ino_out);
+/*
+ * Resolve a '/'-separated path of directories below dir_ino; an empty path is
+ * dir_ino itself. With 'create' set, missing components are made like mkdir
+ * -p. A component that names a file is -ENOTDIR.
+ */
+int vsfs_path_lookup(vsfs_t* fs, uint64_t dir_ino, const char* path, int create, uint64_t* ino_out);
+
+/* Copy the host file 'path' into a new inode linked into dir_ino as 'name'. */
+int vsfs_add_file(vsfs_t* fs, uint64_t dir_ino, const char* path, const char* name, uint64_t* ino_out);
+
+/*
+ * Content-addressed deduplication of file data blocks. The index and the
+ * reference counts are not stored in the image; vsfs_dedup_load() rebuilds
+ * them from the block maps and data of every file. While it is enabled,
+ * vsfs_add_prepare() points direct[] at an existing block whose contents
+ * match instead of allocating a new one. A data block stays allocated until
+ * vsfs_block_unref() drops its last reference.
+ */
+int vsfs_dedup_load(vsfs_t* fs);
+uint32_t vsfs_block_refs(const vsfs_t* fs, uint32_t block);
+int vsfs_block_unref(vsfs_t* fs, uint32_t block);
+
+/*
+ * vsfs_add_file() in three steps, so a batch can reserve space for every file
+ * first, copy the payloads on several threads, then link them one by one.
+ * vsfs_add_abort() must be called on every prepared file, linked or not.
+ */
+typedef struct {
+    int src_fd;
+    char name[58];
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t nblocks;
+    uint32_t* blocks;
+    uint8_t* packed;              /* payload of a packed file, read by vsfs_add_copy() */
+    uint32_t* crcs;               /* with dedup: CRC32 of each zero-padded block */
+    uint8_t* shared;              /* with dedup: blocks[i] already existed */
+    uint64_t nshared;
+    uint8_t* stream;              /* with compression: the frames written to blocks[] */
+    uint64_t stream_size;
+    unsigned codec;
+    int linked;
+} vsfs_new_file_t;
+
+int vsfs_add_prepare(vsfs_t* fs, uint64_t dir_ino, const char* path, const char* name, vsfs_new_file_t* nf);
+int vsfs_add_copy(vsfs_t* fs, vsfs_new_file_t* nf);
+int vsfs_add_commit(vsfs_t* fs, uint64_t dir_ino, vsfs_new_file_t* nf);
+void vsfs_add_abort(vsfs_t* fs, vsfs_new_file_t* nf);
+
+/*
+ * Remove 'name' from dir_ino and free its inode. A file's data, tail and
+ * index blocks are released, shared blocks only losing a reference; a
+ * directory must be empty. Freed blocks return to the bitmap at the next
+ * vsfs_flush(), so nothing the image still uses is reallocated before then.
+ */
+int vsfs_unlink(vsfs_t* fs, uint64_t dir_ino, const char* name);
+
+/*
+ * Replace the contents of the regular file 'ino' with the host file 'path',
+ * keeping its inode and directory entry. The data goes to freshly allocated
+ * blocks and the inode is switched to them in the same transaction that
+ * frees the old ones, so a crash before the commit leaves the old file
+ * intact. -EOPNOTSUPP if the new contents would be packed, compressed or
+ * deduplicated; callers then fall back to vsfs_unlink() and a fresh add.
+ */
+int vsfs_overwrite(vsfs_t* fs, uint64_t ino, const char* path);
+
+/* Write a file's contents to out_fd given its resolved block map; safe to call from several threads. */
+int vsfs_copy_out(vsfs_t* fs, const uint32_t* blocks, uint64_t size, int out_fd);
+/* The same for a compressed file, decoding one frame at a time. */
+int vsfs_copy_out_compressed(vsfs_t* fs, const inode_t* ino, const uint32_t* blocks, int out_fd);
+
+#endif
@@ -0,0 +1,171 @@
+#include "vsfs_codec.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef VSFS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * The built-in codec is a byte-oriented LZ77 in the style of LZ4's block
+ * format: each sequence is a token (literal count in the high nibble, match
+ * length - 4 in the low one, 15 meaning "more length bytes follow"), the
+ * literals, then a 16-bit little-endian offset and the extra match length.
+ * The last sequence carries literals only, so the input ends right after them.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* lz_put_length(uint8_t* op, const uint8_t* oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Emit one sequence; mlen == 0 marks the final literals-only one. NULL if dst is full. */
+static uint8_t* lz_sequence(uint8_t* op, const uint8_t* oend, const uint8_t* lit, size_t nlit, size_t offset, size_t mlen) {
+    if (op >= oend) return NULL;
+    uint8_t* token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15 && !(op = lz_put_length(op, oend, nlit - 15))) return NULL;
+    if (nlit > (size_t)(oend - op)) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15 && !(op = lz_put_length(op, oend, mlen - 15))) return NULL;
+    return op;
+}
+
+static size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    uint32_t table[1u << LZ_HASH_BITS];   /* position + 1 of the last 4-byte string with each hash */
+    memset(table, 0, sizeof(table));
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* iend = src + n;
+    uint8_t* op = dst;
+    const uint8_t* oend = dst + cap;
+
+    while (iend - ip >= LZ_MIN_MATCH) {
+        uint32_t h = lz_hash(ip);
+        uint32_t cand = table[h];
+        table[h] = (uint32_t)(ip - src) + 1;
+        const uint8_t* ref = cand ? src + (cand - 1) : NULL;
+        if (!ref || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < iend && ref[mlen] == ip[mlen]) mlen++;
+        if (!(op = lz_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), mlen))) return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!(op = lz_sequence(op, oend, anchor, (size_t)(iend - anchor), 0, 0))) return 0;
+    return (size_t)(op - dst);
+}
+
+static int lz_get_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+static int lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t out_len) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + n;
+    size_t op = 0;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz_get_length(&ip, iend, &nlit) != 0) return -EIO;
+        if (nlit > (size_t)(iend - ip) || nlit > out_len - op) return -EIO;
+        memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -EIO;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz_get_length(&ip, iend, &mlen) != 0) return -EIO;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || mlen > out_len - op) return -EIO;
+        /* Copy at most 'offset' bytes at a time so source and destination never overlap. */
+        while (mlen) {
+            size_t step = mlen < offset ? mlen : offset;
+            memcpy(dst + op, dst + op - offset, step);
+            op += step;
+            mlen -= step;
+        }
+    }
+    return op == out_len ? 0 : -EIO;
+}
+
+int vsfs_codec_available(unsigned codec) {
+#ifdef VSFS_HAVE_ZLIB
+    if (codec == VSFS_CODEC_DEFLATE) return 1;
+#endif
+    return codec == VSFS_CODEC_LZ;
+}
+
+const char* vsfs_codec_name(unsigned codec) {
+    switch (codec) {
+    case VSFS_CODEC_NONE: return "none";
+    case VSFS_CODEC_LZ: return "lz";
+    case VSFS_CODEC_DEFLATE: return "deflate";
+    default: return "unknown";
+    }
+}
+
+int vsfs_codec_parse(const char* name) {
+    if (strcmp(name, "lz") == 0) return VSFS_CODEC_LZ;
+    if (strcmp(name, "deflate") == 0) return VSFS_CODEC_DEFLATE;
+    return -1;
+}
+
+size_t vsfs_compress(unsigned codec, const uint8_t* src, size_t n, uint8_t* dst, size_t cap) {
+    if (codec == VSFS_CODEC_LZ) return lz_compress(src, n, dst, cap);
+#ifdef VSFS_HAVE_ZLIB
+    if (codec == VSFS_CODEC_DEFLATE) {
+        uLongf len = cap;
+        return compress2(dst, &len, src, n, Z_DEFAULT_COMPRESSION) == Z_OK ? len : 0;
+    }
+#endif
+    return 0;
+}
+
+int vsfs_decompress(unsigned codec, const uint8_t* src, size_t n, uint8_t* dst, size_t out_len) {
+    if (codec == VSFS_CODEC_LZ) return lz_decompress(src, n, dst, out_len);
+#ifdef VSFS_HAVE_ZLIB
+    if (codec == VSFS_CODEC_DEFLATE) {
+        uLongf len = out_len;
+        uLong consumed = n;
+        if (uncompress2(dst, &len, src, &consumed) != Z_OK || len != out_len || consumed != n) return -EIO;
+        return 0;
+    }
+#endif
+    return -EOPNOTSUPP;
+}
@@ -0,0 +1,26 @@
+#ifndef VSFS_CODEC_H
+#define VSFS_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Block compressors for compressed files. VSFS_CODEC_LZ is built in and
+ * always available; VSFS_CODEC_DEFLATE uses zlib and is only compiled in
+ * when the library is built with VSFS_HAVE_ZLIB.
+ */
+#define VSFS_CODEC_NONE 0u
+#define VSFS_CODEC_LZ 1u
+#define VSFS_CODEC_DEFLATE 2u
+
+int vsfs_codec_available(unsigned codec);
+const char* vsfs_codec_name(unsigned codec);
+/* VSFS_CODEC_* for a name as accepted on the command line, or -1. */
+int vsfs_codec_parse(const char* name);
+
+/* Compress n bytes into dst; returns the compressed length, or 0 if it does not fit in cap bytes. */
+size_t vsfs_compress(unsigned codec, const uint8_t* src, size_t n, uint8_t* dst, size_t cap);
+/* Decompress exactly out_len bytes; anything else, including trailing input, is -EIO. */
+int vsfs_decompress(unsigned codec, const uint8_t* src, size_t n, uint8_t* dst, size_t out_len);
+
+#endif
@@ -0,0 +1,154 @@
+#include "vsfs_crc32.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_CLMUL 1
+#endif
+
+uint32_t CRC32_TAB[8][256];
+
+static uint32_t crc32_slice8(uint32_t c, const uint8_t* p, size_t n);
+static uint32_t (*crc32_impl)(uint32_t c, const uint8_t* p, size_t n) = crc32_slice8;
+
+static uint32_t crc32_tail(uint32_t c, const uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; i++) c = CRC32_TAB[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+static uint32_t crc32_slice8(uint32_t c, const uint8_t* p, size_t n) {
+    while (n && ((uintptr_t)p & 7)) {
+        c = CRC32_TAB[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+        n--;
+    }
+    while (n >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= c;
+        c = CRC32_TAB[7][lo & 0xFF] ^ CRC32_TAB[6][(lo >> 8) & 0xFF] ^
+            CRC32_TAB[5][(lo >> 16) & 0xFF] ^ CRC32_TAB[4][lo >> 24] ^
+            CRC32_TAB[3][hi & 0xFF] ^ CRC32_TAB[2][(hi >> 8) & 0xFF] ^
+            CRC32_TAB[1][(hi >> 16) & 0xFF] ^ CRC32_TAB[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    return crc32_tail(c, p, n);
+}
+
+#ifdef CRC32_HAVE_CLMUL
+/*
+ * Carry-less multiplication folding ("Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ", Intel 2009) with the bit-reflected
+ * constants for 0xEDB88320. Folds four 128-bit lanes while at least 64
+ * bytes remain, then one lane at a time, then Barrett-reduces to 32 bits.
+ * Anything that does not fill a 16-byte lane goes through the tables.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul(uint32_t c, const uint8_t* p, size_t n) {
+    if (n < 64) return crc32_slice8(c, p, n);
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124ll);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    p += 64;
+    n -= 64;
+
+    x0 = k1k2;
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p += 64;
+        n -= 64;
+    }
+
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        n -= 16;
+    }
+
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    c = (uint32_t)_mm_extract_epi32(x1, 1);
+    return crc32_tail(c, p, n);
+}
+#endif
+
+void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[0][i]=c;
+    }
+    for (uint32_t i=0;i<256;i++){
+        for (int t=1;t<8;t++) CRC32_TAB[t][i] = CRC32_TAB[0][CRC32_TAB[t-1][i] & 0xFF] ^ (CRC32_TAB[t-1][i] >> 8);
+    }
+    crc32_impl = crc32_slice8;
+#ifdef CRC32_HAVE_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) crc32_impl = crc32_clmul;
+#endif
+}
+
+uint32_t crc32(const void* data, size_t n){
+    return crc32_impl(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n){
+    return crc32_impl(crc ^ 0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_bytewise(const void* data, size_t n){
+    return crc32_tail(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
@@ -0,0 +1,22 @@
+#ifndef VSFS_CRC32_H
+#define VSFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32 (reflected polynomial 0xEDB88320, init and final xor 0xFFFFFFFF),
+ * bit-identical to zlib's crc32(). crc32_init() must run once before use;
+ * it builds the slicing-by-8 tables and picks the PCLMULQDQ folding path
+ * when the CPU supports it.
+ */
+void crc32_init(void);
+uint32_t crc32(const void* data, size_t n);
+
+/* Continue a CRC over more data, zlib-style: crc32_update(crc32(a), b) == crc32(a || b). */
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n);
+
+/* Byte-at-a-time reference implementation, kept for self-checks. */
+uint32_t crc32_bytewise(const void* data, size_t n);
+
+#endif
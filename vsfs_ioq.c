@@ -0,0 +1,265 @@
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include "vsfs_ioq.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef VSFS_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* A write that has been queued; the iovecs are the caller's, or 'one' for vsfs_ioq_write(). */
+struct vsfs_ioq_slot {
+    const struct iovec* iov;
+    int cnt;
+    struct iovec one;
+    uint64_t offset;
+    uint64_t len;
+};
+
+/*
+ * Write iov to offset, of which the first 'done' bytes are already written:
+ * one pwritev() for a fresh write, then one pwrite() per buffer to finish a
+ * short one.
+ */
+static int write_sync(int fd, const struct iovec* iov, int cnt, uint64_t offset, uint64_t len, uint64_t done) {
+    if (done == 0) {
+        ssize_t w = pwritev(fd, iov, cnt, (off_t)offset);
+        if (w < 0 && errno != EINTR) return -errno;
+        if (w > 0) done = (uint64_t)w;
+    }
+    uint64_t pos = 0;
+    for (int i = 0; i < cnt && done < len; i++) {
+        uint64_t end = pos + iov[i].iov_len;
+        while (done < end) {
+            ssize_t w = pwrite(fd, (const uint8_t*)iov[i].iov_base + (done - pos), end - done, (off_t)(offset + done));
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return w < 0 ? -errno : -EIO;
+            done += (uint64_t)w;
+        }
+        pos = end;
+    }
+    return 0;
+}
+
+static void record_error(vsfs_ioq_t* q, int rc) {
+    if (rc != 0 && q->error == 0) q->error = rc;
+}
+
+#ifdef VSFS_HAVE_URING
+
+static void ring_teardown(vsfs_ioq_t* q) {
+    if (q->sqes) munmap(q->sqes, q->sqes_len);
+    if (q->cq_ring && q->cq_ring != q->sq_ring) munmap(q->cq_ring, q->cq_ring_len);
+    if (q->sq_ring) munmap(q->sq_ring, q->sq_ring_len);
+    if (q->ring_fd >= 0) close(q->ring_fd);
+    free(q->slots);
+    free(q->free_slots);
+    int fd = q->fd;
+    memset(q, 0, sizeof(*q));
+    q->fd = fd;
+    q->ring_fd = -1;
+}
+
+/* Map the rings of a new io_uring; the caller tears it down on failure. */
+static int ring_setup(vsfs_ioq_t* q, unsigned depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0) return -errno;
+    q->ring_fd = fd;
+
+    q->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && q->cq_ring_len > q->sq_ring_len) q->sq_ring_len = q->cq_ring_len;
+    void* sq = mmap(NULL, q->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return -errno;
+    q->sq_ring = sq;
+    void* cq = sq;
+    if (!single) {
+        cq = mmap(NULL, q->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return -errno;
+    }
+    q->cq_ring = cq;
+    q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return -errno;
+    q->sqes = sqes;
+
+    q->sq_tail = (unsigned*)((uint8_t*)sq + p.sq_off.tail);
+    q->sq_mask = (unsigned*)((uint8_t*)sq + p.sq_off.ring_mask);
+    q->sq_array = (unsigned*)((uint8_t*)sq + p.sq_off.array);
+    q->cq_head = (unsigned*)((uint8_t*)cq + p.cq_off.head);
+    q->cq_tail = (unsigned*)((uint8_t*)cq + p.cq_off.tail);
+    q->cq_mask = (unsigned*)((uint8_t*)cq + p.cq_off.ring_mask);
+    q->cqes = (uint8_t*)cq + p.cq_off.cqes;
+
+    /* The completion ring has at least as many entries, so with one slot per
+     * submission entry it can never overflow. */
+    q->depth = p.sq_entries;
+    q->slots = calloc(q->depth, sizeof(*q->slots));
+    q->free_slots = malloc(q->depth * sizeof(unsigned));
+    if (!q->slots || !q->free_slots) return -ENOMEM;
+    for (unsigned i = 0; i < q->depth; i++) q->free_slots[i] = q->depth - 1 - i;
+    q->nfree = q->depth;
+    return 0;
+}
+
+static int ring_enter(vsfs_ioq_t* q, unsigned submit, unsigned min_complete) {
+    for (;;) {
+        q->submits++;
+        long r = syscall(__NR_io_uring_enter, q->ring_fd, submit, min_complete,
+                         min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (r >= 0) return (int)r;
+        if (errno != EINTR && errno != EAGAIN) return -errno;
+    }
+}
+
+/* Retire every completion in the ring; a short write is finished synchronously. */
+static void ring_reap(vsfs_ioq_t* q) {
+    unsigned head = *q->cq_head;
+    unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe* cqe = (const struct io_uring_cqe*)q->cqes + (head & *q->cq_mask);
+        unsigned idx = (unsigned)cqe->user_data;
+        const vsfs_ioq_slot_t* s = &q->slots[idx];
+        if (cqe->res < 0) {
+            record_error(q, cqe->res);
+        } else if ((uint64_t)cqe->res < s->len) {
+            record_error(q, write_sync(q->fd, s->iov, s->cnt, s->offset, s->len, (uint64_t)cqe->res));
+        }
+        q->free_slots[q->nfree++] = idx;
+        q->inflight--;
+    }
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Submit everything queued, wait until at least min_complete writes have completed, then reap. */
+static int ring_submit(vsfs_ioq_t* q, unsigned min_complete) {
+    do {
+        int r = ring_enter(q, q->queued, min_complete);
+        if (r < 0) return r;
+        q->queued -= (unsigned)r;
+        q->inflight += (unsigned)r;
+    } while (q->queued);
+    ring_reap(q);
+    return 0;
+}
+
+static int ring_queue(vsfs_ioq_t* q, const struct iovec* iov, int cnt, uint64_t offset, uint64_t len,
+                      const void* buf) {
+    if (q->nfree == 0) {
+        int rc = ring_submit(q, 1);
+        if (rc != 0) return rc;
+    }
+    unsigned idx = q->free_slots[--q->nfree];
+    vsfs_ioq_slot_t* s = &q->slots[idx];
+    if (buf) {
+        s->one.iov_base = (void*)buf;
+        s->one.iov_len = len;
+        iov = &s->one;
+        cnt = 1;
+    }
+    s->iov = iov;
+    s->cnt = cnt;
+    s->offset = offset;
+    s->len = len;
+
+    unsigned tail = *q->sq_tail;
+    unsigned i = tail & *q->sq_mask;
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)q->sqes + i;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = q->fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = (uint32_t)cnt;
+    sqe->user_data = idx;
+    q->sq_array[i] = i;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    q->queued++;
+    return 0;
+}
+
+#endif
+
+void vsfs_ioq_init(vsfs_ioq_t* q, int fd, unsigned depth) {
+    memset(q, 0, sizeof(*q));
+    q->fd = fd;
+    q->ring_fd = -1;
+#ifdef VSFS_HAVE_URING
+    const char* mode = getenv("VSFS_IO");
+    if (depth == 0 || (mode && strcmp(mode, "sync") == 0)) return;
+    if (ring_setup(q, depth) != 0) ring_teardown(q);
+#else
+    (void)depth;
+#endif
+}
+
+void vsfs_ioq_destroy(vsfs_ioq_t* q) {
+#ifdef VSFS_HAVE_URING
+    if (q->ring_fd >= 0) {
+        vsfs_ioq_wait(q);
+        ring_teardown(q);
+    }
+#else
+    (void)q;
+#endif
+}
+
+const char* vsfs_ioq_backend(const vsfs_ioq_t* q) {
+    return q->ring_fd >= 0 ? "io_uring" : "pwritev";
+}
+
+int vsfs_ioq_writev(vsfs_ioq_t* q, const struct iovec* iov, int cnt, uint64_t offset) {
+    uint64_t len = 0;
+    for (int i = 0; i < cnt; i++) len += iov[i].iov_len;
+#ifdef VSFS_HAVE_URING
+    if (q->ring_fd >= 0) return ring_queue(q, iov, cnt, offset, len, NULL);
+#endif
+    int rc = write_sync(q->fd, iov, cnt, offset, len, 0);
+    record_error(q, rc);
+    return rc;
+}
+
+int vsfs_ioq_write(vsfs_ioq_t* q, const void* buf, uint64_t len, uint64_t offset) {
+#ifdef VSFS_HAVE_URING
+    if (q->ring_fd >= 0) return ring_queue(q, NULL, 0, offset, len, buf);
+#endif
+    struct iovec one = { .iov_base = (void*)buf, .iov_len = len };
+    int rc = write_sync(q->fd, &one, 1, offset, len, 0);
+    record_error(q, rc);
+    return rc;
+}
+
+int vsfs_ioq_submit(vsfs_ioq_t* q) {
+#ifdef VSFS_HAVE_URING
+    if (q->ring_fd >= 0 && q->queued) {
+        int rc = ring_submit(q, 0);
+        record_error(q, rc);
+        return rc;
+    }
+#else
+    (void)q;
+#endif
+    return 0;
+}
+
+int vsfs_ioq_wait(vsfs_ioq_t* q) {
+#ifdef VSFS_HAVE_URING
+    if (q->ring_fd >= 0) {
+        int rc = q->queued ? ring_submit(q, 0) : 0;
+        while (rc == 0 && q->inflight) rc = ring_submit(q, q->inflight);
+        record_error(q, rc);
+    }
+#endif
+    int rc = q->error;
+    q->error = 0;
+    return rc;
+}
@@ -0,0 +1,62 @@
+#ifndef VSFS_IOQ_H
+#define VSFS_IOQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Batched positional writes to one file descriptor. When the library is
+ * built with VSFS_HAVE_URING and the kernel allows it, queued writes go to an
+ * io_uring and are handed to the kernel together by vsfs_ioq_submit() or
+ * vsfs_ioq_wait(); otherwise, or with VSFS_IO=sync in the environment, each
+ * one is a pwritev() made as it is queued. Either way the buffers and iovecs
+ * must stay untouched until vsfs_ioq_wait() returns, and a short write is
+ * finished before the write counts as done. Not thread-safe.
+ */
+#define VSFS_IOQ_DEPTH 64u
+
+typedef struct vsfs_ioq_slot vsfs_ioq_slot_t;
+
+typedef struct {
+    int fd;
+    int ring_fd;                  /* -1: synchronous pwritev() */
+    unsigned depth;
+    unsigned queued;              /* in the submission ring, not yet submitted */
+    unsigned inflight;            /* submitted, not yet reaped */
+    int error;                    /* first failure since the last vsfs_ioq_wait() */
+    uint64_t submits;             /* io_uring_enter() calls */
+    void* sq_ring;                /* io_uring mappings and the ring indices inside them */
+    size_t sq_ring_len;
+    void* cq_ring;
+    size_t cq_ring_len;
+    void* sqes;
+    size_t sqes_len;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    void* cqes;
+    vsfs_ioq_slot_t* slots;       /* one per submission ring entry, indexed by user_data */
+    unsigned* free_slots;
+    unsigned nfree;
+} vsfs_ioq_t;
+
+/* depth 0, or a ring that cannot be set up, means synchronous writes, so this cannot fail. */
+void vsfs_ioq_init(vsfs_ioq_t* q, int fd, unsigned depth);
+/* Waits for anything still in flight; the descriptor itself is left open. */
+void vsfs_ioq_destroy(vsfs_ioq_t* q);
+/* "io_uring" or "pwritev", for messages. */
+const char* vsfs_ioq_backend(const vsfs_ioq_t* q);
+
+/* Queue a write; when the queue is full this first waits for one to complete. */
+int vsfs_ioq_writev(vsfs_ioq_t* q, const struct iovec* iov, int cnt, uint64_t offset);
+int vsfs_ioq_write(vsfs_ioq_t* q, const void* buf, uint64_t len, uint64_t offset);
+/* Hand every queued write to the kernel without waiting for any. */
+int vsfs_ioq_submit(vsfs_ioq_t* q);
+/* Submit and wait for every write; returns the first failure since the last wait. */
+int vsfs_ioq_wait(vsfs_ioq_t* q);
+
+#endif